@@ -13,6 +13,9 @@
 #include <variant>
 #include <iomanip>
 #include <random>
+#include <map>
+#include <deque>
+#include <cstdint>
 
 using namespace std;
 
@@ -39,6 +42,125 @@ arma::vec cross_product_3(arma::vec a,arma::vec b){
 	c(2)=a(0)*b(1)-a(1)*b(0);
 	return c;
 };
+/// cyclic Jacobi diagonalization of a batch of small hermitian matrices (i.e. the same TB hamiltonian at many k points)
+/// batch-last layout: the element (l,m) of the matrix b is at (l+dimension*m)*batch_dimension+b, so that every rotation is vectorized over the batch
+/// at the end the diagonal of hamiltonian contains the (unordered) eigenvalues, eigenvectors the corresponding columns
+/// if eigenvectors_real is NULL only the eigenvalues are computed (no accumulation of the rotations)
+/// each rotation is a phase on q (making a_pq real) followed by a real Jacobi rotation on (p,q)
+void jacobi_hermitian_eigensolver_batch(int dimension,int batch_dimension,double* hamiltonian_real,double* hamiltonian_imag,double* eigenvectors_real,double* eigenvectors_imag,double threshold,int max_sweeps){
+	std::vector<double> cos_rotation(batch_dimension);
+	std::vector<double> sin_rotation(batch_dimension);
+	std::vector<double> phase_real(batch_dimension);
+	std::vector<double> phase_imag(batch_dimension);
+	double* cos_r=cos_rotation.data();
+	double* sin_r=sin_rotation.data();
+	double* phase_r=phase_real.data();
+	double* phase_i=phase_imag.data();
+	bool computing_eigenvectors=(eigenvectors_real!=NULL);
+	
+	if(computing_eigenvectors){
+		for(int l=0;l<dimension;l++)
+			for(int m=0;m<dimension;m++){
+				#pragma omp simd
+				for(int b=0;b<batch_dimension;b++){
+					eigenvectors_real[(l+dimension*m)*batch_dimension+b]=(l==m)?1.0:0.0;
+					eigenvectors_imag[(l+dimension*m)*batch_dimension+b]=0.0;
+				}
+			}
+	}
+	double off_diagonal;
+	for(int sweep=0;sweep<max_sweeps;sweep++){
+		/// largest off-diagonal element among all the matrices of the batch
+		off_diagonal=0.0;
+		for(int p=0;p<dimension;p++)
+			for(int q=p+1;q<dimension;q++){
+				double* a_pq_r=hamiltonian_real+(p+dimension*q)*batch_dimension;
+				double* a_pq_i=hamiltonian_imag+(p+dimension*q)*batch_dimension;
+				#pragma omp simd reduction(max:off_diagonal)
+				for(int b=0;b<batch_dimension;b++)
+					off_diagonal=std::max(off_diagonal,a_pq_r[b]*a_pq_r[b]+a_pq_i[b]*a_pq_i[b]);
+			}
+		if(off_diagonal<threshold*threshold)
+			break;
+		for(int p=0;p<dimension;p++)
+			for(int q=p+1;q<dimension;q++){
+				double* a_pq_r=hamiltonian_real+(p+dimension*q)*batch_dimension;
+				double* a_pq_i=hamiltonian_imag+(p+dimension*q)*batch_dimension;
+				double* a_pp=hamiltonian_real+(p+dimension*p)*batch_dimension;
+				double* a_qq=hamiltonian_real+(q+dimension*q)*batch_dimension;
+				#pragma omp simd
+				for(int b=0;b<batch_dimension;b++){
+					double modulus=std::sqrt(a_pq_r[b]*a_pq_r[b]+a_pq_i[b]*a_pq_i[b]);
+					double modulus_safe=(modulus>1.0e-300)?modulus:1.0;
+					double theta=(a_qq[b]-a_pp[b])/(2.0*modulus_safe);
+					double t=((theta>=0.0)?1.0:-1.0)/(std::abs(theta)+std::sqrt(theta*theta+1.0));
+					double c=1.0/std::sqrt(t*t+1.0);
+					/// phase e^{-i arg(a_pq)}
+					cos_r[b]=(modulus>1.0e-300)?c:1.0;
+					sin_r[b]=(modulus>1.0e-300)?t*c:0.0;
+					phase_r[b]=(modulus>1.0e-300)?a_pq_r[b]/modulus_safe:1.0;
+					phase_i[b]=(modulus>1.0e-300)?-a_pq_i[b]/modulus_safe:0.0;
+				}
+				/// columns p and q of the hamiltonian
+				for(int l=0;l<dimension;l++){
+					double* a_lp_r=hamiltonian_real+(l+dimension*p)*batch_dimension;
+					double* a_lp_i=hamiltonian_imag+(l+dimension*p)*batch_dimension;
+					double* a_lq_r=hamiltonian_real+(l+dimension*q)*batch_dimension;
+					double* a_lq_i=hamiltonian_imag+(l+dimension*q)*batch_dimension;
+					#pragma omp simd
+					for(int b=0;b<batch_dimension;b++){
+						double x_r=a_lp_r[b]; double x_i=a_lp_i[b];
+						double y_r=phase_r[b]*a_lq_r[b]-phase_i[b]*a_lq_i[b];
+						double y_i=phase_r[b]*a_lq_i[b]+phase_i[b]*a_lq_r[b];
+						a_lp_r[b]=cos_r[b]*x_r-sin_r[b]*y_r; a_lp_i[b]=cos_r[b]*x_i-sin_r[b]*y_i;
+						a_lq_r[b]=sin_r[b]*x_r+cos_r[b]*y_r; a_lq_i[b]=sin_r[b]*x_i+cos_r[b]*y_i;
+					}
+				}
+				/// columns p and q of the eigenvectors
+				if(computing_eigenvectors){
+					for(int l=0;l<dimension;l++){
+						double* v_lp_r=eigenvectors_real+(l+dimension*p)*batch_dimension;
+						double* v_lp_i=eigenvectors_imag+(l+dimension*p)*batch_dimension;
+						double* v_lq_r=eigenvectors_real+(l+dimension*q)*batch_dimension;
+						double* v_lq_i=eigenvectors_imag+(l+dimension*q)*batch_dimension;
+						#pragma omp simd
+						for(int b=0;b<batch_dimension;b++){
+							double x_r=v_lp_r[b]; double x_i=v_lp_i[b];
+							double y_r=phase_r[b]*v_lq_r[b]-phase_i[b]*v_lq_i[b];
+							double y_i=phase_r[b]*v_lq_i[b]+phase_i[b]*v_lq_r[b];
+							v_lp_r[b]=cos_r[b]*x_r-sin_r[b]*y_r; v_lp_i[b]=cos_r[b]*x_i-sin_r[b]*y_i;
+							v_lq_r[b]=sin_r[b]*x_r+cos_r[b]*y_r; v_lq_i[b]=sin_r[b]*x_i+cos_r[b]*y_i;
+						}
+					}
+				}
+				/// rows p and q of the hamiltonian (conjugated phase)
+				for(int m=0;m<dimension;m++){
+					double* a_pm_r=hamiltonian_real+(p+dimension*m)*batch_dimension;
+					double* a_pm_i=hamiltonian_imag+(p+dimension*m)*batch_dimension;
+					double* a_qm_r=hamiltonian_real+(q+dimension*m)*batch_dimension;
+					double* a_qm_i=hamiltonian_imag+(q+dimension*m)*batch_dimension;
+					#pragma omp simd
+					for(int b=0;b<batch_dimension;b++){
+						double x_r=a_pm_r[b]; double x_i=a_pm_i[b];
+						double y_r=phase_r[b]*a_qm_r[b]+phase_i[b]*a_qm_i[b];
+						double y_i=phase_r[b]*a_qm_i[b]-phase_i[b]*a_qm_r[b];
+						a_pm_r[b]=cos_r[b]*x_r-sin_r[b]*y_r; a_pm_i[b]=cos_r[b]*x_i-sin_r[b]*y_i;
+						a_qm_r[b]=sin_r[b]*x_r+cos_r[b]*y_r; a_qm_i[b]=sin_r[b]*x_i+cos_r[b]*y_i;
+					}
+				}
+				/// removing the round-off on the rotated elements
+				double* a_qp_r=hamiltonian_real+(q+dimension*p)*batch_dimension;
+				double* a_qp_i=hamiltonian_imag+(q+dimension*p)*batch_dimension;
+				double* a_pp_i=hamiltonian_imag+(p+dimension*p)*batch_dimension;
+				double* a_qq_i=hamiltonian_imag+(q+dimension*q)*batch_dimension;
+				#pragma omp simd
+				for(int b=0;b<batch_dimension;b++){
+					a_pq_r[b]=0.0; a_pq_i[b]=0.0; a_qp_r[b]=0.0; a_qp_i[b]=0.0;
+					a_pp_i[b]=0.0; a_qq_i[b]=0.0;
+				}
+			}
+	}
+};
 
 /// START DEFINITION DIFFERENT CLASSES
 /// Crystal_Lattice class
@@ -139,6 +261,290 @@ void Crystal_Lattice::print()
 		cout << endl;
 	}
 };
+/// Sampling_Points class
+/// reproducible points in [0,1)^3 (and in a sphere) with weights
+/// sampling_type: 0 pseudo-random (mt19937_64), 1 Sobol (Joe-Kuo direction numbers, digital shift from the seed), 2 rank-1 (Kronecker) lattice with random shift, 3 stratified (one jittered point per cell)
+/// each call builds its own generator from (seed,stream), so different threads (streams) do not share any state
+class Sampling_Points
+{
+private:
+	int sampling_type;
+	unsigned long long seed;
+	unsigned int sobol_direction_numbers[3][32];
+public:
+	Sampling_Points(int sampling_type_tmp,unsigned long long seed_tmp);
+	/// (3 x number_points) points in [0,1)^3 and their weights (summing to 1); with sampling_type=3 the number of points is rounded to a cube
+	std::tuple<arma::mat,arma::vec> pull_points(int number_points,int stream);
+	/// points uniformly distributed in the sphere of radius radius (volume preserving map of the points in [0,1)^3)
+	std::tuple<arma::mat,arma::vec> pull_points_sphere(int number_points,double radius,int stream);
+	int pull_sampling_type(){
+		return sampling_type;
+	};
+};
+Sampling_Points::Sampling_Points(int sampling_type_tmp,unsigned long long seed_tmp){
+	sampling_type=sampling_type_tmp;
+	seed=seed_tmp;
+	/// direction numbers (Joe-Kuo): first dimension van der Corput, second s=1 a=0 m={1}, third s=2 a=1 m={1,3}
+	unsigned int m[3][32];
+	for(int j=0;j<32;j++)
+		m[0][j]=1;
+	m[1][0]=1;
+	for(int j=1;j<32;j++)
+		m[1][j]=(2*m[1][j-1])^m[1][j-1];
+	m[2][0]=1; m[2][1]=3;
+	for(int j=2;j<32;j++)
+		m[2][j]=(2*m[2][j-1])^(4*m[2][j-2])^m[2][j-2];
+	for(int d=0;d<3;d++)
+		for(int j=0;j<32;j++)
+			sobol_direction_numbers[d][j]=m[d][j]<<(31-j);
+};
+std::tuple<arma::mat,arma::vec> Sampling_Points::pull_points(int number_points,int stream){
+	std::mt19937_64 generator(seed+0x9E3779B97F4A7C15ULL*(unsigned long long)(stream+1));
+	std::uniform_real_distribution<double> distribution(0.0,1.0);
+	if(sampling_type==3){
+		int number_strata=std::max(1,int(std::floor(std::cbrt(double(number_points))+minval)));
+		int number_points_strata=number_strata*number_strata*number_strata;
+		arma::mat points(3,number_points_strata);
+		arma::vec weights(number_points_strata);
+		int counting=0;
+		for(int i=0;i<number_strata;i++)
+			for(int j=0;j<number_strata;j++)
+				for(int k=0;k<number_strata;k++){
+					points(0,counting)=(i+distribution(generator))/number_strata;
+					points(1,counting)=(j+distribution(generator))/number_strata;
+					points(2,counting)=(k+distribution(generator))/number_strata;
+					weights(counting)=1.0/number_points_strata;
+					counting++;
+				}
+		return {points,weights};
+	}
+	arma::mat points(3,number_points);
+	arma::vec weights(number_points);
+	for(int i=0;i<number_points;i++)
+		weights(i)=1.0/number_points;
+	if(sampling_type==0){
+		for(int i=0;i<number_points;i++)
+			for(int r=0;r<3;r++)
+				points(r,i)=distribution(generator);
+	}else if(sampling_type==1){
+		/// gray code construction, the point 0 is skipped; the digital shift is 0 if seed=0
+		unsigned int sobol_point[3]={0,0,0};
+		unsigned int digital_shift[3]={0,0,0};
+		if(seed!=0)
+			for(int r=0;r<3;r++)
+				digital_shift[r]=(unsigned int)(generator()>>32);
+		/// the stream starts from the point stream*number_points: x_n is the xor of the direction numbers of the bits of gray(n)
+		unsigned int first_index=(unsigned int)(stream*number_points);
+		unsigned int gray_code=first_index^(first_index>>1);
+		for(int j=0;j<32;j++)
+			if((gray_code>>j)&1u)
+				for(int r=0;r<3;r++)
+					sobol_point[r]^=sobol_direction_numbers[r][j];
+		for(int i=0;i<number_points;i++){
+			unsigned int index=first_index+(unsigned int)i;
+			int rightmost_zero=0;
+			while((index>>rightmost_zero)&1u)
+				rightmost_zero++;
+			for(int r=0;r<3;r++){
+				sobol_point[r]^=sobol_direction_numbers[r][rightmost_zero];
+				points(r,i)=double(sobol_point[r]^digital_shift[r])/4294967296.0;
+			}
+		}
+	}else if(sampling_type==2){
+		/// generating vector from the plastic number (x^4=x+1), random shift
+		double plastic_number=1.2207440846057594;
+		double generating_vector[3]={1.0/plastic_number,1.0/(plastic_number*plastic_number),1.0/(plastic_number*plastic_number*plastic_number)};
+		double random_shift[3];
+		for(int r=0;r<3;r++)
+			random_shift[r]=distribution(generator);
+		for(int i=0;i<number_points;i++)
+			for(int r=0;r<3;r++){
+				double value=random_shift[r]+(i+1)*generating_vector[r];
+				points(r,i)=value-std::floor(value);
+			}
+	}else
+		cout<<"ERROR!!!!!!! sampling type not implemented"<<endl;
+	return {points,weights};
+};
+std::tuple<arma::mat,arma::vec> Sampling_Points::pull_points_sphere(int number_points,double radius,int stream){
+	std::tuple<arma::mat,arma::vec> points_weights=pull_points(number_points,stream);
+	arma::mat points=get<0>(points_weights);
+	arma::mat points_sphere(3,points.n_cols);
+	double modulus; double cos_theta; double sin_theta; double phi;
+	for(int i=0;i<int(points.n_cols);i++){
+		modulus=radius*std::cbrt(points(0,i));
+		cos_theta=1.0-2.0*points(1,i);
+		sin_theta=std::sqrt(std::max(0.0,1.0-cos_theta*cos_theta));
+		phi=2.0*pigreco*points(2,i);
+		points_sphere(0,i)=modulus*sin_theta*std::cos(phi);
+		points_sphere(1,i)=modulus*sin_theta*std::sin(phi);
+		points_sphere(2,i)=modulus*cos_theta;
+	}
+	return {points_sphere,get<1>(points_weights)};
+};
+/// Mini_Brillouin_Zone class
+/// Wigner-Seitz cell of the k grid, i.e. the region around q=0 represented by the q=0 point of the grid
+/// the cell is split in pyramids with apex in 0 and basis on the faces: \int_{pyramid} f(\hat{q})/q^2 d^3q = h \int_{face} f(\hat{p})/p^2 dA (h distance of the face)
+/// so the singular averages become smooth surface integrals, evaluated with a fixed Gauss rule on the triangulated faces
+/// the faces are obtained clipping the bisector planes of the 26 neighbours (enough for a reduced basis of the grid)
+class Mini_Brillouin_Zone
+{
+private:
+	arma::mat mini_brillouin_zone_vectors{arma::mat(3,3)};
+	double volume;
+	double inscribed_radius;
+	arma::mat quadrature_points;
+	arma::vec quadrature_weights;
+	std::vector<arma::vec> function_clipping_polygon(std::vector<arma::vec> polygon,arma::vec normal,double offset);
+	arma::mat function_building_triangle(arma::vec vertex_0,arma::vec vertex_1,arma::vec vertex_2);
+public:
+	Mini_Brillouin_Zone(arma::mat mini_brillouin_zone_vectors_tmp,int number_subdivisions);
+	double pull_volume(){
+		return volume;
+	};
+	double pull_inscribed_radius(){
+		return inscribed_radius;
+	};
+	/// points p on the faces and weights w: \int_{cell} f(\hat{q})/q^2 d^3q = \sum w f(\hat{p})/p^2
+	std::tuple<arma::mat,arma::vec> pull_quadrature(){
+		return {quadrature_points,quadrature_weights};
+	};
+	/// points q and weights W in the cell: \int_{cell} f(q) d^3q = \sum W f(q) (Gauss-Legendre along the segments from 0 to the face points)
+	/// the weights go as q^2 close to 0, so f can diverge as 1/q^2 (i.e. the bare or truncated potentials)
+	std::tuple<arma::mat,arma::vec> pull_volume_quadrature();
+	/// 1/V \int_{cell} 1/q^2 d^3q
+	double pull_average_inverse_square();
+};
+Mini_Brillouin_Zone::Mini_Brillouin_Zone(arma::mat mini_brillouin_zone_vectors_tmp,int number_subdivisions){
+	mini_brillouin_zone_vectors=mini_brillouin_zone_vectors_tmp;
+	volume=std::abs(arma::det(mini_brillouin_zone_vectors));
+	double maximum_length=0.0;
+	for(int r=0;r<3;r++)
+		if(arma::norm(mini_brillouin_zone_vectors.col(r))>maximum_length)
+			maximum_length=arma::norm(mini_brillouin_zone_vectors.col(r));
+	arma::mat neighbours(3,26);
+	int count=0;
+	for(int m0=-1;m0<=1;m0++)
+		for(int m1=-1;m1<=1;m1++)
+			for(int m2=-1;m2<=1;m2++)
+				if(m0!=0||m1!=0||m2!=0){
+					neighbours.col(count)=m0*mini_brillouin_zone_vectors.col(0)+m1*mini_brillouin_zone_vectors.col(1)+m2*mini_brillouin_zone_vectors.col(2);
+					count++;
+				}
+	/// Dunavant rule of degree 5 on the triangle (barycentric coordinates and weights)
+	const double barycentric[7][3]={{1.0/3.0,1.0/3.0,1.0/3.0},
+		{0.059715871789770,0.470142064105115,0.470142064105115},{0.470142064105115,0.059715871789770,0.470142064105115},{0.470142064105115,0.470142064105115,0.059715871789770},
+		{0.797426985353087,0.101286507323456,0.101286507323456},{0.101286507323456,0.797426985353087,0.101286507323456},{0.101286507323456,0.101286507323456,0.797426985353087}};
+	const double weights[7]={0.225,0.132394152788506,0.132394152788506,0.132394152788506,0.125939180544827,0.125939180544827,0.125939180544827};
+
+	std::vector<arma::vec> points;
+	std::vector<double> points_weights;
+	inscribed_radius=maximum_length;
+	double volume_faces=0.0;
+	for(int j=0;j<26;j++){
+		arma::vec normal=neighbours.col(j)/arma::norm(neighbours.col(j));
+		double distance=arma::norm(neighbours.col(j))/2;
+		/// large square on the bisector plane, clipped by all the other bisector planes
+		arma::vec axis_1=arma::cross(normal,std::abs(normal(0))<0.9?arma::vec({1.0,0.0,0.0}):arma::vec({0.0,1.0,0.0}));
+		axis_1=axis_1/arma::norm(axis_1);
+		arma::vec axis_2=arma::cross(normal,axis_1);
+		std::vector<arma::vec> polygon;
+		polygon.push_back(distance*normal+4*maximum_length*(axis_1+axis_2));
+		polygon.push_back(distance*normal+4*maximum_length*(-axis_1+axis_2));
+		polygon.push_back(distance*normal+4*maximum_length*(-axis_1-axis_2));
+		polygon.push_back(distance*normal+4*maximum_length*(axis_1-axis_2));
+		for(int i=0;i<26&&polygon.size()>=3;i++)
+			if(i!=j)
+				polygon=function_clipping_polygon(polygon,neighbours.col(i)/arma::norm(neighbours.col(i)),arma::norm(neighbours.col(i))/2);
+		if(polygon.size()<3)
+			continue;
+		arma::vec centroid(3,arma::fill::zeros);
+		for(int v=0;v<int(polygon.size());v++)
+			centroid+=polygon[v]/double(polygon.size());
+		/// triangles of the fan from the centroid, each one subdivided number_subdivisions times in 4 triangles
+		std::vector<arma::mat> triangles;
+		for(int v=0;v<int(polygon.size());v++){
+			triangles.push_back(function_building_triangle(centroid,polygon[v],polygon[(v+1)%polygon.size()]));
+		}
+		for(int level=0;level<number_subdivisions;level++){
+			std::vector<arma::mat> triangles_subdivided;
+			for(int t=0;t<int(triangles.size());t++){
+				arma::vec middle_01=(triangles[t].col(0)+triangles[t].col(1))/2;
+				arma::vec middle_12=(triangles[t].col(1)+triangles[t].col(2))/2;
+				arma::vec middle_20=(triangles[t].col(2)+triangles[t].col(0))/2;
+				triangles_subdivided.push_back(function_building_triangle(triangles[t].col(0),middle_01,middle_20));
+				triangles_subdivided.push_back(function_building_triangle(middle_01,triangles[t].col(1),middle_12));
+				triangles_subdivided.push_back(function_building_triangle(middle_20,middle_12,triangles[t].col(2)));
+				triangles_subdivided.push_back(function_building_triangle(middle_01,middle_12,middle_20));
+			}
+			triangles=triangles_subdivided;
+		}
+		double area_face=0.0;
+		for(int t=0;t<int(triangles.size());t++){
+			double area=arma::norm(arma::cross(triangles[t].col(1)-triangles[t].col(0),triangles[t].col(2)-triangles[t].col(0)))/2;
+			area_face+=area;
+			for(int n=0;n<7;n++){
+				points.push_back(barycentric[n][0]*triangles[t].col(0)+barycentric[n][1]*triangles[t].col(1)+barycentric[n][2]*triangles[t].col(2));
+				points_weights.push_back(distance*area*weights[n]);
+			}
+		}
+		if(area_face>0.0&&distance<inscribed_radius)
+			inscribed_radius=distance;
+		volume_faces+=distance*area_face/3;
+	}
+	quadrature_points.set_size(3,points.size());
+	quadrature_weights.set_size(points.size());
+	for(int n=0;n<int(points.size());n++){
+		quadrature_points.col(n)=points[n];
+		quadrature_weights(n)=points_weights[n];
+	}
+	if(std::abs(volume_faces-volume)>1.0e-6*volume)
+		cout<<"ERROR!!!!!!! mini BZ faces volume "<<volume_faces<<" different from the cell volume "<<volume<<" (basis of the grid not reduced?)"<<endl;
+};
+arma::mat Mini_Brillouin_Zone::function_building_triangle(arma::vec vertex_0,arma::vec vertex_1,arma::vec vertex_2){
+	arma::mat triangle(3,3);
+	triangle.col(0)=vertex_0;
+	triangle.col(1)=vertex_1;
+	triangle.col(2)=vertex_2;
+	return triangle;
+};
+std::vector<arma::vec> Mini_Brillouin_Zone::function_clipping_polygon(std::vector<arma::vec> polygon,arma::vec normal,double offset){
+	/// keeping the part with normal*q<=offset (Sutherland-Hodgman)
+	std::vector<arma::vec> polygon_clipped;
+	int number_vertices=polygon.size();
+	for(int v=0;v<number_vertices;v++){
+		arma::vec vertex_1=polygon[v];
+		arma::vec vertex_2=polygon[(v+1)%number_vertices];
+		double side_1=arma::dot(normal,vertex_1)-offset;
+		double side_2=arma::dot(normal,vertex_2)-offset;
+		if(side_1<=0.0)
+			polygon_clipped.push_back(vertex_1);
+		if((side_1<0.0&&side_2>0.0)||(side_1>0.0&&side_2<0.0))
+			polygon_clipped.push_back(vertex_1+(side_1/(side_1-side_2))*(vertex_2-vertex_1));
+	}
+	return polygon_clipped;
+};
+std::tuple<arma::mat,arma::vec> Mini_Brillouin_Zone::pull_volume_quadrature(){
+	/// 8 points Gauss-Legendre on [0,1]; \int_{pyramid} f d^3q = h \int_{face} dA \int_0^1 t^2 f(t p) dt
+	const double nodes[8]={-0.9602898564975363,-0.7966664774136267,-0.5255324099163290,-0.1834346424956498,0.1834346424956498,0.5255324099163290,0.7966664774136267,0.9602898564975363};
+	const double weights[8]={0.1012285362903763,0.2223810344533745,0.3137066458778873,0.3626837833783620,0.3626837833783620,0.3137066458778873,0.2223810344533745,0.1012285362903763};
+	int number_points=quadrature_weights.n_elem;
+	arma::mat volume_points(3,8*number_points);
+	arma::vec volume_weights(8*number_points);
+	for(int n=0;n<number_points;n++)
+		for(int l=0;l<8;l++){
+			double t=(nodes[l]+1.0)/2;
+			volume_points.col(8*n+l)=t*quadrature_points.col(n);
+			volume_weights(8*n+l)=quadrature_weights(n)*t*t*weights[l]/2;
+		}
+	return {volume_points,volume_weights};
+};
+double Mini_Brillouin_Zone::pull_average_inverse_square(){
+	double average=0.0;
+	for(int n=0;n<int(quadrature_weights.n_elem);n++)
+		average+=quadrature_weights(n)/arma::dot(quadrature_points.col(n),quadrature_points.col(n));
+	return average/volume;
+};
 /// K_points class
 /// it is possible to define a list of k points directly from the BZ or as an input
 /// in the class K_points the points of FBZ are saved as k_points_list, while the points outside of the FBZ, defining the rest of the reciprocal lattice, are saved as g_points_list
@@ -152,18 +558,29 @@ private:
 	arma::mat k_points_list;
 	arma::vec shift{arma::vec(3)}; 
 	arma::vec direction_cutting{arma::vec(3)};
-	arma::mat k_point_differences;
+	/// folding of the k points modulo G: crystal coordinates (in [0,1), in units of resolution_folding) of k ---> index of k
+	std::map<std::tuple<long long,long long,long long>,int> k_points_folding;
+	double resolution_folding;
+	arma::ivec time_reversal_partners;
 public:
 	K_points(Crystal_Lattice *crystal_lattice,arma::vec shift_tmp,int number_k_points_list_tmp);
-	void push_k_points_list_values(string k_points_list_file_name,int crystal_coordinates,int random_generator);
-	///void push_k_points_list_values(double spacing_tmp,int dimension_tmp,arma::vec direction_cutting_tmp);
+	void push_k_points_list_values(string k_points_list_file_name,int crystal_coordinates,int random_generator,unsigned long long seed);
+	/// regular grid with the given spacing along the periodic directions (direction_cutting=1), a single point along the others
+	void push_k_points_list_values(double spacing_tmp,int dimension_tmp,arma::vec direction_cutting_tmp);
 	int pull_number_k_points_list();
 	arma::mat pull_k_points_list_values();
 	arma::mat pull_primitive_vectors();
 	arma::vec pull_shift();
-	arma::mat pull_k_point_differences(){
-		return k_point_differences;
-	}
+	/// table of the k points modulo G (used by the time reversal partners and by the nested grids)
+	void push_k_points_folding(double resolution_folding_tmp);
+	std::tuple<long long,long long,long long> function_building_folding_key(arma::vec k_point);
+	/// time reversal: index of the k point equal to -k (modulo G), -1 if not in the list
+	void push_time_reversal_partners(double resolution_folding_tmp);
+	arma::ivec pull_time_reversal_partners();
+	/// nested grids: for each k point, index of the same point (modulo G) in k_points_list_previous, -1 if it is a new point
+	arma::ivec pull_nested_grid_indexing(arma::mat k_points_list_previous,double resolution_folding_tmp);
+	/// vectors of the k grid (primitive vectors divided by the number of points along each direction)
+	arma::mat pull_mini_brillouin_zone_vectors();
 	void print();
 	~K_points(){
 		spacing=0;
@@ -171,16 +588,17 @@ public:
 	};
 };
 K_points::K_points(Crystal_Lattice *crystal_lattice,arma::vec shift_tmp,int number_k_points_list_tmp):
-k_points_list(3,number_k_points_list_tmp), k_point_differences(3,number_k_points_list_tmp*number_k_points_list_tmp)
+k_points_list(3,number_k_points_list_tmp)
 {
 	number_k_points_list=number_k_points_list_tmp;
+	resolution_folding=0.0;
 	shift=shift_tmp;
 	primitive_vectors=crystal_lattice->pull_primitive_vectors();
 };
 arma::mat K_points::pull_primitive_vectors(){
 	return primitive_vectors;
 };
-void K_points::push_k_points_list_values(string k_points_list_file_name,int crystal_coordinates,int random_generator){
+void K_points::push_k_points_list_values(string k_points_list_file_name,int crystal_coordinates,int random_generator,unsigned long long seed){
 	cout<<"number points "<<number_k_points_list<<endl;
 	if(random_generator==0){
 		ifstream k_points_list_file;
@@ -215,12 +633,17 @@ void K_points::push_k_points_list_values(string k_points_list_file_name,int crys
 			}
 		}
 	}else{
-		std::random_device rd;
-    	std::mt19937 gen(rd());
-   		std::uniform_real_distribution<> dis(-1.0,1.0); // distribution in range [-1,1]
+		/// random_generator-1 is the sampling type of Sampling_Points (1 pseudo-random, 2 Sobol, 3 rank-1 lattice, 4 stratified), in range [-1,1]
+		Sampling_Points sampling_points(random_generator-1,seed);
+		arma::mat sampled_points=get<0>(sampling_points.pull_points(number_k_points_list,0));
+		if(int(sampled_points.n_cols)!=number_k_points_list){
+			cout<<"Number of k points changed to "<<sampled_points.n_cols<<" by the stratified sampling"<<endl;
+			number_k_points_list=sampled_points.n_cols;
+			k_points_list.set_size(3,number_k_points_list);
+		}
 		for(int i=0;i<number_k_points_list;i++){
 			for(int r=0;r<3;r++)
-				k_points_list(r,i)=dis(gen)+shift(r);
+				k_points_list(r,i)=2.0*sampled_points(r,i)-1.0+shift(r);
 		}
 		if(crystal_coordinates==1){
 			arma::vec k_points_list_tmp(3);
@@ -235,40 +658,74 @@ void K_points::push_k_points_list_values(string k_points_list_file_name,int crys
 			}
 		}
 	}
-	for (int i = 0; i < number_k_points_list; i++)
-		for (int j = 0; j < number_k_points_list; j++)
-			for (int r = 0; r < 3; r++)
-				k_point_differences(r,i*number_k_points_list+j)=k_points_list(r,i)-k_points_list(r,j);
-};
-//void K_points::push_k_points_list_values(double spacing_tmp,int dimension_tmp,arma::vec direction_cutting_tmp){
-//	dimension=dimension_tmp;
-//	direction_cutting=direction_cutting_tmp;
-//	spacing=spacing_tmp;
-//	if(dimension==3){
-//		arma::vec vec_number_k_points_list(3);
-//		for (int i = 0; i < 3; i++)
-//			vec_number_k_points_list(i) = int(sqrt(accu(primitive_vectors.col(i) % primitive_vectors.col(i))) / spacing);
-//		int limiti = int(vec_number_k_points_list(0));
-//		int limitj = int(vec_number_k_points_list(1));
-//		int limitk = int(vec_number_k_points_list(2));
-//		number_k_points_list = limiti * limitj * limitk;
-//		k_points_list.set_size(3,number_k_points_list);
-//		int counting = 0;
-//		for (int i = 0; i < limiti; i++)
-//			for (int j = 0; j < limitj; j++)
-//				for (int k = 0; k < limitk; k++){
-//					for (int r = 0; r < 3; r++)
-//						k_points_list(r, counting) = ((double)i / limiti) * (shift(r) + primitive_vectors(r, 0)) + ((double)j / limitj) * (shift(r) + primitive_vectors(r, 1)) + ((double)k / limitk) * (shift(r) + primitive_vectors(r, 2));
-//					counting = counting + 1;
-//				}
-//	}
-//	k_point_differences.set_size(3,number_k_points_list*number_k_points_list);
-//	for (int i = 0; i < number_k_points_list; i++)
-//		for (int j = 0; j < number_k_points_list; j++)
-//			for (int r = 0; r < 3; r++)
-//				k_point_differences(r,i*number_k_points_list+j)=k_points_list(r,i)-k_points_list(r,j);
-//	///TO IMPLEMENT OTHER CONDITIONS
-//};
+};
+/// crystal coordinates of k_point folded in [0,1), in units of resolution_folding
+std::tuple<long long,long long,long long> K_points::function_building_folding_key(arma::vec k_point){
+	arma::vec k_point_crystal=arma::solve(primitive_vectors,k_point);
+	long long number_divisions=llround(1.0/resolution_folding);
+	long long key_component[3];
+	for(int r=0;r<3;r++){
+		key_component[r]=llround((k_point_crystal(r)-std::floor(k_point_crystal(r)))/resolution_folding)%number_divisions;
+		if(key_component[r]<0)
+			key_component[r]+=number_divisions;
+	}
+	return std::make_tuple(key_component[0],key_component[1],key_component[2]);
+};
+void K_points::push_k_points_folding(double resolution_folding_tmp){
+	resolution_folding=resolution_folding_tmp;
+	k_points_folding.clear();
+	for(int i=0;i<number_k_points_list;i++)
+		k_points_folding[function_building_folding_key(k_points_list.col(i))]=i;
+	cout<<"Folding k points: "<<k_points_folding.size()<<" different points (modulo G)"<<endl;
+};
+void K_points::push_time_reversal_partners(double resolution_folding_tmp){
+	push_k_points_folding(resolution_folding_tmp);
+	time_reversal_partners.set_size(number_k_points_list);
+	int number_pairs=0;
+	for(int i=0;i<number_k_points_list;i++){
+		std::map<std::tuple<long long,long long,long long>,int>::iterator found=k_points_folding.find(function_building_folding_key(-k_points_list.col(i)));
+		if(found==k_points_folding.end())
+			time_reversal_partners(i)=-1;
+		else{
+			time_reversal_partners(i)=found->second;
+			if(found->second>i)
+				number_pairs++;
+		}
+	}
+	cout<<"Time reversal: "<<number_pairs<<" pairs (k,-k) over "<<number_k_points_list<<" k points"<<endl;
+};
+arma::ivec K_points::pull_time_reversal_partners(){
+	return time_reversal_partners;
+};
+void K_points::push_k_points_list_values(double spacing_tmp,int dimension_tmp,arma::vec direction_cutting_tmp){
+	dimension=dimension_tmp;
+	direction_cutting=direction_cutting_tmp;
+	spacing=spacing_tmp;
+	arma::vec vec_number_k_points_list(3);
+	for (int i = 0; i < 3; i++){
+		if(dimension==3||direction_cutting(i)==1)
+			vec_number_k_points_list(i) = std::max(int(std::ceil(norm(primitive_vectors.col(i))/spacing)),1);
+		else
+			vec_number_k_points_list(i) = 1;
+	}
+	int limiti = int(vec_number_k_points_list(0));
+	int limitj = int(vec_number_k_points_list(1));
+	int limitk = int(vec_number_k_points_list(2));
+	number_k_points_list = limiti * limitj * limitk;
+	cout<<"k grid "<<limiti<<"x"<<limitj<<"x"<<limitk<<endl;
+	k_points_list.set_size(3,number_k_points_list);
+	int counting = 0;
+	for (int i = 0; i < limiti; i++)
+		for (int j = 0; j < limitj; j++)
+			for (int k = 0; k < limitk; k++){
+				for (int r = 0; r < 3; r++)
+					k_points_list(r, counting) = ((double)i / limiti) * primitive_vectors(r, 0) + ((double)j / limitj) * primitive_vectors(r, 1) + ((double)k / limitk) * primitive_vectors(r, 2) + shift(r);
+				counting = counting + 1;
+			}
+	/// the folding (if any) refers to the previous list
+	resolution_folding=0.0;
+	k_points_folding.clear();
+};
 arma::vec K_points::pull_shift(){
 	return shift;
 };
@@ -289,38 +746,165 @@ void K_points::print(){
 	}
 	cout<<endl;
 };
+arma::ivec K_points::pull_nested_grid_indexing(arma::mat k_points_list_previous,double resolution_folding_tmp){
+	if(resolution_folding==0.0)
+		push_k_points_folding(resolution_folding_tmp);
+	std::map<std::tuple<long long,long long,long long>,int> k_points_previous_folding;
+	for(int i=0;i<int(k_points_list_previous.n_cols);i++)
+		k_points_previous_folding[function_building_folding_key(k_points_list_previous.col(i))]=i;
+	arma::ivec nested_grid_indexing(number_k_points_list);
+	int number_nested=0;
+	for(int i=0;i<number_k_points_list;i++){
+		std::map<std::tuple<long long,long long,long long>,int>::iterator found=k_points_previous_folding.find(function_building_folding_key(k_points_list.col(i)));
+		if(found==k_points_previous_folding.end())
+			nested_grid_indexing(i)=-1;
+		else{
+			nested_grid_indexing(i)=found->second;
+			number_nested++;
+		}
+	}
+	cout<<"Nested grid: "<<number_nested<<" k points over "<<number_k_points_list<<" already calculated"<<endl;
+	return nested_grid_indexing;
+};
+arma::mat K_points::pull_mini_brillouin_zone_vectors(){
+	/// number of divisions from the smallest non-zero difference of crystal coordinates along each direction
+	arma::mat crystal_coordinates=arma::solve(primitive_vectors,k_points_list);
+	arma::vec number_divisions(3);
+	for(int r=0;r<3;r++){
+		double smallest_difference=1.0;
+		for(int i=1;i<number_k_points_list;i++){
+			double difference=crystal_coordinates(r,i)-crystal_coordinates(r,0);
+			difference=difference-std::floor(difference);
+			if(difference>1.0e-6&&difference<smallest_difference)
+				smallest_difference=difference;
+			if(1.0-difference>1.0e-6&&1.0-difference<smallest_difference)
+				smallest_difference=1.0-difference;
+		}
+		number_divisions(r)=std::round(1.0/smallest_difference);
+	}
+	/// not a regular grid: cell of the same volume as the one per k point
+	if(std::abs(number_divisions(0)*number_divisions(1)*number_divisions(2)-number_k_points_list)>0.5){
+		cout<<"k points not on a regular grid, isotropic mini BZ"<<endl;
+		for(int r=0;r<3;r++)
+			number_divisions(r)=std::cbrt(double(number_k_points_list));
+	}
+	arma::mat mini_brillouin_zone_vectors(3,3);
+	for(int r=0;r<3;r++)
+		mini_brillouin_zone_vectors.col(r)=primitive_vectors.col(r)/number_divisions(r);
+	return mini_brillouin_zone_vectors;
+};
+/// Ks_States_Store class
+/// persistent store (arma binary files) of the ks states (all bands, no shift) calculated on a k list
+/// a run on a larger nested grid (i.e. 16x16x16 containing 8x8x8) reuses them and diagonalizes only the new k points
+/// W is not stored: chi0 is a sum over the k list of the run, so W(k-k') of a coarser grid is not the one of the finer grid
+class Ks_States_Store
+{
+private:
+	string store_name;
+	arma::mat k_points_list_ks_states;
+	arma::cube ks_energies;
+	arma::cx_cube ks_states;
+	arma::ivec nested_indexing_ks_states;
+	/// setup of the run, saved with the data: (htb_basis_dimension,bands) of the ks states
+	arma::ivec dimensions_ks_states;
+public:
+	Ks_States_Store(string store_name_tmp);
+	/// reading the files (if present) and matching the stored k points with the ones of k_points
+	/// stored ks states of a different basis are not used and are overwritten
+	void load(K_points *k_points,double resolution_folding,int htb_basis_dimension,int number_bands);
+	/// saving (and keeping as the stored ones) the ks states of the whole list
+	void push_ks_states(arma::mat k_points_list_tmp,arma::cube ks_energies_tmp,arma::cx_cube ks_states_tmp);
+	arma::ivec pull_nested_indexing_ks_states(){
+		return nested_indexing_ks_states;
+	};
+	arma::mat pull_ks_energies(int index){
+		return ks_energies.slice(index);
+	};
+	arma::cx_mat pull_ks_states(int index){
+		return ks_states.slice(index);
+	};
+};
+Ks_States_Store::Ks_States_Store(string store_name_tmp){
+	store_name=store_name_tmp;
+};
+void Ks_States_Store::load(K_points *k_points,double resolution_folding,int htb_basis_dimension,int number_bands){
+	dimensions_ks_states.set_size(2);
+	dimensions_ks_states(0)=htb_basis_dimension;
+	dimensions_ks_states(1)=number_bands;
+	arma::ivec dimensions_stored;
+	int matching_ks_states=0;
+	if(dimensions_stored.load(store_name+"_dimensions_ks_states.bin")&&dimensions_stored.n_elem==2)
+		matching_ks_states=(dimensions_stored(0)==dimensions_ks_states(0)&&dimensions_stored(1)==dimensions_ks_states(1));
+	if(matching_ks_states==0)
+		cout<<"Stored ks states missing or of a different basis, not used"<<endl;
+	int number_k_points_list=k_points->pull_number_k_points_list();
+	arma::mat k_points_list=k_points->pull_k_points_list_values();
+	nested_indexing_ks_states.set_size(number_k_points_list);
+	for(int i=0;i<number_k_points_list;i++)
+		nested_indexing_ks_states(i)=-1;
+	if(matching_ks_states==1&&k_points_list_ks_states.load(store_name+"_k_points_ks_states.bin")&&ks_energies.load(store_name+"_ks_energies.bin")&&ks_states.load(store_name+"_ks_states.bin")
+		&&ks_states.n_slices==k_points_list_ks_states.n_cols&&int(ks_states.n_rows)==dimensions_ks_states(0)&&int(ks_states.n_cols)==dimensions_ks_states(1)){
+		cout<<"Reading stored ks states"<<endl;
+		nested_indexing_ks_states=k_points->pull_nested_grid_indexing(k_points_list_ks_states,resolution_folding);
+		/// points equal only modulo G are recalculated (the tb gauge is not periodic in general)
+		for(int i=0;i<number_k_points_list;i++)
+			if(nested_indexing_ks_states(i)>=0&&arma::norm(k_points_list_ks_states.col(nested_indexing_ks_states(i))-k_points_list.col(i))>resolution_folding)
+				nested_indexing_ks_states(i)=-1;
+	}
+};
+void Ks_States_Store::push_ks_states(arma::mat k_points_list_tmp,arma::cube ks_energies_tmp,arma::cx_cube ks_states_tmp){
+	k_points_list_ks_states=k_points_list_tmp;
+	ks_energies=ks_energies_tmp;
+	ks_states=ks_states_tmp;
+	nested_indexing_ks_states.set_size(k_points_list_tmp.n_cols);
+	for(int i=0;i<int(k_points_list_tmp.n_cols);i++)
+		nested_indexing_ks_states(i)=i;
+	k_points_list_ks_states.save(store_name+"_k_points_ks_states.bin");
+	ks_energies.save(store_name+"_ks_energies.bin");
+	ks_states.save(store_name+"_ks_states.bin");
+	dimensions_ks_states.save(store_name+"_dimensions_ks_states.bin");
+};
 /// G_points class
-/// the case one G point has to be properly implemented
+/// with cutoff 0 the list has only G=0
+/// cutoff_type: 0 box (2n+1 G along each direction), 1 sphere |G|<=cutoff, 2 kinetic energy hbar^2G^2/2m<=cutoff (eV)
+/// with the spherical cutoffs the G are sorted in shells of increasing |G| (G=0 first)
 class G_points
 {
 private:
 	int number_g_points_list;
 	arma::vec number_g_points_direction;
-	double** g_points_list;
+	arma::mat g_points_list;
+	int g_point_0;
 	double cutoff_g_points_list;
+	int cutoff_type;
 	int dimension_g_points_list;
 	arma::vec direction_cutting{arma::vec(3)};
 	arma::mat bravais_lattice{arma::mat(3,3)};
 	arma::vec shift{arma::vec(3)};
+	/// number of G (on each side) along the non-periodic directions, when dimension_g_points_list<3
+	int number_g_points_out_of_plane;
 public:
-	G_points(Crystal_Lattice *crystal_lattice,double cutoff_g_points_list_tmp,int dimension_g_points_list_tmp,arma::vec direction_cutting_tmp,arma::vec shift_tmp);
-	arma::mat pull_g_points_list_values();
+	G_points(Crystal_Lattice *crystal_lattice,double cutoff_g_points_list_tmp,int cutoff_type_tmp,int dimension_g_points_list_tmp,arma::vec direction_cutting_tmp,arma::vec shift_tmp,int number_g_points_out_of_plane_tmp);
+	const arma::mat& pull_g_points_list_values();
 	int pull_number_g_points_list();
+	/// index of G=0 in the list
+	int pull_g_point_0();
+	/// keeping only the first number_g_points_list_tmp G by |G| (i.e. the converged shells of Dielectric_Function::pull_converged_g_shells)
+	void push_number_g_points_list(int number_g_points_list_tmp);
 	void print();
 	~G_points(){
 		number_g_points_list=0;
 		cutoff_g_points_list=0.0;
 		dimension_g_points_list=0;
-		for(int r=0;r<3;r++)
-			delete[] g_points_list[r];
-		delete[] g_points_list;
 	};
 };
-G_points::G_points(Crystal_Lattice *crystal_lattice,double cutoff_g_points_list_tmp,int dimension_g_points_list_tmp,arma::vec direction_cutting_tmp,arma::vec shift_tmp){
+G_points::G_points(Crystal_Lattice *crystal_lattice,double cutoff_g_points_list_tmp,int cutoff_type_tmp,int dimension_g_points_list_tmp,arma::vec direction_cutting_tmp,arma::vec shift_tmp,int number_g_points_out_of_plane_tmp){
 	dimension_g_points_list=dimension_g_points_list_tmp;
 	direction_cutting=direction_cutting_tmp;
 	cutoff_g_points_list=cutoff_g_points_list_tmp;
+	cutoff_type=cutoff_type_tmp;
 	shift=shift_tmp;
+	number_g_points_out_of_plane=number_g_points_out_of_plane_tmp;
 
 	arma::mat primitive_vectors=crystal_lattice->pull_primitive_vectors();
 	bravais_lattice=crystal_lattice->pull_bravais_lattice();
@@ -328,81 +912,112 @@ G_points::G_points(Crystal_Lattice *crystal_lattice,double cutoff_g_points_list_
 	for(int i=0;i<3;i++)
 		for(int j=0;j<3;j++)
 			cout<<dot(bravais_lattice.col(j),primitive_vectors.col(i))/(2*pigreco)<<endl;
+	/// |G| corresponding to the cutoff (hbar^2/2m=3.80998 eV A^2)
 	double max_g_value=cutoff_g_points_list;
+	if(cutoff_type==2)
+		max_g_value=std::sqrt(cutoff_g_points_list/3.80998);
 	cout<<"Calculating g values..."<<endl;
+	/// along the periodic directions (direction_cutting=1) the G are up to the cutoff,
+	/// along the non-periodic ones (dimension_g_points_list<3) only number_g_points_out_of_plane on each side (0: only the plane)
+	number_g_points_direction.zeros(3);
 	if(cutoff_g_points_list!=0){
-		if(dimension_g_points_list==3){
-			number_g_points_direction.zeros(3);
-			number_g_points_list=1;
-			for(int i=0;i<3;i++){
+		int number_periodic_directions=0;
+		for(int i=0;i<3;i++)
+			if(direction_cutting(i)==1)
+				number_periodic_directions++;
+		if(dimension_g_points_list<3&&dimension_g_points_list!=number_periodic_directions)
+			cout<<"ERROR!!!!!!! dimension G points "<<dimension_g_points_list<<" different from the periodic directions "<<number_periodic_directions<<endl;
+		for(int i=0;i<3;i++){
+			if(dimension_g_points_list<3&&direction_cutting(i)==0)
+				number_g_points_direction(i)=number_g_points_out_of_plane;
+			else if(cutoff_type==0)
 				number_g_points_direction(i)=int(max_g_value/norm(primitive_vectors.col(i),2));
-				number_g_points_list=number_g_points_list*(2*number_g_points_direction(i)+1);
-			}
-			g_points_list=new double*[3];
-			for(int s=0;s<3;s++)
-				g_points_list[s]=new double[number_g_points_list];
-			int counting=0;	
-			for (int i = -number_g_points_direction(0); i <= number_g_points_direction(0); i++)
-				for (int j = -number_g_points_direction(1); j <= number_g_points_direction(1); j++)
-					for (int k = -number_g_points_direction(2); k <= number_g_points_direction(2); k++){
-							for (int r = 0; r < 3; r++)
-								g_points_list[r][counting] =  i * (shift(r) + primitive_vectors(r, 0)) + j * (shift(r) + primitive_vectors(r, 1)) + k * (shift(r) + primitive_vectors(r, 2));
-							counting = counting + 1;
-					}
-		}else if(dimension_g_points_list==2){
-			number_g_points_direction.zeros(2);
-			arma::mat reciprocal_plane_along; reciprocal_plane_along.zeros(3,2);
-			int counting=0;
-			number_g_points_list=0;
-			for(int i=0;i<3;i++)
-				if(direction_cutting(i)==1){
-					reciprocal_plane_along.col(counting)=primitive_vectors.col(i);
-					number_g_points_direction(counting)=int(max_g_value/norm(primitive_vectors.col(i),2));
-					number_g_points_list=number_g_points_list*(2*number_g_points_direction(i)+1);
-					cout<<number_g_points_direction(counting)<<endl;
-					counting++;
-				}
-			g_points_list=new double*[3];
-			for(int s=0;s<3;s++)
-				g_points_list[s]=new double[number_g_points_list];
-			counting = 1;
-			for (int i = -number_g_points_direction(0); i <= number_g_points_direction(0); i++)
-				for (int j = -number_g_points_direction(1); j <= number_g_points_direction(1); j++){
-					//if((i!=0)||(j!=0)){
-						for (int r = 0; r < 3; r++)
-							g_points_list[r][counting] = i * (shift(r) + reciprocal_plane_along(r, 0)) + j * (shift(r) + reciprocal_plane_along(r, 1));
-						//cout<<g_points_list.col(count)<<endl;
-						counting = counting + 1;
-					//}else
-					//	for (int r = 0; r < 3; r++)
-					//		g_points_list(r, 0) = 0.0;
-				}
-		}else{
-		/// TO IMPLEMENT OTHER CASE
-		cout<<"TO IMPLEMENT"<<endl;
+			else
+				/// |m_i|=|G.a_i|/2pi<=|G||a_i|/2pi: the box containing the sphere
+				number_g_points_direction(i)=int(max_g_value*norm(bravais_lattice.col(i),2)/(2*pigreco));
 		}
 	}
+	int number_g_points_box=(2*number_g_points_direction(0)+1)*(2*number_g_points_direction(1)+1)*(2*number_g_points_direction(2)+1);
+	arma::mat g_points_box(3,number_g_points_box);
+	arma::vec modulus_g_points_box(number_g_points_box);
+	int counting=0;	
+	for (int i = -number_g_points_direction(0); i <= number_g_points_direction(0); i++)
+		for (int j = -number_g_points_direction(1); j <= number_g_points_direction(1); j++)
+			for (int k = -number_g_points_direction(2); k <= number_g_points_direction(2); k++){
+					for (int r = 0; r < 3; r++)
+						g_points_box(r,counting) =  i * (shift(r) + primitive_vectors(r, 0)) + j * (shift(r) + primitive_vectors(r, 1)) + k * (shift(r) + primitive_vectors(r, 2));
+					modulus_g_points_box(counting)=norm(g_points_box.col(counting));
+					counting = counting + 1;
+			}
+	if(cutoff_type==0||cutoff_g_points_list==0){
+		g_points_list=g_points_box;
+	}else{
+		/// shells of increasing |G| (stable: the order of the box inside a shell), keeping only |G|<=cutoff
+		arma::uvec sorting=arma::stable_sort_index(modulus_g_points_box);
+		int number_inside=0;
+		for(int n=0;n<number_g_points_box;n++)
+			if(modulus_g_points_box(n)<=max_g_value*(1.0+minval))
+				number_inside++;
+		g_points_list.set_size(3,number_inside);
+		for(int n=0;n<number_inside;n++)
+			g_points_list.col(n)=g_points_box.col(sorting(n));
+	}
+	number_g_points_list=g_points_list.n_cols;
+	g_point_0=-1;
+	for(int n=0;n<number_g_points_list;n++)
+		if(norm(g_points_list.col(n))<minval)
+			g_point_0=n;
+	if(g_point_0<0)
+		cout<<"ERROR!!!!!!! G=0 not in the list"<<endl;
+	cout<<"G points along each direction "<<number_g_points_direction.t()<<" inside the cutoff "<<number_g_points_list<<" over "<<number_g_points_box<<endl;
 };
-arma::mat G_points::pull_g_points_list_values(){
-	arma::mat g_points_list_new(3,number_g_points_list);
-	for(int r=0;r<3;r++)
-		for(int s=0;s<number_g_points_list;s++)
-			g_points_list_new(r,s)=g_points_list[r][s];
-
-	return g_points_list_new;
+const arma::mat& G_points::pull_g_points_list_values(){
+	return g_points_list;
 };
 int G_points::pull_number_g_points_list(){
 	return number_g_points_list;
 };
+int G_points::pull_g_point_0(){
+	return g_point_0;
+};
+void G_points::push_number_g_points_list(int number_g_points_list_tmp){
+	if(number_g_points_list_tmp<1||number_g_points_list_tmp>number_g_points_list){
+		cout<<"ERROR!!!!!!! number of G "<<number_g_points_list_tmp<<" not in the list of "<<number_g_points_list<<", list not changed"<<endl;
+		return;
+	}
+	/// same (stable) order by |G| of pull_converged_g_shells (the lists of the spherical cutoffs are already in this order)
+	arma::vec modulus_g_points(number_g_points_list);
+	for(int n=0;n<number_g_points_list;n++)
+		modulus_g_points(n)=norm(g_points_list.col(n));
+	arma::uvec sorting=arma::stable_sort_index(modulus_g_points);
+	arma::mat g_points_list_sorted(3,number_g_points_list_tmp);
+	for(int n=0;n<number_g_points_list_tmp;n++)
+		g_points_list_sorted.col(n)=g_points_list.col(sorting(n));
+	g_points_list=g_points_list_sorted;
+	number_g_points_list=number_g_points_list_tmp;
+	g_point_0=-1;
+	for(int n=0;n<number_g_points_list;n++)
+		if(norm(g_points_list.col(n))<minval)
+			g_point_0=n;
+	cout<<"G points kept "<<number_g_points_list<<endl;
+};
 void G_points::print(){
 	cout << "G points list "<<number_g_points_list << endl;
 	for (int i = 0; i < number_g_points_list; i++){
 		cout << " ( ";
 		for (int r = 0; r < 3; r++)
-			cout << i<<" "<< g_points_list[r, i] << " ";
+			cout << i<<" "<< g_points_list(r,i) << " ";
 		cout << " ) " << endl;
 	}
 };
+/// index of G=0 in a list of G (the list of G_points, as passed to the other classes)
+int function_finding_g_point_0(const arma::mat& g_points_list){
+	for(int n=0;n<int(g_points_list.n_cols);n++)
+		if(arma::norm(g_points_list.col(n))<minval)
+			return n;
+	cout<<"ERROR!!!!!!! G=0 not in the list"<<endl;
+	return 0;
+};
 /// Hamiltonian_TB class
 class Hamiltonian_TB
 {
@@ -422,6 +1037,9 @@ private:
 	double little_shift;
 	double scissor_operator;
 	arma::mat bravais_lattice{arma::mat(3,3)};
+	/// below this number of wannier functions the batched Jacobi eigensolver is used instead of LAPACK
+	int threshold_batch_eigensolver;
+	int batch_eigensolver_dimension;
 public:
 	Hamiltonian_TB(){
 		number_wannier_functions = 0;
@@ -430,12 +1048,34 @@ public:
 		fermi_energy = 0;
 		number_primitive_cells = 0;
 		dynamic_shifting = false;
+		threshold_batch_eigensolver = 16;
+		batch_eigensolver_dimension = 64;
 	};
 	/// reading hamiltonian from wannier90 output
 	Hamiltonian_TB(string wannier90_hr_file_name,string wannier90_centers_file_name,double fermi_energy_tmp,int spinorial_calculation_tmp,int number_atoms_tmp,bool dynamic_shifting_tmp,double little_shift_tmp,double scissor_operator_tmp,arma::mat bravais_lattice_tmp,int number_primitive_cells_tmp,int number_wannier_functions_tmp,int looking_from_fermi_tmp);
 	arma::field<arma::cx_mat> FFT(arma::vec k_point);
 	std::tuple<arma::mat,arma::cx_mat> pull_ks_states(arma::vec k_point);
 	std::tuple<arma::mat,arma::cx_mat> pull_ks_states_subset(arma::vec k_point,int number_valence_bands_selected,int number_conduction_bands_selected);
+	/// derivative of H(k) along direction: \sum_R w_R H_R i(direction.R) e^{ikR}
+	arma::field<arma::cx_mat> FFT_derivative(arma::vec k_point,arma::vec direction);
+	/// first-order k.p states and energies at k+shift, starting from all the ks states at k (as given by pull_ks_states)
+	std::tuple<arma::mat,arma::cx_mat> pull_ks_states_perturbative(arma::vec k_point,arma::vec shift,std::tuple<arma::mat,arma::cx_mat> ks_states,double threshold_degeneracy);
+	std::tuple<arma::mat,arma::cx_mat> extract_ks_states_subset(std::tuple<arma::mat,arma::cx_mat> ks_states,int number_valence_bands_selected,int number_conduction_bands_selected);
+	/// H(k) for all the columns of k_points at once (one GEMM): for each spin channel a (number k points)x(W*W) matrix, column l+W*m
+	arma::field<arma::cx_mat> FFT_batch(arma::mat k_points);
+	/// same output of pull_ks_states and pull_ks_states_subset, one slice per column of k_points
+	std::tuple<arma::cube,arma::cx_cube> pull_ks_states_batch(arma::mat k_points);
+	std::tuple<arma::cube,arma::cx_cube> pull_ks_states_subset_batch(arma::mat k_points,int number_valence_bands_selected,int number_conduction_bands_selected);
+	void push_batch_eigensolver(int threshold_batch_eigensolver_tmp,int batch_eigensolver_dimension_tmp);
+	/// 1 if H(-k)=H(k)^* (spinorial_calculation=0 and all the H_R real within threshold), 0 otherwise
+	int pull_time_reversal_symmetry(double threshold);
+	/// energies only (no eigenvectors), for bands and energy windows
+	int pull_number_valence_bands(arma::mat ks_eigenvalues,int number_conduction_bands_selected);
+	arma::mat extract_energies_subset(arma::mat ks_eigenvalues,int number_valence_bands_selected,int number_conduction_bands_selected);
+	arma::mat pull_energies(arma::vec k_point);
+	arma::mat pull_energies_subset(arma::vec k_point,int number_valence_bands_selected,int number_conduction_bands_selected);
+	arma::cube pull_energies_batch(arma::mat k_points);
+	arma::cube pull_energies_subset_batch(arma::mat k_points,int number_valence_bands_selected,int number_conduction_bands_selected);
 	arma::field<arma::cx_cube> pull_hamiltonian();
 	int pull_htb_basis_dimension();
 	int pull_number_wannier_functions();
@@ -446,7 +1086,7 @@ public:
 	arma::mat pull_bravais_lattice(){
 		return bravais_lattice;
 	};
-	void pull_bands(string bands_file_name,string k_points_bands_file_name,int number_k_points_bands, int number_valence_bands_selected,int number_conduction_bands_selected, int crystal_coordinates,arma::mat primitive_vectors);
+	void pull_bands(string bands_file_name,string k_points_bands_file_name,int number_k_points_bands, int number_valence_bands_selected,int number_conduction_bands_selected, int crystal_coordinates,arma::mat primitive_vectors,int binary_output);
 	void print();
 	~Hamiltonian_TB(){
 		number_wannier_functions = 0;
@@ -468,6 +1108,8 @@ weights_primitive_cells(number_primitive_cells_tmp), positions_primitive_cells(3
 	spinorial_calculation=spinorial_calculation_tmp;
 	dynamic_shifting=dynamic_shifting_tmp;
 	scissor_operator=scissor_operator_tmp;
+	threshold_batch_eigensolver=16;
+	batch_eigensolver_dimension=64;
 	bravais_lattice=bravais_lattice_tmp;
 	ifstream wannier90_hr_file;
 	ifstream wannier90_centers_file;
@@ -775,102 +1417,389 @@ std::tuple<arma::mat, arma::cx_mat> Hamiltonian_TB::pull_ks_states(arma::vec k_p
 		return {ks_eigenvalues_spinor, ks_eigenvectors_spinor};
 	}
 };
-std::tuple<arma::mat,arma::cx_mat> Hamiltonian_TB::pull_ks_states_subset(arma::vec k_point,int number_valence_bands_selected,int number_conduction_bands_selected){
-	int number_valence_bands = 0;
-	int number_conduction_bands = 0;
-	int dimensions_subspace = number_conduction_bands_selected + number_valence_bands_selected;
-	arma::vec spinor_scissor_operator(2);
-	spinor_scissor_operator(0)=scissor_operator;
-	spinor_scissor_operator(1)=scissor_operator;
-	
-	std::tuple<arma::mat,arma::cx_mat> ks_states=pull_ks_states(k_point);
+arma::field<arma::cx_mat> Hamiltonian_TB::FFT_derivative(arma::vec k_point,arma::vec direction){
+	arma::field<arma::cx_mat> fft_hamiltonian_derivative(spinorial_calculation+1);
+	arma::cx_vec phase_factor(number_primitive_cells);
+	double variable_tmp;
+	double projection_tmp;
+	/// i(direction.R) w_R e^{ikR}
+	for (int r = 0; r < number_primitive_cells; r++){
+		variable_tmp=0.0;
+		projection_tmp=0.0;
+		for(int s = 0; s < 3; s++){
+			variable_tmp+=k_point(s)*positions_primitive_cells(s,r);
+			projection_tmp+=direction(s)*positions_primitive_cells(s,r);
+		}
+		phase_factor(r).real(-projection_tmp*weights_primitive_cells(r)*std::sin(variable_tmp));
+		phase_factor(r).imag(projection_tmp*weights_primitive_cells(r)*std::cos(variable_tmp));
+	}
+	for(int spin_channel=0;spin_channel<(spinorial_calculation+1);spin_channel++){
+		fft_hamiltonian_derivative(spin_channel).zeros(number_wannier_functions,number_wannier_functions);
+		for (int r = 0; r < number_primitive_cells; r++)
+			fft_hamiltonian_derivative(spin_channel)+=phase_factor(r)*hamiltonian(spin_channel).slice(r);
+	}
+	return fft_hamiltonian_derivative;
+};
+/// first order k.p perturbation theory: H(k+shift)=H(k)+shift.dH/dk
+/// E_n(k+shift)=E_n(k)+<n|shift.dH/dk|n>
+/// |n(k+shift)>=|n>+\sum_{m!=n}|m><m|shift.dH/dk|n>/(E_n-E_m)
+/// the correction is orthogonal to |n> (parallel transport gauge), so that the phase of the perturbed state is the one of the state at k
+/// couples of (quasi)degenerate states (|E_n-E_m|<threshold_degeneracy) are not mixed
+/// the perturbed states are sorted by their first order energies, as the ones of pull_ks_states
+std::tuple<arma::mat,arma::cx_mat> Hamiltonian_TB::pull_ks_states_perturbative(arma::vec k_point,arma::vec shift,std::tuple<arma::mat,arma::cx_mat> ks_states,double threshold_degeneracy){
 	arma::mat ks_eigenvalues=get<0>(ks_states);
 	arma::cx_mat ks_eigenvectors=get<1>(ks_states);
+	arma::mat ks_eigenvalues_perturbed(2,number_wannier_functions,arma::fill::zeros);
+	arma::cx_mat ks_eigenvectors_perturbed(htb_basis_dimension,number_wannier_functions,arma::fill::zeros);
+
+	arma::field<arma::cx_mat> fft_hamiltonian_derivative=FFT_derivative(k_point,shift);
+	arma::cx_mat eigenvectors_spin_channel(number_wannier_functions,number_wannier_functions);
+	arma::cx_mat perturbation_eigenbasis(number_wannier_functions,number_wannier_functions);
+	arma::cx_vec eigenvector_perturbed(number_wannier_functions);
+	double energy_difference;
+	for(int spin_channel=0;spin_channel<(spinorial_calculation+1);spin_channel++){
+		eigenvectors_spin_channel=ks_eigenvectors.rows(spin_channel*number_wannier_functions,(spin_channel+1)*number_wannier_functions-1);
+		perturbation_eigenbasis=eigenvectors_spin_channel.t()*fft_hamiltonian_derivative(spin_channel)*eigenvectors_spin_channel;
+		for(int n=0;n<number_wannier_functions;n++){
+			eigenvector_perturbed=eigenvectors_spin_channel.col(n);
+			for(int m=0;m<number_wannier_functions;m++){
+				energy_difference=ks_eigenvalues(spin_channel,n)-ks_eigenvalues(spin_channel,m);
+				if(m!=n&&std::abs(energy_difference)>threshold_degeneracy)
+					eigenvector_perturbed+=eigenvectors_spin_channel.col(m)*(perturbation_eigenbasis(m,n)/energy_difference);
+			}
+			ks_eigenvectors_perturbed.submat(spin_channel*number_wannier_functions,n,(spin_channel+1)*number_wannier_functions-1,n)=eigenvector_perturbed/arma::vecnorm(eigenvector_perturbed);
+			if(spinorial_calculation==1)
+				ks_eigenvalues_perturbed(spin_channel,n)=ks_eigenvalues(spin_channel,n)+std::real(perturbation_eigenbasis(n,n));
+			else
+				for(int r=0;r<2;r++)
+					ks_eigenvalues_perturbed(r,n)=ks_eigenvalues(r,n)+std::real(perturbation_eigenbasis(n,n));
+		}
+		/// increasing energies as the states of the exact diagonalization (the first order energies of close bands can cross)
+		arma::uvec ordering=arma::sort_index(ks_eigenvalues_perturbed.row(spin_channel).t());
+		arma::mat ks_eigenvalues_unsorted=ks_eigenvalues_perturbed;
+		arma::cx_mat eigenvectors_unsorted=ks_eigenvectors_perturbed.rows(spin_channel*number_wannier_functions,(spin_channel+1)*number_wannier_functions-1);
+		for(int n=0;n<number_wannier_functions;n++){
+			ks_eigenvectors_perturbed.submat(spin_channel*number_wannier_functions,n,(spin_channel+1)*number_wannier_functions-1,n)=eigenvectors_unsorted.col(ordering(n));
+			for(int r=0;r<2;r++)
+				if(spinorial_calculation==0||r==spin_channel)
+					ks_eigenvalues_perturbed(r,n)=ks_eigenvalues_unsorted(r,ordering(n));
+		}
+	}
+	return {ks_eigenvalues_perturbed,ks_eigenvectors_perturbed};
+};
+int Hamiltonian_TB::pull_time_reversal_symmetry(double threshold){
+	if(spinorial_calculation!=0)
+		return 0;
+	for(int r=0;r<number_primitive_cells;r++)
+		for(int l=0;l<number_wannier_functions;l++)
+			for(int m=0;m<number_wannier_functions;m++)
+				if(std::abs(std::imag(hamiltonian(0)(l,m,r)))>threshold)
+					return 0;
+	return 1;
+};
+void Hamiltonian_TB::push_batch_eigensolver(int threshold_batch_eigensolver_tmp,int batch_eigensolver_dimension_tmp){
+	threshold_batch_eigensolver=threshold_batch_eigensolver_tmp;
+	batch_eigensolver_dimension=batch_eigensolver_dimension_tmp;
+};
+arma::field<arma::cx_mat> Hamiltonian_TB::FFT_batch(arma::mat k_points){
+	int number_k_points=k_points.n_cols;
+	arma::field<arma::cx_mat> fft_hamiltonian_batch(spinorial_calculation+1);
+	/// w_R e^{ikR}
+	arma::cx_mat phase_factor(number_k_points,number_primitive_cells);
+	#pragma omp parallel for
+	for(int i=0;i<number_k_points;i++)
+		for(int r=0;r<number_primitive_cells;r++){
+			double variable_tmp=0.0;
+			for(int s=0;s<3;s++)
+				variable_tmp+=k_points(s,i)*positions_primitive_cells(s,r);
+			phase_factor(i,r).real(weights_primitive_cells(r)*std::cos(variable_tmp));
+			phase_factor(i,r).imag(weights_primitive_cells(r)*std::sin(variable_tmp));
+		}
+	for(int spin_channel=0;spin_channel<(spinorial_calculation+1);spin_channel++){
+		/// every slice of the hamiltonian becomes a column
+		arma::cx_mat hamiltonian_flat(hamiltonian(spin_channel).memptr(),number_wannier_functions*number_wannier_functions,number_primitive_cells);
+		fft_hamiltonian_batch(spin_channel)=phase_factor*hamiltonian_flat.st();
+	}
+	return fft_hamiltonian_batch;
+};
+std::tuple<arma::cube,arma::cx_cube> Hamiltonian_TB::pull_ks_states_batch(arma::mat k_points){
+	int number_k_points=k_points.n_cols;
+	int dimension_square=number_wannier_functions*number_wannier_functions;
+	arma::cube ks_eigenvalues_spinor(2,number_wannier_functions,number_k_points,arma::fill::zeros);
+	arma::cx_cube ks_eigenvectors_spinor(htb_basis_dimension,number_wannier_functions,number_k_points,arma::fill::zeros);
+	arma::field<arma::cx_mat> fft_hamiltonian_batch=FFT_batch(k_points);
 
+	for(int spin_channel=0;spin_channel<(spinorial_calculation+1);spin_channel++){
+		if(number_wannier_functions<=threshold_batch_eigensolver){
+			int number_batches=(number_k_points+batch_eigensolver_dimension-1)/batch_eigensolver_dimension;
+			#pragma omp parallel for schedule(dynamic)
+			for(int batch=0;batch<number_batches;batch++){
+				int first_k_point=batch*batch_eigensolver_dimension;
+				int batch_dimension=std::min(batch_eigensolver_dimension,number_k_points-first_k_point);
+				std::vector<double> hamiltonian_real(dimension_square*batch_dimension);
+				std::vector<double> hamiltonian_imag(dimension_square*batch_dimension);
+				std::vector<double> eigenvectors_real(dimension_square*batch_dimension);
+				std::vector<double> eigenvectors_imag(dimension_square*batch_dimension);
+				for(int lm=0;lm<dimension_square;lm++)
+					for(int b=0;b<batch_dimension;b++){
+						hamiltonian_real[lm*batch_dimension+b]=std::real(fft_hamiltonian_batch(spin_channel)(first_k_point+b,lm));
+						hamiltonian_imag[lm*batch_dimension+b]=std::imag(fft_hamiltonian_batch(spin_channel)(first_k_point+b,lm));
+					}
+				jacobi_hermitian_eigensolver_batch(number_wannier_functions,batch_dimension,hamiltonian_real.data(),hamiltonian_imag.data(),eigenvectors_real.data(),eigenvectors_imag.data(),1.0e-12,50);
+				arma::vec eigenvalues(number_wannier_functions);
+				arma::uvec ordering;
+				for(int b=0;b<batch_dimension;b++){
+					for(int i=0;i<number_wannier_functions;i++)
+						eigenvalues(i)=hamiltonian_real[(i+number_wannier_functions*i)*batch_dimension+b];
+					ordering=arma::sort_index(eigenvalues);
+					for(int i=0;i<number_wannier_functions;i++){
+						for(int l=0;l<number_wannier_functions;l++){
+							ks_eigenvectors_spinor(spin_channel*number_wannier_functions+l,i,first_k_point+b).real(eigenvectors_real[(l+number_wannier_functions*ordering(i))*batch_dimension+b]);
+							ks_eigenvectors_spinor(spin_channel*number_wannier_functions+l,i,first_k_point+b).imag(eigenvectors_imag[(l+number_wannier_functions*ordering(i))*batch_dimension+b]);
+						}
+						for(int r=0;r<2;r++)
+							if(spinorial_calculation==0||r==spin_channel)
+								ks_eigenvalues_spinor(r,i,first_k_point+b)=eigenvalues(ordering(i));
+					}
+				}
+			}
+		}else{
+			#pragma omp parallel for schedule(dynamic)
+			for(int k=0;k<number_k_points;k++){
+				arma::cx_mat fft_hamiltonian(number_wannier_functions,number_wannier_functions);
+				for(int lm=0;lm<dimension_square;lm++)
+					fft_hamiltonian(lm%number_wannier_functions,lm/number_wannier_functions)=fft_hamiltonian_batch(spin_channel)(k,lm);
+				arma::vec eigenvalues;
+				arma::cx_mat eigenvectors;
+				arma::eig_sym(eigenvalues,eigenvectors,fft_hamiltonian,"std");
+				arma::uvec ordering=arma::sort_index(eigenvalues);
+				for(int i=0;i<number_wannier_functions;i++){
+					for(int l=0;l<number_wannier_functions;l++)
+						ks_eigenvectors_spinor(spin_channel*number_wannier_functions+l,i,k)=eigenvectors(l,ordering(i));
+					for(int r=0;r<2;r++)
+						if(spinorial_calculation==0||r==spin_channel)
+							ks_eigenvalues_spinor(r,i,k)=eigenvalues(ordering(i));
+				}
+			}
+		}
+	}
+	return {ks_eigenvalues_spinor,ks_eigenvectors_spinor};
+};
+std::tuple<arma::cube,arma::cx_cube> Hamiltonian_TB::pull_ks_states_subset_batch(arma::mat k_points,int number_valence_bands_selected,int number_conduction_bands_selected){
+	int number_k_points=k_points.n_cols;
+	int dimensions_subspace=number_valence_bands_selected+number_conduction_bands_selected;
+	std::tuple<arma::cube,arma::cx_cube> ks_states_batch=pull_ks_states_batch(k_points);
+	arma::cube ks_eigenvalues_subset(2,dimensions_subspace,number_k_points);
+	arma::cx_cube ks_eigenvectors_subset(htb_basis_dimension,dimensions_subspace,number_k_points);
+	#pragma omp parallel for
+	for(int k=0;k<number_k_points;k++){
+		std::tuple<arma::mat,arma::cx_mat> ks_states(get<0>(ks_states_batch).slice(k),get<1>(ks_states_batch).slice(k));
+		std::tuple<arma::mat,arma::cx_mat> ks_states_subset=extract_ks_states_subset(ks_states,number_valence_bands_selected,number_conduction_bands_selected);
+		ks_eigenvalues_subset.slice(k)=get<0>(ks_states_subset);
+		ks_eigenvectors_subset.slice(k)=get<1>(ks_states_subset);
+	}
+	return {ks_eigenvalues_subset,ks_eigenvectors_subset};
+};
+std::tuple<arma::mat,arma::cx_mat> Hamiltonian_TB::pull_ks_states_subset(arma::vec k_point,int number_valence_bands_selected,int number_conduction_bands_selected){
+	return extract_ks_states_subset(pull_ks_states(k_point),number_valence_bands_selected,number_conduction_bands_selected);
+};
+/// number of bands below the fermi energy (or, if looking_from_fermi=0, number_conduction_bands_selected as in the original subset extraction)
+int Hamiltonian_TB::pull_number_valence_bands(arma::mat ks_eigenvalues,int number_conduction_bands_selected){
+	int number_valence_bands = 0;
 	if(looking_from_fermi==1){
 		/// distinguishing between valence and conduction states
 		for (int i = 0; i < number_wannier_functions; i++){
 			///cout<<ks_eigenvalues(0, i)<<" "<<ks_eigenvalues(1, i)<<endl; 
 			if (ks_eigenvalues(0, i)<=fermi_energy && ks_eigenvalues(1, i)<=fermi_energy)
 				number_valence_bands++;
-			else
-				number_conduction_bands++;
 		}
 		///cout<<"Number valence bands "<<number_valence_bands<<" Number conduction bands "<<number_conduction_bands<<endl;
 	}else{
 		number_valence_bands = number_conduction_bands_selected;
-		number_conduction_bands = number_valence_bands_selected;
 	}
+	return number_valence_bands;
+};
+std::tuple<arma::mat,arma::cx_mat> Hamiltonian_TB::extract_ks_states_subset(std::tuple<arma::mat,arma::cx_mat> ks_states,int number_valence_bands_selected,int number_conduction_bands_selected){
+	int dimensions_subspace = number_conduction_bands_selected + number_valence_bands_selected;
+	
+	arma::mat ks_eigenvalues=get<0>(ks_states);
+	arma::cx_mat ks_eigenvectors=get<1>(ks_states);
+	int number_valence_bands = pull_number_valence_bands(ks_eigenvalues,number_conduction_bands_selected);
 
 	/// in a single matrix: first are written valence states, than (at higher rows) conduction states
-	/// converting from eV to Ang^{-1}	
-	arma::mat ks_eigenvalues_subset(2, dimensions_subspace);
+	arma::mat ks_eigenvalues_subset=extract_energies_subset(ks_eigenvalues,number_valence_bands_selected,number_conduction_bands_selected);
 	arma::cx_mat ks_eigenvectors_subset(htb_basis_dimension, dimensions_subspace);
 	for (int i = 0; i < dimensions_subspace; i++){
-		///cout<<"eigenvalues "<<ks_eigenvalues.col(i)<<endl;
-		if (i < number_valence_bands_selected){
+		if (i < number_valence_bands_selected)
 			ks_eigenvectors_subset.col(i) = ks_eigenvectors.col((number_valence_bands - 1) - i);
-			ks_eigenvalues_subset.col(i) = ks_eigenvalues.col((number_valence_bands - 1) - i);
-		}else{
+		else
 			ks_eigenvectors_subset.col(i) = ks_eigenvectors.col(number_valence_bands + (i - number_valence_bands_selected));
-			ks_eigenvalues_subset.col(i) = ks_eigenvalues.col(number_valence_bands + (i - number_valence_bands_selected))+ spinor_scissor_operator;
-		}
 	}
 	
 	return {ks_eigenvalues_subset, ks_eigenvectors_subset};
 };
+arma::mat Hamiltonian_TB::extract_energies_subset(arma::mat ks_eigenvalues,int number_valence_bands_selected,int number_conduction_bands_selected){
+	int dimensions_subspace = number_conduction_bands_selected + number_valence_bands_selected;
+	int number_valence_bands = pull_number_valence_bands(ks_eigenvalues,number_conduction_bands_selected);
+	arma::vec spinor_scissor_operator(2);
+	spinor_scissor_operator(0)=scissor_operator;
+	spinor_scissor_operator(1)=scissor_operator;
 
-void Hamiltonian_TB:: pull_bands(string bands_file_name,string k_points_bands_file_name, int number_k_points_bands,int number_valence_bands_selected,int number_conduction_bands_selected, int crystal_coordinates,arma::mat primitive_vectors){
-	arma::mat k_point(3,2);
-	arma::mat k_point_tmp(3,2);
-	arma::vec k_point_3(3);
-	int intermediate_points;
-	arma::mat eigenvalues(2,number_conduction_bands_selected+number_valence_bands_selected);
-	ifstream k_points_bands_file;
-	ofstream bands_file;
-	k_points_bands_file.open(k_points_bands_file_name);
-	bands_file.open(bands_file_name);
-	k_points_bands_file.seekg(0);
-	int counting = 0;
-	while (k_points_bands_file.peek()!=EOF){
-		if (counting<number_k_points_bands)
-		{
-			k_points_bands_file >> k_point(0,0) >> k_point(1,0) >> k_point(2,0);
-			k_points_bands_file >> k_point(0,1) >> k_point(1,1) >> k_point(2,1);
-			k_points_bands_file >> intermediate_points;
-			counting = counting + 1;
-			cout<<k_point<<endl;
-			if(crystal_coordinates==1){
-				for(int k=0;k<2;k++){
-					for(int s=0;s<3;s++){
-						k_point_tmp(s,k)=0.0;
-						for(int r=0;r<3;r++)
-							k_point_tmp(s,k)+=k_point(r,k)*primitive_vectors(s,r);
+	/// first valence states (from the highest), then conduction states (with the scissor)
+	arma::mat ks_eigenvalues_subset(2, dimensions_subspace);
+	for (int i = 0; i < dimensions_subspace; i++){
+		if (i < number_valence_bands_selected)
+			ks_eigenvalues_subset.col(i) = ks_eigenvalues.col((number_valence_bands - 1) - i);
+		else
+			ks_eigenvalues_subset.col(i) = ks_eigenvalues.col(number_valence_bands + (i - number_valence_bands_selected))+ spinor_scissor_operator;
+	}
+	return ks_eigenvalues_subset;
+};
+/// eigenvalues only (no eigenvectors are computed, LAPACK job 'N'), same shape of get<0>(pull_ks_states(k_point))
+arma::mat Hamiltonian_TB::pull_energies(arma::vec k_point){
+	arma::mat ks_eigenvalues_spinor(2, number_wannier_functions, arma::fill::zeros);
+	arma::field<arma::cx_mat> fft_hamiltonian = FFT(k_point);
+	arma::vec eigenvalues;
+	for(int spin_channel=0;spin_channel<(spinorial_calculation+1);spin_channel++){
+		arma::eig_sym(eigenvalues,fft_hamiltonian(spin_channel));
+		eigenvalues=arma::sort(eigenvalues);
+		for (int i = 0; i < number_wannier_functions; i++)
+			for(int r=0;r<2;r++)
+				if(spinorial_calculation==0||r==spin_channel)
+					ks_eigenvalues_spinor(r,i)=eigenvalues(i);
+	}
+	return ks_eigenvalues_spinor;
+};
+arma::mat Hamiltonian_TB::pull_energies_subset(arma::vec k_point,int number_valence_bands_selected,int number_conduction_bands_selected){
+	return extract_energies_subset(pull_energies(k_point),number_valence_bands_selected,number_conduction_bands_selected);
+};
+arma::cube Hamiltonian_TB::pull_energies_batch(arma::mat k_points){
+	int number_k_points=k_points.n_cols;
+	int dimension_square=number_wannier_functions*number_wannier_functions;
+	arma::cube ks_eigenvalues_spinor(2,number_wannier_functions,number_k_points,arma::fill::zeros);
+	arma::field<arma::cx_mat> fft_hamiltonian_batch=FFT_batch(k_points);
+
+	for(int spin_channel=0;spin_channel<(spinorial_calculation+1);spin_channel++){
+		if(number_wannier_functions<=threshold_batch_eigensolver){
+			int number_batches=(number_k_points+batch_eigensolver_dimension-1)/batch_eigensolver_dimension;
+			#pragma omp parallel for schedule(dynamic)
+			for(int batch=0;batch<number_batches;batch++){
+				int first_k_point=batch*batch_eigensolver_dimension;
+				int batch_dimension=std::min(batch_eigensolver_dimension,number_k_points-first_k_point);
+				std::vector<double> hamiltonian_real(dimension_square*batch_dimension);
+				std::vector<double> hamiltonian_imag(dimension_square*batch_dimension);
+				for(int lm=0;lm<dimension_square;lm++)
+					for(int b=0;b<batch_dimension;b++){
+						hamiltonian_real[lm*batch_dimension+b]=std::real(fft_hamiltonian_batch(spin_channel)(first_k_point+b,lm));
+						hamiltonian_imag[lm*batch_dimension+b]=std::imag(fft_hamiltonian_batch(spin_channel)(first_k_point+b,lm));
 					}
-					for(int s=0;s<3;s++)
-						k_point(s,k)=k_point_tmp(s,k);
+				/// no accumulation of the eigenvectors
+				jacobi_hermitian_eigensolver_batch(number_wannier_functions,batch_dimension,hamiltonian_real.data(),hamiltonian_imag.data(),NULL,NULL,1.0e-12,50);
+				arma::vec eigenvalues(number_wannier_functions);
+				for(int b=0;b<batch_dimension;b++){
+					for(int i=0;i<number_wannier_functions;i++)
+						eigenvalues(i)=hamiltonian_real[(i+number_wannier_functions*i)*batch_dimension+b];
+					eigenvalues=arma::sort(eigenvalues);
+					for(int i=0;i<number_wannier_functions;i++)
+						for(int r=0;r<2;r++)
+							if(spinorial_calculation==0||r==spin_channel)
+								ks_eigenvalues_spinor(r,i,first_k_point+b)=eigenvalues(i);
 				}
 			}
-			for(int j=0;j<intermediate_points;j++){
-				for(int r=0;r<3;r++){
-					k_point_3(r)=k_point(r,0)*(1.0-double(j)/double(intermediate_points-1))+k_point(r,1)*(double(j)/double(intermediate_points-1));
-					//cout<<k_point_3(r)<<" ";
-				}
-				//cout<<endl;
-				///cout<<k_point_3<<endl;
-				///cout<<double(j)/double(intermediate_points)<<endl;
-				eigenvalues=get<0>(pull_ks_states_subset(k_point_3,number_valence_bands_selected,number_conduction_bands_selected));
-				for(int spin=0;spin<(spinorial_calculation+1);spin++)
-					for(int i=0;i<number_conduction_bands_selected+number_valence_bands_selected;i++)
-						bands_file<<eigenvalues(spin,i)<<" ";
-				bands_file<<endl;
+		}else{
+			#pragma omp parallel for schedule(dynamic)
+			for(int k=0;k<number_k_points;k++){
+				arma::cx_mat fft_hamiltonian(number_wannier_functions,number_wannier_functions);
+				for(int lm=0;lm<dimension_square;lm++)
+					fft_hamiltonian(lm%number_wannier_functions,lm/number_wannier_functions)=fft_hamiltonian_batch(spin_channel)(k,lm);
+				arma::vec eigenvalues;
+				arma::eig_sym(eigenvalues,fft_hamiltonian);
+				eigenvalues=arma::sort(eigenvalues);
+				for(int i=0;i<number_wannier_functions;i++)
+					for(int r=0;r<2;r++)
+						if(spinorial_calculation==0||r==spin_channel)
+							ks_eigenvalues_spinor(r,i,k)=eigenvalues(i);
 			}
 		}
+	}
+	return ks_eigenvalues_spinor;
+};
+arma::cube Hamiltonian_TB::pull_energies_subset_batch(arma::mat k_points,int number_valence_bands_selected,int number_conduction_bands_selected){
+	int number_k_points=k_points.n_cols;
+	arma::cube ks_eigenvalues=pull_energies_batch(k_points);
+	arma::cube ks_eigenvalues_subset(2,number_valence_bands_selected+number_conduction_bands_selected,number_k_points);
+	#pragma omp parallel for
+	for(int k=0;k<number_k_points;k++)
+		ks_eigenvalues_subset.slice(k)=extract_energies_subset(ks_eigenvalues.slice(k),number_valence_bands_selected,number_conduction_bands_selected);
+	return ks_eigenvalues_subset;
+};
+
+/// the whole path is built first, the energies are evaluated in batch and the file is written once
+/// binary_output=1: raw doubles, one row per k point of the path (spin-major, then bands), no header
+void Hamiltonian_TB:: pull_bands(string bands_file_name,string k_points_bands_file_name, int number_k_points_bands,int number_valence_bands_selected,int number_conduction_bands_selected, int crystal_coordinates,arma::mat primitive_vectors,int binary_output){
+	int number_bands_selected=number_conduction_bands_selected+number_valence_bands_selected;
+	arma::mat segments_extrema(6,number_k_points_bands);
+	arma::vec segments_intermediate_points(number_k_points_bands);
+	ifstream k_points_bands_file;
+	k_points_bands_file.open(k_points_bands_file_name);
+	k_points_bands_file.seekg(0);
+	int number_segments = 0;
+	while (k_points_bands_file.peek()!=EOF){
+		if (number_segments<number_k_points_bands){
+			for(int r=0;r<6;r++)
+				k_points_bands_file >> segments_extrema(r,number_segments);
+			k_points_bands_file >> segments_intermediate_points(number_segments);
+			number_segments = number_segments + 1;
+		}
 		else
-			///to avoid the reading of blank rows			
+			///to avoid the reading of blank rows
 			break;
 	}
 	k_points_bands_file.close();
+
+	/// building the path
+	int number_k_points_path=0;
+	for(int i=0;i<number_segments;i++)
+		number_k_points_path+=int(segments_intermediate_points(i));
+	arma::mat k_points_path(3,number_k_points_path);
+	int counting=0;
+	for(int i=0;i<number_segments;i++){
+		int intermediate_points=int(segments_intermediate_points(i));
+		for(int j=0;j<intermediate_points;j++){
+			for(int r=0;r<3;r++)
+				k_points_path(r,counting)=segments_extrema(r,i)*(1.0-double(j)/double(intermediate_points-1))+segments_extrema(3+r,i)*(double(j)/double(intermediate_points-1));
+			counting++;
+		}
+	}
+	if(crystal_coordinates==1)
+		k_points_path=primitive_vectors*k_points_path;
+	cout<<"Bands on "<<number_k_points_path<<" k points"<<endl;
+
+	arma::cube eigenvalues=pull_energies_subset_batch(k_points_path,number_valence_bands_selected,number_conduction_bands_selected);
+
+	arma::mat bands((spinorial_calculation+1)*number_bands_selected,number_k_points_path);
+	for(int k=0;k<number_k_points_path;k++)
+		for(int spin=0;spin<(spinorial_calculation+1);spin++)
+			for(int i=0;i<number_bands_selected;i++)
+				bands(spin*number_bands_selected+i,k)=eigenvalues(spin,i,k);
+	ofstream bands_file;
+	if(binary_output==1){
+		bands_file.open(bands_file_name,ios::binary);
+		bands_file.write(reinterpret_cast<const char*>(bands.memptr()),sizeof(double)*bands.n_elem);
+	}else{
+		/// single buffer, a single write
+		string bands_buffer;
+		char value_buffer[32];
+		for(int k=0;k<number_k_points_path;k++){
+			for(int i=0;i<(spinorial_calculation+1)*number_bands_selected;i++){
+				snprintf(value_buffer,sizeof(value_buffer),"%g ",bands(i,k));
+				bands_buffer+=value_buffer;
+			}
+			bands_buffer+="\n";
+		}
+		bands_file.open(bands_file_name);
+		bands_file<<bands_buffer;
+	}
 	bands_file.close();
 };
 	
@@ -924,7 +1853,7 @@ private:
 	int number_atoms;
 public:
 	Real_space_wannier(arma::vec number_points_real_space_grid_tmp, arma::vec number_unit_cells_supercell_tmp, int spinorial_calculation_tmp, string seedname_files_xsf_tmp, int number_wannier_functions_tmp, double cell_volume_tmp, int number_atoms_tmp, arma::mat atoms_coordinates_tmp);
-	arma::mat pull_real_space_wannier_functions_list(){
+	const arma::mat& pull_real_space_wannier_functions_list(){
 		return real_space_wannier_functions_list;
 	};
 	arma::vec pull_origin(){
@@ -1223,9 +2152,36 @@ private:
 	G_points *g_points;
 	double volume_cell;
 	double radius;
+	/// truncation (computed once from direction_cutting): slab (2) normal to the plane, wire (1) axis of the wire
+	/// radius_truncation is half of the cell along the truncated direction (slab), or half of the smallest one (wire and 0D)
+	arma::vec direction_truncation{arma::vec(3)};
+	double radius_truncation;
+	double function_integrating_wire_limit(double modulus_k_point_orthogonal);
+	/// table of v(q+G) and sqrt(v(q+G)) over the G list, one entry per q (q id from the rounded components)
+	/// the deques keep the references to the entries valid while new q are added
+	arma::mat g_points_list_table;
+	double resolution_table;
+	std::map<std::tuple<long long,long long,long long>,int> q_points_table;
+	std::deque<arma::vec> v_table;
+	std::deque<arma::vec> sqrt_v_table;
+	int function_building_q_index_table(arma::vec q_point);
 public:
 	Coulomb_Potential(K_points* k_points_tmp,G_points* g_points_tmp,double minimum_k_point_modulus_tmp,int dimension_potential_tmp,arma::vec direction_cutting_tmp,double volume_tmp,double radius_tmp);
 	double pull(arma::vec k_point);
+	int pull_dimension_potential(){
+		return dimension_potential;
+	};
+	/// component of the q points along the periodic directions (in plane for slabs, along the axis for wires, 0 for molecules)
+	arma::mat pull_projection_periodic(arma::mat k_points_batch);
+	/// potential on each column of a 3xN matrix (i.e. q+G for all G), without temporaries
+	arma::vec pull_batch(const arma::mat& k_points_batch);
+	/// v(q+G) and sqrt(v(q+G)) for all the G of the list, calculated the first time q is requested
+	const arma::vec& pull_table(arma::vec q_point);
+	const arma::vec& pull_table_sqrt(arma::vec q_point);
+	/// releasing the table (at the end of a set of q, i.e. after W has been built): the references of pull_table are no more valid
+	void clear_table();
+	/// new G list (i.e. after G_points::push_number_g_points_list), the table is released
+	void push_g_points(G_points* g_points_tmp);
 	double pull_volume();
 	void print();
 	void print_profile(int number_k_points,double max_radius,string file_coulomb_potential_name, int direction_profile_xyz);
@@ -1240,10 +2196,91 @@ Coulomb_Potential::Coulomb_Potential(K_points* k_points_tmp,G_points* g_points_t
 	minimum_k_point_modulus = minimum_k_point_modulus_tmp;
 	radius=radius_tmp;
 	dimension_potential = dimension_potential_tmp;
-	///direction of the bravais lattice along whic the cut is considered (1 is cut and 0 is no-cut)
+	///directions of the bravais lattice along which the potential is cut (0 is cut and 1 is periodic, as for the G points)
 	direction_cutting = direction_cutting_tmp;
 	primitive_vectors = k_points->pull_primitive_vectors();
 	volume_cell=volume_tmp;
+	/// the truncation is given by the number of periodic directions: 2 slab, 1 wire, 0 molecule (3 no truncation)
+	int number_periodic_directions=0;
+	for(int i=0;i<3;i++)
+		if(direction_cutting(i)==1)
+			number_periodic_directions++;
+	if(dimension_potential!=3&&dimension_potential!=number_periodic_directions){
+		cout<<"ERROR!!!!!!! dimension potential "<<dimension_potential<<" not compatible with direction cutting, using "<<number_periodic_directions<<endl;
+		dimension_potential=number_periodic_directions;
+	}
+	/// the spacing between the planes of the lattice along the reciprocal vector b is 2pi/|b|
+	radius_truncation=0.0;
+	direction_truncation.zeros();
+	for(int i=0;i<3;i++)
+		if(direction_cutting(i)==0)
+			if(radius_truncation==0.0||pigreco/norm(primitive_vectors.col(i))<radius_truncation)
+				radius_truncation=pigreco/norm(primitive_vectors.col(i));
+	if(dimension_potential==2){
+		for(int i=0;i<3;i++)
+			if(direction_cutting(i)==0)
+				direction_truncation=primitive_vectors.col(i)/norm(primitive_vectors.col(i));
+	}else if(dimension_potential==1){
+		arma::mat primitive_vectors_cut(3,2);
+		int counting=0;
+		for(int i=0;i<3;i++)
+			if(direction_cutting(i)==0){
+				primitive_vectors_cut.col(counting)=primitive_vectors.col(i);
+				counting++;
+			}
+		direction_truncation=arma::cross(primitive_vectors_cut.col(0),primitive_vectors_cut.col(1));
+		direction_truncation=direction_truncation/norm(direction_truncation);
+	}
+	g_points_list_table=g_points->pull_g_points_list_values();
+	resolution_table=1.0e-8;
+};
+int Coulomb_Potential::function_building_q_index_table(arma::vec q_point){
+	std::tuple<long long,long long,long long> key=std::make_tuple((long long)std::llround(q_point(0)/resolution_table),(long long)std::llround(q_point(1)/resolution_table),(long long)std::llround(q_point(2)/resolution_table));
+	int q_index;
+	#pragma omp critical(coulomb_table)
+	{
+		std::map<std::tuple<long long,long long,long long>,int>::iterator found=q_points_table.find(key);
+		if(found!=q_points_table.end())
+			q_index=found->second;
+		else{
+			arma::mat q_plus_g(3,g_points_list_table.n_cols);
+			for(int g=0;g<int(g_points_list_table.n_cols);g++)
+				for(int r=0;r<3;r++)
+					q_plus_g(r,g)=q_point(r)+g_points_list_table(r,g);
+			q_index=v_table.size();
+			v_table.push_back(pull_batch(q_plus_g));
+			sqrt_v_table.push_back(arma::sqrt(v_table.back()));
+			q_points_table[key]=q_index;
+		}
+	}
+	return q_index;
+};
+const arma::vec& Coulomb_Potential::pull_table(arma::vec q_point){
+	int q_index=function_building_q_index_table(q_point);
+	const arma::vec *v_q_point;
+	#pragma omp critical(coulomb_table)
+	v_q_point=&v_table[q_index];
+	return *v_q_point;
+};
+const arma::vec& Coulomb_Potential::pull_table_sqrt(arma::vec q_point){
+	int q_index=function_building_q_index_table(q_point);
+	const arma::vec *sqrt_v_q_point;
+	#pragma omp critical(coulomb_table)
+	sqrt_v_q_point=&sqrt_v_table[q_index];
+	return *sqrt_v_q_point;
+};
+void Coulomb_Potential::clear_table(){
+	#pragma omp critical(coulomb_table)
+	{
+		q_points_table.clear();
+		v_table.clear();
+		sqrt_v_table.clear();
+	}
+};
+void Coulomb_Potential::push_g_points(G_points* g_points_tmp){
+	clear_table();
+	g_points=g_points_tmp;
+	g_points_list_table=g_points->pull_g_points_list_values();
 };
 double Coulomb_Potential::pull_volume(){
 	return volume_cell;
@@ -1270,42 +2307,191 @@ void Coulomb_Potential:: print_profile(int number_k_points,double max_k_point,st
 	}
 	file_coulomb_potential.close();
 };
-double Coulomb_Potential::pull(arma::vec k_point){
-	/// the volume of the cell is in angstrom
-	/// the momentum k is in angstrom^-1
-	double coulomb_potential;
+double Coulomb_Potential::pull(arma::vec k_point){
+	/// the volume of the cell is in angstrom
+	/// the momentum k is in angstrom^-1
+	arma::mat k_points_batch(3,1);
+	k_points_batch.col(0)=k_point;
+	return pull_batch(k_points_batch)(0);
+};
+arma::vec Coulomb_Potential::pull_batch(const arma::mat& k_points_batch){
+	int number_points=k_points_batch.n_cols;
+	arma::vec coulomb_potential(number_points,arma::fill::zeros);
+	const double *k_point=k_points_batch.memptr();
+	double *potential=coulomb_potential.memptr();
+	/// a cutoff is introduced in order to avoid any divergence in k=0 (not needed in 0D)
+	/// below minval^2 the q=0 limit is always used, also with minimum_k_point_modulus=0 (the formulas give inf*0 in q=0)
+	/// the wire needs no limit: in q=0 it falls in the finite wire branch
+	const double modulus_limit=std::max(minimum_k_point_modulus,minval*minval);
+	if(dimension_potential==3){
+		#pragma omp simd
+		for(int i=0;i<number_points;i++){
+			double modulus_k_point=k_point[3*i]*k_point[3*i]+k_point[3*i+1]*k_point[3*i+1]+k_point[3*i+2]*k_point[3*i+2];
+			potential[i]=(modulus_k_point<modulus_limit)?0.0:conversion_parameter/(modulus_k_point+radius);
+		}
+	}else if(dimension_potential==2){
+		/// slab (Ismail-Beigi): v(q)=4pi/q^2 [1-e^{-q_par z_c} cos(q_z z_c)], z_c half of the cell along the normal
+		const double normal_0=direction_truncation(0);
+		const double normal_1=direction_truncation(1);
+		const double normal_2=direction_truncation(2);
+		const double z_c=radius_truncation;
+		#pragma omp simd
+		for(int i=0;i<number_points;i++){
+			double modulus_k_point=k_point[3*i]*k_point[3*i]+k_point[3*i+1]*k_point[3*i+1]+k_point[3*i+2]*k_point[3*i+2];
+			double k_point_z=normal_0*k_point[3*i]+normal_1*k_point[3*i+1]+normal_2*k_point[3*i+2];
+			double modulus_k_point_parallel=std::sqrt(std::max(modulus_k_point-k_point_z*k_point_z,0.0));
+			potential[i]=(modulus_k_point<modulus_limit)?0.0:conversion_parameter/(modulus_k_point+radius)*(1-std::exp(-modulus_k_point_parallel*z_c)*std::cos(k_point_z*z_c));
+		}
+	}else if(dimension_potential==1){
+		/// wire (Ismail-Beigi): v(q)=4pi/q^2 [1+q_perp R J1(q_perp R) K0(|q_x| R)-|q_x| R J0(q_perp R) K1(|q_x| R)], q_x along the axis
+		/// for q_x=0 the limit of the finite wire is used: v=-4pi \int_0^R r J0(q_perp r) ln(r) dr
+		for(int i=0;i<number_points;i++){
+			double modulus_k_point=k_point[3*i]*k_point[3*i]+k_point[3*i+1]*k_point[3*i+1]+k_point[3*i+2]*k_point[3*i+2];
+			double k_point_x=std::abs(direction_truncation(0)*k_point[3*i]+direction_truncation(1)*k_point[3*i+1]+direction_truncation(2)*k_point[3*i+2]);
+			double modulus_k_point_orthogonal=std::sqrt(std::max(modulus_k_point-k_point_x*k_point_x,0.0));
+			if(modulus_k_point<minimum_k_point_modulus)
+				potential[i]=0.0;
+			else if(k_point_x*radius_truncation>minval)
+				potential[i]=conversion_parameter/(modulus_k_point+radius)*(1+modulus_k_point_orthogonal*radius_truncation*std::cyl_bessel_j(1.0,modulus_k_point_orthogonal*radius_truncation)*std::cyl_bessel_k(0.0,k_point_x*radius_truncation)
+					-k_point_x*radius_truncation*std::cyl_bessel_j(0.0,modulus_k_point_orthogonal*radius_truncation)*std::cyl_bessel_k(1.0,k_point_x*radius_truncation));
+			else
+				potential[i]=conversion_parameter*function_integrating_wire_limit(modulus_k_point_orthogonal);
+		}
+	}else if(dimension_potential==0){
+		/// sphere: v(q)=4pi/q^2 [1-cos(q R)], finite in q=0 (4pi R^2/2)
+		const double radius_sphere=radius_truncation;
+		#pragma omp simd
+		for(int i=0;i<number_points;i++){
+			double modulus_k_point=k_point[3*i]*k_point[3*i]+k_point[3*i+1]*k_point[3*i+1]+k_point[3*i+2]*k_point[3*i+2];
+			potential[i]=(modulus_k_point<modulus_limit)?conversion_parameter*radius_sphere*radius_sphere/2:conversion_parameter/(modulus_k_point+radius)*(1-std::cos(std::sqrt(modulus_k_point)*radius_sphere));
+		}
+	}
+	return coulomb_potential;
+};
+arma::mat Coulomb_Potential::pull_projection_periodic(arma::mat k_points_batch){
+	if(dimension_potential==2)
+		k_points_batch-=direction_truncation*(direction_truncation.t()*k_points_batch);
+	else if(dimension_potential==1)
+		k_points_batch=direction_truncation*(direction_truncation.t()*k_points_batch);
+	else if(dimension_potential==0)
+		k_points_batch.zeros();
+	return k_points_batch;
+};
+double Coulomb_Potential::function_integrating_wire_limit(double modulus_k_point_orthogonal){
+	/// Simpson rule on [0,R] (the integrand r ln(r) goes to 0 in r=0)
+	int number_intervals=256;
+	double step=radius_truncation/number_intervals;
+	double integral=0.0;
+	for(int n=1;n<=number_intervals;n++){
+		double r=n*step;
+		double weight=(n==number_intervals)?1.0:((n%2==1)?4.0:2.0);
+		integral+=weight*r*std::cyl_bessel_j(0.0,modulus_k_point_orthogonal*r)*std::log(r);
+	}
+	return -integral*step/3;
+};
+
+/// wannier functions on the real space grid, as used by the dipole integrals:
+/// one contiguous block per (spin,w,cell) with the points of the cell (p=s*N1*N2+t*N2+l, cell c=i*M1*M2+j*M2+k)
+/// every block starts on a 32 bytes boundary (blocks padded with zeros to a multiple of 4 doubles), so that the unit-stride
+/// loops over the points of a cell are vectorized with aligned loads and no load crosses a cache line
+/// the shifted cells of the overlaps w_1(r-R)w_2(r) (R cell of the integration region) are tabulated once
+class Wannier_Grid
+{
+private:
+	int number_points_percell[3];
+	int number_points_cell;
+	int leading_dimension;
+	int number_cells[3];
+	int number_cells_supercell;
+	int number_wannier_functions;
+	int number_cells_integration[3];
+	int number_cells_integration_total;
+	/// blocks (spin,w,cell) of leading_dimension doubles, from values_storage[aligned_offset] (first 32 bytes aligned element)
+	std::vector<double> values_storage;
+	int aligned_offset;
+	/// (cell_integration*number_cells_supercell+c): cell of w_1(r-R) for r in the cell c, -1 outside the supercell
+	arma::ivec shifted_cells;
+public:
+	Wannier_Grid(Real_space_wannier *real_space_wannier,arma::vec number_primitive_cells_integration);
+	const double* pull_block(int spin,int w,int cell) const{
+		return values_storage.data()+aligned_offset+((spin*number_wannier_functions+w)*number_cells_supercell+cell)*(long long)leading_dimension;
+	};
+	int pull_shifted_cell(int cell_integration,int cell) const{
+		return shifted_cells(cell_integration*number_cells_supercell+cell);
+	};
+	/// sum of all the grid values (fingerprint of the wannier functions, for the files built from them)
+	double pull_sum_values() const{
+		double sum_values=0.0;
+		for(int n=0;n<int(values_storage.size());n++)
+			sum_values+=values_storage[n];
+		return sum_values;
+	};
+	int pull_number_points_cell() const{
+		return number_points_cell;
+	};
+	int pull_number_cells_supercell() const{
+		return number_cells_supercell;
+	};
+	int pull_number_cells_integration() const{
+		return number_cells_integration_total;
+	};
+	/// (s,t,l) of the point p and (i,j,k) of the cell c
+	void pull_point_coordinates(int p,int& s,int& t,int& l) const{
+		s=p/(number_points_percell[1]*number_points_percell[2]);
+		t=(p/number_points_percell[2])%number_points_percell[1];
+		l=p%number_points_percell[2];
+	};
+	void pull_cell_coordinates(int c,int& i,int& j,int& k) const{
+		i=c/(number_cells[1]*number_cells[2]);
+		j=(c/number_cells[2])%number_cells[1];
+		k=c%number_cells[2];
+	};
+};
+Wannier_Grid::Wannier_Grid(Real_space_wannier *real_space_wannier,arma::vec number_primitive_cells_integration){
+	arma::vec number_points_real_space_grid_percell=real_space_wannier->pull_number_points_real_space_grid_percell();
+	arma::vec number_unit_cells_supercell=real_space_wannier->pull_number_unit_cells_supercell();
+	number_wannier_functions=real_space_wannier->pull_number_wannier_functions();
+	for(int r=0;r<3;r++){
+		number_points_percell[r]=int(number_points_real_space_grid_percell(r));
+		number_cells[r]=int(number_unit_cells_supercell(r));
+		number_cells_integration[r]=int(number_primitive_cells_integration(r));
+	}
+	number_points_cell=number_points_percell[0]*number_points_percell[1]*number_points_percell[2];
+	number_cells_supercell=number_cells[0]*number_cells[1]*number_cells[2];
+	number_cells_integration_total=number_cells_integration[0]*number_cells_integration[1]*number_cells_integration[2];
+
+	leading_dimension=4*((number_points_cell+3)/4);
+
+	/// same columns of real_space_wannier_functions_list (spin,w,i,j,k), padding set to zero
+	const arma::mat& real_space_wannier_functions_list=real_space_wannier->pull_real_space_wannier_functions_list();
+	int number_blocks=real_space_wannier_functions_list.n_cols;
+	values_storage.assign((long long)leading_dimension*number_blocks+3,0.0);
+	aligned_offset=int(((32-reinterpret_cast<std::uintptr_t>(values_storage.data())%32)%32)/sizeof(double));
+	for(int column=0;column<number_blocks;column++){
+		const double* source=real_space_wannier_functions_list.colptr(column);
+		double* destination=values_storage.data()+aligned_offset+column*(long long)leading_dimension;
+		for(int p=0;p<number_points_cell;p++)
+			destination[p]=source[p];
+	}
 
-	/// a cutoff is introduced in order to avoid any divergence in k=0
-	double modulus_k_point;
-	modulus_k_point= accu(k_point%k_point);
-	if(dimension_potential==3){
-		if (modulus_k_point < minimum_k_point_modulus)
-			coulomb_potential = 0;
-		else
-			coulomb_potential = conversion_parameter /(modulus_k_point+radius);
-	}else if(dimension_potential==2){
-		arma::vec primitive_along(3);
-		for(int i=0;i<3;i++)
-			if(direction_cutting(i)==0){
-				primitive_along=primitive_vectors.col(i);
-			}
-		arma::vec k_point_orthogonal(3,arma::fill::zeros);
-		arma::vec k_point_along(3,arma::fill::zeros);
-		arma::vec unity(3,arma::fill::ones);
-		k_point_along=(primitive_along%k_point)/norm(primitive_along);
-		k_point_orthogonal=k_point-k_point_along;
-		double c1=norm(k_point_along)/norm(k_point_orthogonal);
-		double c2=(norm(primitive_along)/2)*norm(k_point_orthogonal);
-		double c3=(norm(primitive_along)/2)*norm(k_point_along);
-		if (modulus_k_point < minimum_k_point_modulus)
-			coulomb_potential=0;
-		else{
-			coulomb_potential = conversion_parameter/(pow(modulus_k_point, 2)+radius);
-			coulomb_potential = coulomb_potential*(1-exp(-c2)*(c1*sin(c3)-cos(c3)));
+	/// w_1(r-R) on the cell (i2,j2,k2) is w_1 on the cell (i2-(i1-n1/2),...), R=(i1-n1/2,...) with n1 the cells of the integration region
+	shifted_cells.set_size(number_cells_integration_total*number_cells_supercell);
+	for(int e=0;e<number_cells_integration_total;e++){
+		int i1=e/(number_cells_integration[1]*number_cells_integration[2]);
+		int j1=(e/number_cells_integration[2])%number_cells_integration[1];
+		int k1=e%number_cells_integration[2];
+		for(int c=0;c<number_cells_supercell;c++){
+			int i2; int j2; int k2;
+			pull_cell_coordinates(c,i2,j2,k2);
+			int i3=i2-(i1-number_cells_integration[0]/2);
+			int j3=j2-(j1-number_cells_integration[1]/2);
+			int k3=k2-(k1-number_cells_integration[2]/2);
+			if(i3>=0&&i3<number_cells[0]&&j3>=0&&j3<number_cells[1]&&k3>=0&&k3<number_cells[2])
+				shifted_cells(e*number_cells_supercell+c)=i3*number_cells[1]*number_cells[2]+j3*number_cells[2]+k3;
+			else
+				shifted_cells(e*number_cells_supercell+c)=-1;
 		}
 	}
-	///TO IMPLEMENT THIS CASE AS WELL
-	return coulomb_potential;
 };
 
 /// Generalized dipoles elements
@@ -1333,24 +2519,78 @@ private:
 	arma::vec number_unit_cells_supercell{arma::vec(3)};
 	int number_points_real_space_grid_total;
 	arma::vec number_primitive_cells_integration{arma::vec(3)};
-	arma::mat indexingi;
-	arma::mat indexingj;
-	arma::mat indexingk;
 	arma::mat supercell_axis;
 	arma::vec origin{arma::vec(3)};
 	arma::vec origin_unitcell{arma::vec(3)};
-	arma::mat real_space_wannier_functions_list;
+	/// wannier functions in blocks per (spin,w,cell), with the shifted cells of the integration region
+	Wannier_Grid wannier_grid;
 	double radius_building_kernel;
 	double threshold_building_kernel;
+	int perturbative_small_momentum;
+	double threshold_perturbative_momentum;
+	double threshold_perturbative_degeneracy;
+	/// time reversal (H(-k)=H(k)^*): the states at the partner -k are the conjugate of the ones at k
+	int time_reversal_symmetry;
+	arma::ivec time_reversal_partners;
+	/// store of the ks states of a previous (nested) grid, NULL if not used
+	Ks_States_Store *ks_states_store;
+	/// 1: M approximated by the phases e^{i(q+G)tau_w} on the wannier centers (diagonal in the wannier basis)
+	int point_dipole_approximation;
+	/// caches used while a group of rho blocks is built (pull_values_blocks): ks states by (shift, valence, conduction)
+	/// and M tables by (momentum, diagonal_k, small_excitonic_momentum, radius_convergence)
+	int rho_cache;
+	std::map<std::tuple<long long,long long,long long,int,int>,std::tuple<arma::cube,arma::cx_cube>> ks_states_cache;
+	std::map<std::tuple<long long,long long,long long,int,int,int>,std::tuple<arma::cx_cube,arma::ivec>> M_matrix_cache;
+	std::tuple<arma::cube,arma::cx_cube> function_diagonalizing_ks_states_subset(arma::vec parameter,int number_valence_bands_selected,int number_conduction_bands_selected);
+	/// diagonal_k==0: only the right k points first_k_point_tile,...,first_k_point_tile+number_k_points_tile-1 are built (whole list by default)
+	int first_k_point_tile;
+	int number_k_points_tile;
+	/// q-independent moments of the small excitonic momentum integrals (function_building_real_space_wannier_dipole_ij_small_q),
+	/// slice (w1*number_wannier_centers+w2)*number_g_points_list+g, one column per component of the position moment
+	arma::cx_cube small_q_moments;
+	/// seedname of the files where the moments are saved and read ("" no files)
+	string small_q_moments_file_name;
+	/// real space setup of the moments (saved with them): spin, wannier functions, integration cells, supercell, grid, origin, axis, sum of the grid values
+	arma::vec function_building_small_q_setup();
+	void function_building_small_q_moments();
 public:
-	Dipole_Elements(int number_k_points_list_tmp,arma::mat k_points_list_tmp, int number_g_points_list_tmp,arma::mat g_points_list_tmp,int number_wannier_centers_tmp,int number_valence_bands_selected_tmp,int number_conduction_bands_selected_tmp, Hamiltonian_TB *hamiltonian_tb_tmp,int spinorial_calculation_tmp,	Real_space_wannier* real_space_wannier_tmp,arma::vec number_primitive_cells_integration_tmp, arma::vec number_unit_cells_supercell_tmp, arma::vec number_points_real_space_grid_tmp,double radius_building_kernel_tmp,double threshold_building_kernel_tmp);
-	arma::field<arma::cx_mat> function_building_exponential_factor(arma::vec excitonic_momentum,int diagonal_k,int minus);
+	Dipole_Elements(int number_k_points_list_tmp,arma::mat k_points_list_tmp, int number_g_points_list_tmp,arma::mat g_points_list_tmp,int number_wannier_centers_tmp,int number_valence_bands_selected_tmp,int number_conduction_bands_selected_tmp, Hamiltonian_TB *hamiltonian_tb_tmp,int spinorial_calculation_tmp,	Real_space_wannier* real_space_wannier_tmp,arma::vec number_primitive_cells_integration_tmp,double radius_building_kernel_tmp,double threshold_building_kernel_tmp);
+	/// A_{w2w1}(R)=e^{ik.R}A_{w1w2}(-R) (real wannier functions), k=q+G the momentum of the integral; needs a symmetric set of cells (odd number_primitive_cells_integration)
+	arma::cx_vec function_building_mirror_dipole(const arma::cx_vec& A_matrix,arma::vec momentum);
+	/// pairs (w1,w2) whose integrals are calculated: only w1<=w2 if the cells are symmetric, all otherwise
+	std::vector<std::tuple<int,int>> function_building_wannier_pairs(int mirror_cells);
+	/// M_{w1w2}(slice)+=\sum_R e^{iq(tau_0+R)}A_{w1w2}(R)
+	void function_adding_M_block(arma::cx_cube& M_matrix,int slice,int w1,int w2,const arma::cx_vec& A_matrix,arma::vec momentum_transfer);
+	/// point-dipole approximation of M: only the diagonal phases, one column e^{i(q+G)tau} per G, followed (diagonal_k==0) by one column e^{ik tau} per k point,
+	/// the phase of (G,k1,k2) is e^{i(q+G)tau}e^{ik1 tau}e^{-ik2 tau} (conjugated phases for minus==1)
+	arma::cx_mat function_building_exponential_factor(arma::vec excitonic_momentum,int diagonal_k,int minus);
 	///arma::field<arma::mat> function_building_A_matrix(double threshold_proximity);
 	arma::cx_vec function_building_real_space_wannier_dipole_ij(int number_wannier_1,int number_wannier_2,arma::vec excitonic_momentum,arma::vec g_momentum);
 	std::tuple<arma::cx_mat,arma::cx_vec>  function_building_real_space_wannier_dipole_ij_small_q(int number_wannier_1,int number_wannier_2,arma::vec g_momentum);
-	arma::field<arma::cx_mat> function_building_M_k1k2_ij(arma::vec excitonic_momentum,int diagonal_k,int small_excitonic_momentum,int radius_convergence);
+	///M_{w1w2}(excitonic_momentum+k1-k2,G), stored once per distinct momentum transfer (slice g*number_momentum_transfers+u),
+	///the second element maps the pair k1*number_k_points_list+k2 to u (diagonal_k==1: a single transfer)
+	std::tuple<arma::cx_cube,arma::ivec> function_building_M_k1k2_ij(arma::vec excitonic_momentum,int diagonal_k,int small_excitonic_momentum,int radius_convergence);
+	/// ks states at k-parameter_l and k-parameter_r; if the two shifts are closer than threshold_perturbative_momentum,
+	/// and the perturbative mode is active, the states at k-parameter_r are obtained by k.p from the ones at k-parameter_l (one diagonalization instead of two)
+	/// all the k points of the list are diagonalized in batch; one slice per k point
+	std::tuple<arma::cube,arma::cx_cube,arma::cube,arma::cx_cube> function_building_ks_states_left_right(arma::vec parameter_l,arma::vec parameter_r,int left,int right);
+	void push_perturbative_small_momentum(int perturbative_small_momentum_tmp,double threshold_perturbative_momentum_tmp,double threshold_perturbative_degeneracy_tmp);
+	void push_time_reversal_symmetry(int time_reversal_symmetry_tmp,arma::ivec time_reversal_partners_tmp);
+	void push_ks_states_store(Ks_States_Store *ks_states_store_tmp);
+	void push_point_dipole_approximation(int point_dipole_approximation_tmp);
+	void push_small_q_moments_file_name(string small_q_moments_file_name_tmp);
+	/// ks states (subset) on the k points list shifted by -parameter, only one k point of each pair (k,-k) is diagonalized if parameter=0
+	std::tuple<arma::cube,arma::cx_cube> function_building_ks_states_subset(arma::vec parameter,int number_valence_bands_selected,int number_conduction_bands_selected);
 	///rho_{n1,n2,k1-p,k2-q}(excitonic_momentum,G)=\bra{n1k1-p}e^{i(excitonic_momentum+G)r\ket{n2k2-q}
 	std::tuple<arma::cx_mat,arma::cx_mat,arma::cx_mat> pull_values(arma::vec excitonic_momentum,arma::vec parameter_l,arma::vec parameter_r,int diagonal_k,int minus,int left,int right,int reverse,int reverse_kk,double threshold_proximity,int small_excitonic_momentum,int radius_convergence);
+	/// several rho blocks (excitonic_momentum,parameter_l,parameter_r,diagonal_k,left,right,reverse,small_excitonic_momentum,radius_convergence) in one call:
+	/// the ks states of each shift and the M tables of each momentum are calculated once and shared among the blocks
+	std::vector<std::tuple<arma::cx_mat,arma::cx_mat,arma::cx_mat>> pull_values_blocks(std::vector<std::tuple<arma::vec,arma::vec,arma::vec,int,int,int,int,int,int>> blocks,double threshold_proximity);
+	/// k-pair rho (diagonal_k==0, reverse==0) restricted to a tile of right k points: rows spin,n,m,k_left*number_k_points_tile+(k_right-first_k_point_tile)
+	/// with push_rho_cache(1) the ks states and the M tables are calculated with the first tile and reused by the following ones
+	std::tuple<arma::cx_mat,arma::cx_mat,arma::cx_mat> pull_values_k_tile(arma::vec excitonic_momentum,arma::vec parameter_l,arma::vec parameter_r,int left,int right,double threshold_proximity,int radius_convergence,int first_k_point_tile_tmp,int number_k_points_tile_tmp);
+	/// 1: caching ks states and M tables among the following calls, 0: releasing them
+	void push_rho_cache(int rho_cache_tmp);
 ////arma::mat function_translate(arma::mat wannier,int i,int j,int k);
 	void print(arma::vec excitonic_momentum,arma::vec parameter_l,arma::vec parameter_r,int diagonal_k,int minus,int left, int right,double threshold_proximity);
 	arma::mat pull_bravais_lattice(){
@@ -1393,12 +2633,22 @@ public:
 ///};
 
 
-Dipole_Elements::Dipole_Elements(int number_k_points_list_tmp,arma::mat k_points_list_tmp, int number_g_points_list_tmp,arma::mat g_points_list_tmp, int number_wannier_centers_tmp, int number_valence_bands_tmp, int number_conduction_bands_tmp, Hamiltonian_TB *hamiltonian_tb_tmp,int spinorial_calculation_tmp, Real_space_wannier* real_space_wannier_tmp, arma::vec number_primitive_cells_integration_tmp, arma::vec number_unit_cells_supercell_tmp, arma::vec number_points_real_space_grid_tmp,double radius_building_kernel_tmp,double threshold_building_kernel_tmp):
-k_points_list(3,number_k_points_list_tmp), g_points_list(3,number_g_points_list_tmp), wannier_centers(spinorial_calculation_tmp+1), indexingi(number_primitive_cells_integration_tmp(0),number_unit_cells_supercell_tmp(0)), indexingj(number_primitive_cells_integration_tmp(1),number_unit_cells_supercell_tmp(1)), indexingk(number_primitive_cells_integration_tmp(2),number_unit_cells_supercell_tmp(2)), real_space_wannier_functions_list(number_points_real_space_grid_tmp(0)*number_points_real_space_grid_tmp(1)*number_points_real_space_grid_tmp(2)/(number_unit_cells_supercell_tmp(0)*number_unit_cells_supercell_tmp(1)*number_unit_cells_supercell_tmp(2)),number_unit_cells_supercell_tmp(0)*number_unit_cells_supercell_tmp(1)*number_unit_cells_supercell_tmp(2)*(spinorial_calculation_tmp+1)*number_wannier_centers_tmp)
+Dipole_Elements::Dipole_Elements(int number_k_points_list_tmp,arma::mat k_points_list_tmp, int number_g_points_list_tmp,arma::mat g_points_list_tmp, int number_wannier_centers_tmp, int number_valence_bands_tmp, int number_conduction_bands_tmp, Hamiltonian_TB *hamiltonian_tb_tmp,int spinorial_calculation_tmp, Real_space_wannier* real_space_wannier_tmp, arma::vec number_primitive_cells_integration_tmp,double radius_building_kernel_tmp,double threshold_building_kernel_tmp):
+k_points_list(3,number_k_points_list_tmp), g_points_list(3,number_g_points_list_tmp), wannier_centers(spinorial_calculation_tmp+1), wannier_grid(real_space_wannier_tmp,number_primitive_cells_integration_tmp)
 {
 
 	radius_building_kernel=radius_building_kernel_tmp;
 	threshold_building_kernel=threshold_building_kernel_tmp;
+	perturbative_small_momentum=0;
+	threshold_perturbative_momentum=0.0;
+	threshold_perturbative_degeneracy=minval;
+	time_reversal_symmetry=0;
+	ks_states_store=NULL;
+	point_dipole_approximation=0;
+	rho_cache=0;
+	first_k_point_tile=0;
+	number_k_points_tile=number_k_points_list_tmp;
+	small_q_moments_file_name="";
 
 	number_g_points_list=number_g_points_list_tmp;
 	number_conduction_bands=number_conduction_bands_tmp;
@@ -1419,7 +2669,6 @@ k_points_list(3,number_k_points_list_tmp), g_points_list(3,number_g_points_list_
 	origin=real_space_wannier_tmp->pull_origin();
 	origin_unitcell=real_space_wannier_tmp->pull_origin_unitcell();
 	supercell_axis=real_space_wannier_tmp->pull_supercell_axis();
-	real_space_wannier_functions_list=real_space_wannier_tmp->pull_real_space_wannier_functions_list();
 
 	for(int r=0;r<3;r++)
 		number_points_real_space_grid_percell(r)=number_points_real_space_grid(r)/number_unit_cells_supercell(r);
@@ -1438,71 +2687,37 @@ k_points_list(3,number_k_points_list_tmp), g_points_list(3,number_g_points_list_
 	}
 	wannier_centers=hamiltonian_tb->pull_wannier_centers();
 
-	for(int i1=0;i1<number_primitive_cells_integration(0);i1++)
-		for(int j1=0;j1<number_primitive_cells_integration(1);j1++)
-			for(int k1=0;k1<number_primitive_cells_integration(2);k1++)
-				for(int i2=0;i2<number_unit_cells_supercell(0);i2++)
-					for(int j2=0;j2<number_unit_cells_supercell(1);j2++)
-						for(int k2=0;k2<number_unit_cells_supercell(2);k2++){
-							indexingi(i1,i2)=i2-(i1-int(number_primitive_cells_integration(0)/2));
-							indexingj(j1,j2)=j2-(j1-int(number_primitive_cells_integration(1)/2));
-							indexingk(k1,k2)=k2-(k1-int(number_primitive_cells_integration(2)/2));
-							if(indexingi(i1,i2)>=number_unit_cells_supercell(0))
-								indexingi(i1,i2)=-1;
-							if(indexingj(j1,j2)>=number_unit_cells_supercell(1))
-								indexingj(j1,j2)=-1;
-							if(indexingk(k1,k2)>=number_unit_cells_supercell(2))
-								indexingk(k1,k2)=-1;
-						}
-
 };
-arma::field<arma::cx_mat> Dipole_Elements::function_building_exponential_factor(arma::vec excitonic_momentum,int diagonal_k,int minus){
-	if(diagonal_k==1){
-		arma::vec excitonic_momentum_tmp=excitonic_momentum/arma::vecnorm(excitonic_momentum);
-		arma::field<arma::cx_mat> M_matrix(number_g_points_list);
-		int basis=(spinorial_calculation+1)*number_wannier_centers;
-		for(int i=0;i<number_g_points_list;i++)
-			M_matrix(i).zeros(basis,basis);
-
-		double temporary_variable; arma::vec wannier_center(3);
-		for(int spin_channel=0;spin_channel<(spinorial_calculation+1);spin_channel++)
-			for(int g=0; g<number_g_points_list; g++)
-				for(int i=0; i<number_wannier_centers; i++){
-					temporary_variable=0.0;
-					wannier_center=(wannier_centers(spin_channel)).col(i);
-					for(int r=0; r<3; r++)
-						temporary_variable+=(wannier_center(r)*((1-minus*2)*(g_points_list(r,g)+excitonic_momentum_tmp(r))));
-					///M_matrix(g)(spin_channel*number_wannier_centers+i,spin_channel*number_wannier_centers+i).real(std::cos(temporary_variable));
-					M_matrix(g)(spin_channel*number_wannier_centers+i,spin_channel*number_wannier_centers+i).imag(std::sin(temporary_variable));
-				}
-		return M_matrix;
-	}else{
-		arma::field<arma::cx_mat> M_matrix(number_g_points_list*number_k_points_list*number_k_points_list);
-		for(int i=0;i<number_g_points_list;i++)
-			for(int k1=0;k1<number_k_points_list;k1++)
-				for(int k2=0;k2<number_k_points_list;k2++)
-					M_matrix(i*number_k_points_list*number_k_points_list+k1*number_k_points_list+k2).zeros((spinorial_calculation+1)*number_wannier_centers,(spinorial_calculation+1)*number_wannier_centers);
-		double temporary_variable; arma::vec wannier_center(3);
-		for(int spin_channel=0;spin_channel<(spinorial_calculation+1);spin_channel++)
-			for(int g=0; g<number_g_points_list; g++)
-				for(int k=0; k<number_k_points_list; k++)
-					for(int l=0; l<number_k_points_list; l++)
-						for(int i=0; i<number_wannier_centers; i++){
-							temporary_variable=0.0;
-							wannier_center=(wannier_centers(spin_channel)).col(i);
-							for(int r=0; r<3; r++)
-								temporary_variable+=(wannier_center(r)*((1-minus*2)*(g_points_list(r,g)+excitonic_momentum(r)+k_points_list(r,k)-k_points_list(r,l))));
-							M_matrix(g*number_k_points_list*number_k_points_list+k*number_k_points_list+l)(spin_channel*number_wannier_centers+i,spin_channel*number_wannier_centers+i).real(std::cos(temporary_variable));
-							M_matrix(g*number_k_points_list*number_k_points_list+k*number_k_points_list+l)(spin_channel*number_wannier_centers+i,spin_channel*number_wannier_centers+i).imag(std::sin(temporary_variable));
-						}
-		return M_matrix;	
-
-	}
+arma::cx_mat Dipole_Elements::function_building_exponential_factor(arma::vec excitonic_momentum,int diagonal_k,int minus){
+	int basis=(spinorial_calculation+1)*number_wannier_centers;
+	int number_columns=number_g_points_list;
+	if(diagonal_k==0)
+		number_columns=number_g_points_list+number_k_points_list;
+	arma::cx_mat exponential_factor(basis,number_columns);
+	double temporary_variable; arma::vec wannier_center(3); arma::vec momentum(3);
+	for(int spin_channel=0;spin_channel<(spinorial_calculation+1);spin_channel++)
+		for(int c=0;c<number_columns;c++){
+			if(c<number_g_points_list)
+				momentum=excitonic_momentum+g_points_list.col(c);
+			else
+				momentum=k_points_list.col(c-number_g_points_list);
+			for(int i=0;i<number_wannier_centers;i++){
+				temporary_variable=0.0;
+				wannier_center=(wannier_centers(spin_channel)).col(i);
+				for(int r=0;r<3;r++)
+					temporary_variable+=(wannier_center(r)*((1-minus*2)*momentum(r)));
+				exponential_factor(spin_channel*number_wannier_centers+i,c).real(std::cos(temporary_variable));
+				exponential_factor(spin_channel*number_wannier_centers+i,c).imag(std::sin(temporary_variable));
+			}
+		}
+	return exponential_factor;
 };
-
 arma::cx_vec Dipole_Elements::function_building_real_space_wannier_dipole_ij(int number_wannier_1,int number_wannier_2,arma::vec excitonic_momentum,arma::vec g_momentum){
-	arma::cx_vec A_matrix((spinorial_calculation+1)*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2),arma::fill::zeros);
-	double exponent;
+	const int number_primitive_cells=wannier_grid.pull_number_cells_integration();
+	const int number_cells_supercell=wannier_grid.pull_number_cells_supercell();
+	const int number_points_percell=wannier_grid.pull_number_points_cell();
+	const int number_elements=(spinorial_calculation+1)*number_primitive_cells;
+	arma::cx_vec A_matrix(number_elements,arma::fill::zeros);
 	double factor=number_unit_cells_supercell(0)*number_unit_cells_supercell(1)*number_unit_cells_supercell(2)*volume_cell/double(number_points_real_space_grid_total);
 	////(number_unit_cells_supercell(0)*number_unit_cells_supercell(1)*number_unit_cells_supercell(2)*volume_cell);
 	////\int dr w_1\sigma(r-R)e^{i(q+G)r}W_1\sigma(r)
@@ -1510,318 +2725,385 @@ arma::cx_vec Dipole_Elements::function_building_real_space_wannier_dipole_ij(int
 	/// the strategy is to traslate it and putting to zero all elements outside the wannier supercell
 	///wannier3=function_translate(wannier1,i1,j1,k1);
 	////this is the integral over the wannier supercell
-	#pragma omp parallel for collapse(7) private(exponent) shared(A_matrix)
-	for(int i1=0;i1<int(number_primitive_cells_integration(0));i1++)
-		for(int j1=0;j1<int(number_primitive_cells_integration(1));j1++)
-			for(int k1=0;k1<int(number_primitive_cells_integration(2));k1++)
-				for(int spin=0;spin<(spinorial_calculation+1);spin++)
-					for(int k2=0;k2<int(number_unit_cells_supercell(2));k2++)
-						for(int j2=0;j2<int(number_unit_cells_supercell(1));j2++)
-							for(int i2=0;i2<int(number_unit_cells_supercell(0));i2++)
-								if(indexingi(i1,i2)>=0&&indexingj(j1,j2)>=0&&indexingk(k1,k2)>=0)
-								{
-									for(int l2=0;l2<number_points_real_space_grid_percell(2);l2++)
-										for(int t2=0;t2<number_points_real_space_grid_percell(1);t2++)
-											for(int s2=0;s2<number_points_real_space_grid_percell(0);s2++)
-												{
-													exponent=arma::accu((g_momentum+excitonic_momentum)%(origin+(i2+s2/number_points_real_space_grid_percell(0))*supercell_axis.col(0)+(j2+t2/number_points_real_space_grid_percell(1))*supercell_axis.col(1)+(k2+l2/number_points_real_space_grid_percell(2))*supercell_axis.col(2)));
-													A_matrix(spin*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+i1*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+j1*number_primitive_cells_integration(2)+k1).real(std::real(A_matrix(spin*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+i1*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+j1*number_primitive_cells_integration(2)+k1))+factor*std::cos(exponent)*(real_space_wannier_functions_list(s2*number_points_real_space_grid_percell(1)*number_points_real_space_grid_percell(2)+t2*number_points_real_space_grid_percell(2)+l2,spin*number_wannier_centers*number_unit_cells_supercell(0)*number_unit_cells_supercell(1)*number_unit_cells_supercell(2)+number_wannier_1*number_unit_cells_supercell(0)*number_unit_cells_supercell(1)*number_unit_cells_supercell(2)+indexingi(i1,i2)*number_unit_cells_supercell(1)*number_unit_cells_supercell(2)+indexingj(j1,j2)*number_unit_cells_supercell(2)+indexingk(k1,k2)))*(real_space_wannier_functions_list(s2*number_points_real_space_grid_percell(1)*number_points_real_space_grid_percell(2)+t2*number_points_real_space_grid_percell(2)+l2,spin*number_wannier_centers*number_unit_cells_supercell(0)*number_unit_cells_supercell(1)*number_unit_cells_supercell(2)+number_wannier_2*number_unit_cells_supercell(0)*number_unit_cells_supercell(1)*number_unit_cells_supercell(2)+i2*number_unit_cells_supercell(1)*number_unit_cells_supercell(2)+j2*number_unit_cells_supercell(2)+k2)));
-													A_matrix(spin*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+i1*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+j1*number_primitive_cells_integration(2)+k1).imag(std::imag(A_matrix(spin*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+i1*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+j1*number_primitive_cells_integration(2)+k1))+factor*std::sin(exponent)*(real_space_wannier_functions_list(s2*number_points_real_space_grid_percell(1)*number_points_real_space_grid_percell(2)+t2*number_points_real_space_grid_percell(2)+l2,spin*number_wannier_centers*number_unit_cells_supercell(0)*number_unit_cells_supercell(1)*number_unit_cells_supercell(2)+number_wannier_1*number_unit_cells_supercell(0)*number_unit_cells_supercell(1)*number_unit_cells_supercell(2)+indexingi(i1,i2)*number_unit_cells_supercell(1)*number_unit_cells_supercell(2)+indexingj(j1,j2)*number_unit_cells_supercell(2)+indexingk(k1,k2)))*(real_space_wannier_functions_list(s2*number_points_real_space_grid_percell(1)*number_points_real_space_grid_percell(2)+t2*number_points_real_space_grid_percell(2)+l2,spin*number_wannier_centers*number_unit_cells_supercell(0)*number_unit_cells_supercell(1)*number_unit_cells_supercell(2)+number_wannier_2*number_unit_cells_supercell(0)*number_unit_cells_supercell(1)*number_unit_cells_supercell(2)+i2*number_unit_cells_supercell(1)*number_unit_cells_supercell(2)+j2*number_unit_cells_supercell(2)+k2)));
-												}
-								}
+
+	/// phases e^{i(q+G)r} on the supercell grid, shared by all the (R,spin) elements
+	/// (point p=s2*N1*N2+t2*N2+l2 and cell c=i2*M1*M2+j2*M2+k2 as the blocks of wannier_grid)
+	arma::mat cos_phases(number_points_percell,number_cells_supercell);
+	arma::mat sin_phases(number_points_percell,number_cells_supercell);
+	arma::vec momentum=g_momentum+excitonic_momentum;
+	#pragma omp parallel for if(!omp_in_parallel())
+	for(int c=0;c<number_cells_supercell;c++){
+		int i2; int j2; int k2;
+		wannier_grid.pull_cell_coordinates(c,i2,j2,k2);
+		for(int p=0;p<number_points_percell;p++){
+			int s2; int t2; int l2;
+			wannier_grid.pull_point_coordinates(p,s2,t2,l2);
+			double exponent=0.0;
+			for(int r=0;r<3;r++)
+				exponent+=momentum(r)*(origin(r)+(i2+s2/number_points_real_space_grid_percell(0))*supercell_axis(r,0)+(j2+t2/number_points_real_space_grid_percell(1))*supercell_axis(r,1)+(k2+l2/number_points_real_space_grid_percell(2))*supercell_axis(r,2));
+			cos_phases(p,c)=std::cos(exponent);
+			sin_phases(p,c)=std::sin(exponent);
+		}
+	}
+
+	/// every (element,cell) partial sum belongs to a single thread and is summed over the grid in a fixed order,
+	/// the cells are then reduced serially: the result does not depend on the number of threads
+	arma::cx_mat partial_sums(number_elements,number_cells_supercell,arma::fill::zeros);
+	#pragma omp parallel for collapse(2) schedule(static) if(!omp_in_parallel())
+	for(int e=0;e<number_elements;e++)
+		for(int c=0;c<number_cells_supercell;c++){
+			int spin=e/number_primitive_cells;
+			int shifted_cell=wannier_grid.pull_shifted_cell(e%number_primitive_cells,c);
+			if(shifted_cell>=0){
+				const double* wannier_1=wannier_grid.pull_block(spin,number_wannier_1,shifted_cell);
+				const double* wannier_2=wannier_grid.pull_block(spin,number_wannier_2,c);
+				const double* cos_phase=cos_phases.colptr(c);
+				const double* sin_phase=sin_phases.colptr(c);
+				double real_part=0.0;
+				double imag_part=0.0;
+				#pragma omp simd reduction(+:real_part,imag_part)
+				for(int p=0;p<number_points_percell;p++){
+					double product=wannier_1[p]*wannier_2[p];
+					real_part+=cos_phase[p]*product;
+					imag_part+=sin_phase[p]*product;
+				}
+				partial_sums(e,c).real(factor*real_part);
+				partial_sums(e,c).imag(factor*imag_part);
+			}
+		}
+	for(int c=0;c<number_cells_supercell;c++)
+		for(int e=0;e<number_elements;e++)
+			A_matrix(e)+=partial_sums(e,c);
 	return A_matrix;
 };
 
 std::tuple<arma::cx_mat,arma::cx_vec> Dipole_Elements::function_building_real_space_wannier_dipole_ij_small_q(int number_wannier_1,int number_wannier_2,arma::vec g_momentum){
-	arma::cx_mat A_matrix((spinorial_calculation+1)*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2),3,arma::fill::zeros);
-	arma::cx_vec A_vector((spinorial_calculation+1)*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2),arma::fill::zeros);
+	const int number_primitive_cells=wannier_grid.pull_number_cells_integration();
+	const int number_cells_supercell=wannier_grid.pull_number_cells_supercell();
+	const int number_points_percell=wannier_grid.pull_number_points_cell();
+	const int number_elements=(spinorial_calculation+1)*number_primitive_cells;
+	arma::cx_mat A_matrix(number_elements,3,arma::fill::zeros);
+	arma::cx_vec A_vector(number_elements,arma::fill::zeros);
 
 	double factor=number_unit_cells_supercell(0)*number_unit_cells_supercell(1)*number_unit_cells_supercell(2)*volume_cell/double(number_points_real_space_grid_total);
-	double exponent;
-	////(number_unit_cells_supercell(0)*number_unit_cells_supercell(1)*number_unit_cells_supercell(2)*volume_cell);
-	///(number_unit_cells_supercell(0)*number_unit_cells_supercell(1)*number_unit_cells_supercell(2)*volume_cell);
-	////\int dr w_1\sigma(r-R)e^{i(q+G)r}W_1\sigma(r)
-	////it is necessary to translate the wannier function
-	/// the strategy is to traslate it and putting to zero all elements outside the wannier supercell
-	///wannier3=function_translate(wannier1,i1,j1,k1);
-	////this is the integral over the wannier supercell;
+	////\int dr w_1\sigma(r-R)r e^{iGr}W_2\sigma(r) and \int dr w_1\sigma(r-R)e^{iGr}W_2\sigma(r): the first order in q of the integral at q+G
+
+	/// positions and phases e^{iGr} on the supercell grid (same layout of function_building_real_space_wannier_dipole_ij)
+	arma::mat positions(3*number_points_percell,number_cells_supercell);
+	arma::mat cos_phases(number_points_percell,number_cells_supercell);
+	arma::mat sin_phases(number_points_percell,number_cells_supercell);
+	#pragma omp parallel for if(!omp_in_parallel())
+	for(int c=0;c<number_cells_supercell;c++){
+		int i2; int j2; int k2;
+		wannier_grid.pull_cell_coordinates(c,i2,j2,k2);
+		for(int p=0;p<number_points_percell;p++){
+			int s2; int t2; int l2;
+			wannier_grid.pull_point_coordinates(p,s2,t2,l2);
+			double exponent=0.0;
+			for(int r=0;r<3;r++){
+				positions(3*p+r,c)=origin(r)+(i2+s2/number_points_real_space_grid_percell(0))*supercell_axis(r,0)+(j2+t2/number_points_real_space_grid_percell(1))*supercell_axis(r,1)+(k2+l2/number_points_real_space_grid_percell(2))*supercell_axis(r,2);
+				exponent+=g_momentum(r)*positions(3*p+r,c);
+			}
+			cos_phases(p,c)=std::cos(exponent);
+			sin_phases(p,c)=std::sin(exponent);
+		}
+	}
 
-	#pragma omp parallel for collapse(8) private(exponent) shared(A_matrix,A_vector)
-	for(int i1=0;i1<int(number_primitive_cells_integration(0));i1++)
-		for(int j1=0;j1<int(number_primitive_cells_integration(1));j1++)
-			for(int k1=0;k1<int(number_primitive_cells_integration(2));k1++)
-				for(int spin=0;spin<(spinorial_calculation+1);spin++)
-					for(int r=0;r<3;r++)
-						for(int i2=0;i2<int(number_unit_cells_supercell(0));i2++)
-							for(int j2=0;j2<int(number_unit_cells_supercell(1));j2++)
-								for(int k2=0;k2<int(number_unit_cells_supercell(2));k2++)
-									if(indexingi(i1,i2)>=0&&indexingj(j1,j2)>=0&&indexingk(k1,k2)>=0)
-									{
-										for(int s2=0;s2<int(number_points_real_space_grid_percell(0));s2++)
-											for(int t2=0;t2<int(number_points_real_space_grid_percell(1));t2++)
-												for(int l2=0;l2<int(number_points_real_space_grid_percell(2));l2++){
-													exponent=(origin(r)+(i2+s2/number_points_real_space_grid_percell(0))*supercell_axis(r,0)+(j2+t2/number_points_real_space_grid_percell(1))*supercell_axis(r,1)+(k2+l2/number_points_real_space_grid_percell(2))*supercell_axis(r,2));
-													A_matrix(spin*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+i1*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+j1*number_primitive_cells_integration(2)+k1,r).imag(std::imag(A_matrix(spin*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+i1*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+j1*number_primitive_cells_integration(2)+k1,r))+factor*(exponent)*(real_space_wannier_functions_list(s2*number_points_real_space_grid_percell(1)*number_points_real_space_grid_percell(2)+t2*number_points_real_space_grid_percell(2)+l2,spin*number_wannier_centers*number_unit_cells_supercell(0)*number_unit_cells_supercell(1)*number_unit_cells_supercell(2)+number_wannier_1*number_unit_cells_supercell(0)*number_unit_cells_supercell(1)*number_unit_cells_supercell(2)+indexingi(i1,i2)*number_unit_cells_supercell(1)*number_unit_cells_supercell(2)+indexingj(j1,j2)*number_unit_cells_supercell(2)+indexingk(k1,k2)))*(real_space_wannier_functions_list(s2*number_points_real_space_grid_percell(1)*number_points_real_space_grid_percell(2)+t2*number_points_real_space_grid_percell(2)+l2,spin*number_wannier_centers*number_unit_cells_supercell(0)*number_unit_cells_supercell(1)*number_unit_cells_supercell(2)+number_wannier_2*number_unit_cells_supercell(0)*number_unit_cells_supercell(1)*number_unit_cells_supercell(2)+i2*number_unit_cells_supercell(1)*number_unit_cells_supercell(2)+j2*number_unit_cells_supercell(2)+k2)));			
-													if(r==0)
-														A_vector(spin*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+i1*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+j1*number_primitive_cells_integration(2)+k1).real(std::real(A_vector(spin*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+i1*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+j1*number_primitive_cells_integration(2)+k1))+factor*std::real(real_space_wannier_functions_list(s2*number_points_real_space_grid_percell(1)*number_points_real_space_grid_percell(2)+t2*number_points_real_space_grid_percell(2)+l2,spin*number_wannier_centers*number_unit_cells_supercell(0)*number_unit_cells_supercell(1)*number_unit_cells_supercell(2)+number_wannier_1*number_unit_cells_supercell(0)*number_unit_cells_supercell(1)*number_unit_cells_supercell(2)+indexingi(i1,i2)*number_unit_cells_supercell(1)*number_unit_cells_supercell(2)+indexingj(j1,j2)*number_unit_cells_supercell(2)+indexingk(k1,k2)))*(real_space_wannier_functions_list(s2*number_points_real_space_grid_percell(1)*number_points_real_space_grid_percell(2)+t2*number_points_real_space_grid_percell(2)+l2,spin*number_wannier_centers*number_unit_cells_supercell(0)*number_unit_cells_supercell(1)*number_unit_cells_supercell(2)+number_wannier_2*number_unit_cells_supercell(0)*number_unit_cells_supercell(1)*number_unit_cells_supercell(2)+i2*number_unit_cells_supercell(1)*number_unit_cells_supercell(2)+j2*number_unit_cells_supercell(2)+k2)));		
-												}
-									}
+	/// same scheme of function_building_real_space_wannier_dipole_ij: one partial sum per (element,cell), serial reduction over the cells
+	/// rows 2*(e*3+r)(+1): real (imaginary) part of the position moment, 2*e(+1) of the overlap
+	arma::mat partial_sums_position(2*number_elements*3,number_cells_supercell,arma::fill::zeros);
+	arma::mat partial_sums_overlap(2*number_elements,number_cells_supercell,arma::fill::zeros);
+	#pragma omp parallel for collapse(2) schedule(static) if(!omp_in_parallel())
+	for(int e=0;e<number_elements;e++)
+		for(int c=0;c<number_cells_supercell;c++){
+			int spin=e/number_primitive_cells;
+			int shifted_cell=wannier_grid.pull_shifted_cell(e%number_primitive_cells,c);
+			if(shifted_cell>=0){
+				const double* wannier_1=wannier_grid.pull_block(spin,number_wannier_1,shifted_cell);
+				const double* wannier_2=wannier_grid.pull_block(spin,number_wannier_2,c);
+				const double* position=positions.colptr(c);
+				const double* cos_phase=cos_phases.colptr(c);
+				const double* sin_phase=sin_phases.colptr(c);
+				double position_real_part[3]={0.0,0.0,0.0};
+				double position_imag_part[3]={0.0,0.0,0.0};
+				double overlap_real_part=0.0;
+				double overlap_imag_part=0.0;
+				#pragma omp simd reduction(+:position_real_part[:3],position_imag_part[:3],overlap_real_part,overlap_imag_part)
+				for(int p=0;p<number_points_percell;p++){
+					double product_real=wannier_1[p]*wannier_2[p]*cos_phase[p];
+					double product_imag=wannier_1[p]*wannier_2[p]*sin_phase[p];
+					for(int r=0;r<3;r++){
+						position_real_part[r]+=position[3*p+r]*product_real;
+						position_imag_part[r]+=position[3*p+r]*product_imag;
+					}
+					overlap_real_part+=product_real;
+					overlap_imag_part+=product_imag;
+				}
+				for(int r=0;r<3;r++){
+					partial_sums_position(2*(e*3+r),c)=factor*position_real_part[r];
+					partial_sums_position(2*(e*3+r)+1,c)=factor*position_imag_part[r];
+				}
+				partial_sums_overlap(2*e,c)=factor*overlap_real_part;
+				partial_sums_overlap(2*e+1,c)=factor*overlap_imag_part;
+			}
+		}
+	/// A_matrix=i\int r..., A_vector=\int ... (at G=0 the position moment is purely imaginary, as before)
+	for(int c=0;c<number_cells_supercell;c++)
+		for(int e=0;e<number_elements;e++){
+			for(int r=0;r<3;r++)
+				A_matrix(e,r)+=arma::cx_double(-partial_sums_position(2*(e*3+r)+1,c),partial_sums_position(2*(e*3+r),c));
+			A_vector(e)+=arma::cx_double(partial_sums_overlap(2*e,c),partial_sums_overlap(2*e+1,c));
+		}
 	return {A_matrix,A_vector};
 };
 
-arma::field<arma::cx_mat> Dipole_Elements::function_building_M_k1k2_ij(arma::vec excitonic_momentum,int diagonal_k, int small_excitonic_momentum,int radius_convergence){
+void Dipole_Elements::function_building_small_q_moments(){
+	const int number_elements=(spinorial_calculation+1)*int(number_primitive_cells_integration(0))*int(number_primitive_cells_integration(1))*int(number_primitive_cells_integration(2));
+	arma::vec small_q_setup=function_building_small_q_setup();
+	if(small_q_moments_file_name!=""){
+		arma::mat g_points_list_stored;
+		arma::vec small_q_setup_stored;
+		if(g_points_list_stored.load(small_q_moments_file_name+"_g_points.bin")&&small_q_setup_stored.load(small_q_moments_file_name+"_small_q_setup.bin")&&small_q_moments.load(small_q_moments_file_name+"_small_q_moments.bin")){
+			if(g_points_list_stored.n_cols==g_points_list.n_cols&&arma::norm(g_points_list_stored-g_points_list)<minval
+				&&small_q_setup_stored.n_elem==small_q_setup.n_elem&&arma::norm(small_q_setup_stored-small_q_setup)<minval*(1.0+arma::norm(small_q_setup))
+				&&int(small_q_moments.n_rows)==number_elements&&small_q_moments.n_cols==3&&int(small_q_moments.n_slices)==number_wannier_centers*number_wannier_centers*number_g_points_list){
+				cout<<"Reading stored small q moments"<<endl;
+				return;
+			}
+			cout<<"Stored small q moments do not match the G list or the real space setup, recalculating"<<endl;
+		}
+	}
+	cout<<"Building small q moments"<<endl;
+	small_q_moments.zeros(number_elements,3,number_wannier_centers*number_wannier_centers*number_g_points_list);
+	#pragma omp parallel for collapse(3) schedule(dynamic)
+	for(int w1=0;w1<number_wannier_centers;w1++)
+		for(int w2=0;w2<number_wannier_centers;w2++)
+			for(int i=0;i<number_g_points_list;i++){
+				std::tuple<arma::cx_mat,arma::cx_vec> temporary_vector=function_building_real_space_wannier_dipole_ij_small_q(w1,w2,g_points_list.col(i));
+				int slice=(w1*number_wannier_centers+w2)*number_g_points_list+i;
+				for(int s=0;s<number_elements;s++)
+					for(int r=0;r<3;r++)
+						small_q_moments(s,r,slice)=get<0>(temporary_vector)(s,r);
+			}
+	if(small_q_moments_file_name!=""){
+		g_points_list.save(small_q_moments_file_name+"_g_points.bin");
+		small_q_setup.save(small_q_moments_file_name+"_small_q_setup.bin");
+		small_q_moments.save(small_q_moments_file_name+"_small_q_moments.bin");
+	}
+};
+arma::vec Dipole_Elements::function_building_small_q_setup(){
+	arma::vec small_q_setup(29);
+	small_q_setup(0)=spinorial_calculation;
+	small_q_setup(1)=number_wannier_centers;
+	for(int r=0;r<3;r++){
+		small_q_setup(2+r)=number_primitive_cells_integration(r);
+		small_q_setup(5+r)=number_unit_cells_supercell(r);
+		small_q_setup(8+r)=number_points_real_space_grid(r);
+		small_q_setup(11+r)=origin(r);
+		for(int p=0;p<3;p++)
+			small_q_setup(14+3*p+r)=supercell_axis(r,p);
+	}
+	small_q_setup(23)=volume_cell;
+	small_q_setup(24)=wannier_grid.pull_sum_values();
+	small_q_setup(25)=number_points_real_space_grid_total;
+	for(int r=0;r<3;r++)
+		small_q_setup(26+r)=origin_unitcell(r);
+	return small_q_setup;
+};
+void Dipole_Elements::push_small_q_moments_file_name(string small_q_moments_file_name_tmp){
+	small_q_moments_file_name=small_q_moments_file_name_tmp;
+};
+
+arma::cx_vec Dipole_Elements::function_building_mirror_dipole(const arma::cx_vec& A_matrix,arma::vec momentum){
+	arma::cx_vec A_matrix_mirror(A_matrix.n_elem);
+	double exponent;
+	for(int spin=0;spin<(spinorial_calculation+1);spin++)
+		for(int i1=0;i1<number_primitive_cells_integration(0);i1++)
+			for(int j1=0;j1<number_primitive_cells_integration(1);j1++)
+				for(int k1=0;k1<number_primitive_cells_integration(2);k1++){
+					int i1_mirror=int(number_primitive_cells_integration(0))-1-i1;
+					int j1_mirror=int(number_primitive_cells_integration(1))-1-j1;
+					int k1_mirror=int(number_primitive_cells_integration(2))-1-k1;
+					exponent=arma::accu(momentum%((i1-int(number_primitive_cells_integration(0)/2))*supercell_axis.col(0)+(j1-int(number_primitive_cells_integration(1)/2))*supercell_axis.col(1)+(k1-int(number_primitive_cells_integration(2)/2))*supercell_axis.col(2)));
+					arma::cx_double phase(std::cos(exponent),std::sin(exponent));
+					A_matrix_mirror(spin*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+i1*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+j1*number_primitive_cells_integration(2)+k1)=
+						phase*A_matrix(spin*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+i1_mirror*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+j1_mirror*number_primitive_cells_integration(2)+k1_mirror);
+				}
+	return A_matrix_mirror;
+};
+std::vector<std::tuple<int,int>> Dipole_Elements::function_building_wannier_pairs(int mirror_cells){
+	std::vector<std::tuple<int,int>> wannier_pairs;
+	for(int w1=0;w1<number_wannier_centers;w1++)
+		for(int w2=mirror_cells*w1;w2<number_wannier_centers;w2++)
+			wannier_pairs.push_back(std::make_tuple(w1,w2));
+	return wannier_pairs;
+};
+void Dipole_Elements::function_adding_M_block(arma::cx_cube& M_matrix,int slice,int w1,int w2,const arma::cx_vec& A_matrix,arma::vec momentum_transfer){
+	double exponent;
+	for(int spin=0;spin<(spinorial_calculation+1);spin++)
+		for(int l1=0;l1<number_primitive_cells_integration(0);l1++)
+			for(int j1=0;j1<number_primitive_cells_integration(1);j1++)
+				for(int k1=0;k1<number_primitive_cells_integration(2);k1++){
+					exponent=arma::accu(momentum_transfer%(origin_unitcell+(l1-int(number_primitive_cells_integration(0)/2))*bravais_lattice.col(0)+(j1-int(number_primitive_cells_integration(1)/2))*bravais_lattice.col(1)+(k1-int(number_primitive_cells_integration(2)/2))*bravais_lattice.col(2)));
+					arma::cx_double phase(std::cos(exponent),std::sin(exponent));
+					M_matrix(spin*number_wannier_centers+w1,spin*number_wannier_centers+w2,slice)+=phase*A_matrix(spin*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+l1*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+j1*number_primitive_cells_integration(2)+k1);
+				}
+};
+std::tuple<arma::cx_cube,arma::ivec> Dipole_Elements::function_building_M_k1k2_ij(arma::vec excitonic_momentum,int diagonal_k, int small_excitonic_momentum,int radius_convergence){
 	cout<<"starting M"<<endl;
-	double additional_factor=1;////number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2);
 	///1/(number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2));
 	////if(small_excitonic_momentum==0){
 	///	arma::cx_mat A_matrix2((spinorial_calculation+1)*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2),number_k_points_list*number_k_points_list*number_g_points_list*number_wannier_centers*number_wannier_centers);
 	///arma::cx_double composition;
-	arma::cx_double temporary;
-	double exponent;
 	if(diagonal_k==1){
 		if(small_excitonic_momentum==0){
-			arma::cx_vec A_matrix1((spinorial_calculation+1)*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2),arma::fill::zeros);
-			arma::cx_vec A_matrix2((spinorial_calculation+1)*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2),arma::fill::zeros);
-			arma::field<arma::cx_mat> M_matrix(number_g_points_list);
-			for(int i=0;i<number_g_points_list;i++)
-				M_matrix(i).zeros((spinorial_calculation+1)*number_wannier_centers,(spinorial_calculation+1)*number_wannier_centers);
-			
-			///#pragma omp parallel for collapse(3) private(A_matrix1,composition,exponent) shared(M_matrix)
-			for(int w1=0;w1<number_wannier_centers;w1++)
-				for(int w2=0;w2<number_wannier_centers;w2++)
-					for(int i=0;i<number_g_points_list;i++){
-						A_matrix1=function_building_real_space_wannier_dipole_ij(w1,w2,excitonic_momentum,g_points_list.col(i));
-						///A_matrix2=function_building_real_space_wannier_dipole_ij(w2,w1,excitonic_momentum,g_points_list.col(i));
-						///cout<<"TEST SYMMETRY  "<<w1<<" "<<w2<<A_matrix1<<" "<<A_matrix2<<" "<<endl;
-						for(int spin=0;spin<(spinorial_calculation+1);spin++)
-							for(int l1=0;l1<number_primitive_cells_integration(0);l1++)
-								for(int j1=0;j1<number_primitive_cells_integration(1);j1++)
-									for(int k1=0;k1<number_primitive_cells_integration(2);k1++)
-									{
-										exponent=arma::accu((excitonic_momentum)%(origin_unitcell+(l1-int(number_primitive_cells_integration(0)/2))*bravais_lattice.col(0)+(j1-int(number_primitive_cells_integration(1)/2))*bravais_lattice.col(1)+(k1-int(number_primitive_cells_integration(2)/2))*bravais_lattice.col(2)));
-										///cout<<"exponent "<<exponent<<" ";
-											//exponent=arma::accu((excitonic_momentum.t())*((l1-int(number_primitive_cells_integration(0)/2))*bravais_lattice.col(0)+(j1-int(number_primitive_cells_integration(1)/2))*bravais_lattice.col(1)+(k1-int(number_primitive_cells_integration(2)/2))*bravais_lattice.col(2)));
-										M_matrix(i)(spin*number_wannier_centers+w1,spin*number_wannier_centers+w2).real(std::real(M_matrix(i)(spin*number_wannier_centers+w1,spin*number_wannier_centers+w2))+additional_factor*std::cos(exponent)*std::real(A_matrix1(spin*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+l1*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+j1*number_primitive_cells_integration(2)+k1))-additional_factor*std::sin(exponent)*std::imag(A_matrix1(spin*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+l1*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+j1*number_primitive_cells_integration(2)+k1)));
-										M_matrix(i)(spin*number_wannier_centers+w1,spin*number_wannier_centers+w2).imag(std::imag(M_matrix(i)(spin*number_wannier_centers+w1,spin*number_wannier_centers+w2))+additional_factor*std::sin(exponent)*std::real(A_matrix1(spin*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+l1*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+j1*number_primitive_cells_integration(2)+k1))+additional_factor*std::cos(exponent)*std::imag(A_matrix1(spin*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+l1*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+j1*number_primitive_cells_integration(2)+k1)));
-										///cout<<"composition "<<composition<<" ";
-									}
-					}
-
-			///cout<<"TEST SYMMETRY "<<M_matrix(0)-M_matrix(0).t()<<endl;	
+			arma::cx_cube M_matrix((spinorial_calculation+1)*number_wannier_centers,(spinorial_calculation+1)*number_wannier_centers,number_g_points_list,arma::fill::zeros);
+			///only the pairs w1<=w2 are integrated (the mirror ones follow from A_{w1w2}(-R)), the (pair,G) items are distributed among the threads
+			int mirror_cells=(int(number_primitive_cells_integration(0))%2==1&&int(number_primitive_cells_integration(1))%2==1&&int(number_primitive_cells_integration(2))%2==1);
+			std::vector<std::tuple<int,int>> wannier_pairs=function_building_wannier_pairs(mirror_cells);
+			#pragma omp parallel for collapse(2) schedule(dynamic)
+			for(int p=0;p<int(wannier_pairs.size());p++)
+				for(int i=0;i<number_g_points_list;i++){
+					int w1=get<0>(wannier_pairs[p]);
+					int w2=get<1>(wannier_pairs[p]);
+					arma::cx_vec A_matrix1=function_building_real_space_wannier_dipole_ij(w1,w2,excitonic_momentum,g_points_list.col(i));
+					function_adding_M_block(M_matrix,i,w1,w2,A_matrix1,excitonic_momentum);
+					if(mirror_cells==1&&w1!=w2)
+						function_adding_M_block(M_matrix,i,w2,w1,function_building_mirror_dipole(A_matrix1,excitonic_momentum+g_points_list.col(i)),excitonic_momentum);
+				}
+			///cout<<"TEST SYMMETRY "<<M_matrix.slice(0)-M_matrix.slice(0).t()<<endl;	
 			cout<<"finishing M"<<endl;
-			return M_matrix;
+			return {M_matrix,arma::ivec(1,arma::fill::zeros)};
 		}else{
+			///the moments do not depend on q: they are calculated (or read) once, every q only contracts them with the direction of q
+			if(small_q_moments.n_elem==0)
+				function_building_small_q_moments();
 			arma::vec excitonic_momentum_tmp=excitonic_momentum/arma::vecnorm(excitonic_momentum);
-			arma::cx_vec A_matrix2((spinorial_calculation+1)*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2),arma::fill::zeros);
-			arma::cx_vec zeros((spinorial_calculation+1)*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2),arma::fill::zeros);
-			arma::field<arma::cx_mat> M_matrix(number_g_points_list);
-			for(int i=0;i<number_g_points_list;i++)
-					M_matrix(i).zeros((spinorial_calculation+1)*number_wannier_centers,(spinorial_calculation+1)*number_wannier_centers);
-			///#pragma omp parallel for collapse(3) private(A_matrix2,composition,exponent,temporary) shared(M_matrix)
+			const int number_elements=(spinorial_calculation+1)*int(number_primitive_cells_integration(0))*int(number_primitive_cells_integration(1))*int(number_primitive_cells_integration(2));
+			arma::cx_cube M_matrix((spinorial_calculation+1)*number_wannier_centers,(spinorial_calculation+1)*number_wannier_centers,number_g_points_list,arma::fill::zeros);
+			#pragma omp parallel for collapse(3)
 			for(int w1=0;w1<number_wannier_centers;w1++)
 				for(int w2=0;w2<number_wannier_centers;w2++)
 					for(int i=0;i<number_g_points_list;i++){
-						std::tuple<arma::cx_mat,arma::cx_vec> temporary_vector=function_building_real_space_wannier_dipole_ij_small_q(w1,w2,g_points_list.col(i));
-						A_matrix2=zeros;
-						for(int s=0;s<(spinorial_calculation+1)*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2);s++){
-							for(int r=0;r<3;r++){
-								A_matrix2(s).imag(imag(A_matrix2(s))+imag(get<0>(temporary_vector)(s,r))*excitonic_momentum_tmp(r));
-								///A_matrix2(s).real(real(A_matrix2(s))+real(get<0>(temporary_vector)(s,r))*excitonic_momentum(r));
-							}
-							///A_matrix2(s).imag(imag(A_matrix2(s))+imag(get<1>(temporary_vector)(s)));
-							///A_matrix2(s).real(real(A_matrix2(s))+real(get<1>(temporary_vector)(s)));
-						}
-						for(int spin=0;spin<(spinorial_calculation+1);spin++)
-							for(int l1=0;l1<number_primitive_cells_integration(0);l1++)
-								for(int j1=0;j1<number_primitive_cells_integration(1);j1++)
-									for(int k1=0;k1<number_primitive_cells_integration(2);k1++)
-									{
-										for(int r=0;r<3;r++)
-											exponent=arma::accu((excitonic_momentum)%(origin_unitcell+(l1-int(number_primitive_cells_integration(0)/2))*bravais_lattice.col(0)+(j1-int(number_primitive_cells_integration(1)/2))*bravais_lattice.col(1)+(k1-int(number_primitive_cells_integration(2)/2))*bravais_lattice.col(2)));
-										M_matrix(i)(spin*number_wannier_centers+w1,spin*number_wannier_centers+w2).real(std::real(M_matrix(i)(spin*number_wannier_centers+w1,spin*number_wannier_centers+w2))+additional_factor*std::cos(exponent)*real(A_matrix2(spin*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+l1*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+j1*number_primitive_cells_integration(2)+k1))-additional_factor*std::sin(exponent)*imag(A_matrix2(spin*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+l1*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+j1*number_primitive_cells_integration(2)+k1)));
-										M_matrix(i)(spin*number_wannier_centers+w1,spin*number_wannier_centers+w2).imag(std::imag(M_matrix(i)(spin*number_wannier_centers+w1,spin*number_wannier_centers+w2))+additional_factor*std::sin(exponent)*real(A_matrix2(spin*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+l1*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+j1*number_primitive_cells_integration(2)+k1))+additional_factor*std::cos(exponent)*imag(A_matrix2(spin*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+l1*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+j1*number_primitive_cells_integration(2)+k1)));
-									}
-							///(double(number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)));
-						get<0>(temporary_vector).clear();
-						get<1>(temporary_vector).clear();
+						int slice=(w1*number_wannier_centers+w2)*number_g_points_list+i;
+						arma::cx_vec A_matrix2(number_elements,arma::fill::zeros);
+						for(int s=0;s<number_elements;s++)
+							for(int r=0;r<3;r++)
+								A_matrix2(s)+=small_q_moments(s,r,slice)*excitonic_momentum_tmp(r);
+						function_adding_M_block(M_matrix,i,w1,w2,A_matrix2,excitonic_momentum);
 					}
 			cout<<"finishing M"<<endl;
-			return M_matrix;
+			return {M_matrix,arma::ivec(1,arma::fill::zeros)};
 		}
 	}else{
+		///M depends on the pair (k1,k2) only through the momentum transfer excitonic_momentum+k1-k2:
+		///the blocks are calculated once for every distinct k1-k2 (and G) and the pairs point to them through momentum_transfer_indexing
+		///(pairs outside radius_building_kernel, when radius_convergence==1, point to an additional zero block)
+		std::map<std::tuple<long long,long long,long long>,int> momentum_transfer_keys;
+		std::vector<arma::vec> k_point_differences;
+		arma::ivec momentum_transfer_indexing(number_k_points_list*number_k_points_list);
+		arma::vec k_point_difference(3);
+		for(int s1=0;s1<number_k_points_list;s1++)
+			for(int s2=0;s2<number_k_points_list;s2++){
+				k_point_difference=k_points_list.col(s1)-k_points_list.col(s2);
+				if(radius_convergence==1&&s1!=s2&&arma::vecnorm(excitonic_momentum+k_point_difference)>radius_building_kernel){
+					momentum_transfer_indexing(s1*number_k_points_list+s2)=-1;
+					continue;
+				}
+				std::tuple<long long,long long,long long> key=std::make_tuple(std::llround(k_point_difference(0)/minval),std::llround(k_point_difference(1)/minval),std::llround(k_point_difference(2)/minval));
+				std::map<std::tuple<long long,long long,long long>,int>::iterator found=momentum_transfer_keys.find(key);
+				if(found==momentum_transfer_keys.end()){
+					momentum_transfer_keys[key]=k_point_differences.size();
+					momentum_transfer_indexing(s1*number_k_points_list+s2)=k_point_differences.size();
+					k_point_differences.push_back(k_point_difference);
+				}else
+					momentum_transfer_indexing(s1*number_k_points_list+s2)=found->second;
+			}
+		int number_momentum_transfers=k_point_differences.size()+radius_convergence;
+		for(int s=0;s<number_k_points_list*number_k_points_list;s++)
+			if(momentum_transfer_indexing(s)<0)
+				momentum_transfer_indexing(s)=number_momentum_transfers-1;
+		cout<<"NUMBER MOMENTUM TRANSFERS "<<k_point_differences.size()<<endl;
+
+		///dipoles: radius_convergence==0 one per momentum transfer, radius_convergence==1 one per representative
+		std::vector<arma::vec> dipole_momenta;
+		std::vector<int> dipole_association(k_point_differences.size());
 		if(radius_convergence==0){
-			arma::cx_vec A_matrix1((spinorial_calculation+1)*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2),arma::fill::zeros);
-			arma::field<arma::cx_mat> M_matrix(number_g_points_list*number_k_points_list*number_k_points_list);
-			for(int i=0;i<number_g_points_list;i++)
-				for(int k1=0;k1<number_k_points_list;k1++)
-					for(int k2=0;k2<number_k_points_list;k2++)
-						M_matrix(i*number_k_points_list*number_k_points_list+k1*number_k_points_list+k2).zeros((spinorial_calculation+1)*number_wannier_centers,(spinorial_calculation+1)*number_wannier_centers);
-			///#pragma omp parallel for collapse(5) private(A_matrix1,composition,exponent) shared(M_matrix)
-			for(int i=0;i<number_g_points_list;i++)	
-				for(int w1=0;w1<number_wannier_centers;w1++)
-					for(int w2=0;w2<number_wannier_centers;w2++)	
-						for(int s1=0;s1<number_k_points_list;s1++)
-							for(int s2=0;s2<number_k_points_list;s2++){
-								cout<<w1<<" "<<w2<<" "<<s1<<" "<<s2<<endl;
-								//A_matrix2.col(k1*number_k_points_list*number_g_points_list*number_wannier_centers*number_wannier_centers+k2*number_g_points_list*number_wannier_centers*number_wannier_centers+i*number_wannier_centers*number_wannier_centers+w1*number_wannier_centers+w2)=function_building_real_space_wannier_dipole_ij(w1,w2,excitonic_momentum+k_points_list.col(k1)-k_points_list.col(k2),g_points_list.col(i));
-								A_matrix1=function_building_real_space_wannier_dipole_ij(w1,w2,excitonic_momentum+k_points_list.col(s1)-k_points_list.col(s2),g_points_list.col(i));		
-								for(int spin=0;spin<(spinorial_calculation+1);spin++)
-									for(int l1=0;l1<number_primitive_cells_integration(0);l1++)
-										for(int j1=0;j1<number_primitive_cells_integration(1);j1++)
-											for(int k1=0;k1<number_primitive_cells_integration(2);k1++)
-											{
-												exponent=arma::accu(((excitonic_momentum+k_points_list.col(s1)-k_points_list.col(s2)))%(origin_unitcell+(l1-int(number_primitive_cells_integration(0)/2))*bravais_lattice.col(0)+(j1-int(number_primitive_cells_integration(1)/2))*bravais_lattice.col(1)+(k1-int(number_primitive_cells_integration(2)/2))*bravais_lattice.col(2)));
-												M_matrix(i*number_k_points_list+s1*number_k_points_list+s2)(spin*number_wannier_centers+w1,spin*number_wannier_centers+w2).real(std::real(M_matrix(i*number_k_points_list+s1*number_k_points_list+s2)(spin*number_wannier_centers+w1,spin*number_wannier_centers+w2))+additional_factor*cos(exponent)*real(A_matrix1(spin*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+l1*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+j1*number_primitive_cells_integration(2)+k1))-additional_factor*sin(exponent)*imag(A_matrix1(spin*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+l1*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+j1*number_primitive_cells_integration(2)+k1)));
-												M_matrix(i*number_k_points_list+s1*number_k_points_list+s2)(spin*number_wannier_centers+w1,spin*number_wannier_centers+w2).imag(std::imag(M_matrix(i*number_k_points_list+s1*number_k_points_list+s2)(spin*number_wannier_centers+w1,spin*number_wannier_centers+w2))+additional_factor*sin(exponent)*real(A_matrix1(spin*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+l1*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+j1*number_primitive_cells_integration(2)+k1))+additional_factor*cos(exponent)*imag(A_matrix1(spin*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+l1*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+j1*number_primitive_cells_integration(2)+k1)));
-											}
-							}
-			cout<<"finishing M"<<endl;
-			return M_matrix;
+			for(int u=0;u<int(k_point_differences.size());u++){
+				dipole_momenta.push_back(excitonic_momentum+k_point_differences[u]);
+				dipole_association[u]=u;
+			}
 		}else{
-			arma::cx_vec A_matrix1((spinorial_calculation+1)*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2),arma::fill::zeros);
-			arma::field<arma::cx_mat> M_matrix(number_g_points_list*number_k_points_list*number_k_points_list);
-			for(int i=0;i<number_g_points_list;i++)
-				for(int k1=0;k1<number_k_points_list;k1++)
-					for(int k2=0;k2<number_k_points_list;k2++)
-						M_matrix(i*number_k_points_list*number_k_points_list+k1*number_k_points_list+k2).zeros((spinorial_calculation+1)*number_wannier_centers,(spinorial_calculation+1)*number_wannier_centers);
-			///#pragma omp parallel for collapse(5) private(A_matrix1,composition,exponent) shared(M_matrix)
-			///the same point is already considered
-			int count_number_points;
-			count_number_points=0;
-			for(int s1=0;s1<number_k_points_list;s1++)
-				for(int s2=0;s2<number_k_points_list;s2++)
-					if((arma::vecnorm(excitonic_momentum+k_points_list.col(s1)-k_points_list.col(s2))<=radius_building_kernel)&&(s1!=s2))
-						count_number_points+=1;
-			
-			cout<<"NUMBER K POINT DIFFERENCES CONSIDERED "<<count_number_points+1<<endl;
-			///saving minima differences
-			///saving their modulus
-			arma::mat k_point_differences_minima(3,count_number_points);
-			arma::vec k_point_differences_minima_modulus(count_number_points);
-			////ordering elements
-			count_number_points=0;
-			for(int s1=0;s1<number_k_points_list;s1++)
-				for(int s2=0;s2<number_k_points_list;s2++)
-					if((arma::vecnorm(excitonic_momentum+k_points_list.col(s1)-k_points_list.col(s2))<=radius_building_kernel)&&(s1!=s2)){
-						k_point_differences_minima.col(count_number_points)=k_points_list.col(s1)-k_points_list.col(s2);
-						k_point_differences_minima_modulus(count_number_points)=(arma::sign(s2-s1))*arma::vecnorm(excitonic_momentum+k_points_list.col(s1)-k_points_list.col(s2));
-						count_number_points+=1;
-					}
-			///cout<<count_number_points+1<<endl;
-			///cout<<k_point_differences_minima_modulus<<endl;
-			arma::uvec sorting=sort_index(k_point_differences_minima_modulus);
-			arma::mat k_point_differences_minima_ordered(3,count_number_points+1);
-			///cout<<sorting<<endl;
-			///cout<<k_point_differences_minima_modulus<<endl;
-			///cout<<k_point_differences_minima<<endl;
+			///the differences inside the radius are grouped in representatives (closer than threshold_building_kernel)
+			///the representatives are indexed in a cell list (cells of side threshold_building_kernel), so each difference is associated
+			///to its nearest representative looking only at the 27 neighbouring cells
+			double cell_side=threshold_building_kernel;
+			if(cell_side<minval)
+				cell_side=minval;
+			std::map<std::tuple<long long,long long,long long>,std::vector<int>> cell_list;
 			arma::vec zeros(3,arma::fill::zeros);
-			k_point_differences_minima_ordered.col(0)=zeros;
-			for(int count=0;count<count_number_points;count++){
-				k_point_differences_minima_ordered.col(count+1)=k_point_differences_minima.col(sorting(count));
-				///cout<<k_point_differences_minima_modulus(sorting(count))<<endl;
-			}
-			count_number_points+=1;
-			
-			///TEST THRESHOLDING....
-			//k_point_differences_minima_modulus=arma::sort(k_point_differences_minima_modulus);
-			/////eliminating elements too nearby threshold radius
-			//int degenerate_elements;
-			//int count1=0;
-			//while(count1<count_number_points-1){
-			//	degenerate_elements=0;
-			//	for(int count2=count1+1;count2<count_number_points; count2++){
-			//		if(k_point_differences_minima_modulus(count2)-k_point_differences_minima_modulus(count1)<threshold_building_kernel)
-			//			degenerate_elements+=1;
-			//		else{
-			//			count1+=degenerate_elements;
-			//			break;
-			//		}
-			//	}
-			//}
-			//int total_number_elements=count1;
-			//cout<<"NUMBER K POINT DIFFERENCES CONSIDERED after THRESHOLD"<<total_number_elements<<endl;
-			//arma::vec k_point_differences_minima_modulus_after_degeneracy(total_number_elements);
-			//count1=0;
-			//int count3=0;
-			//while(count1<total_number_elements){
-			//	degenerate_elements=0;
-			//	for(int count2=count1+1;count2<count_number_points; count2++){
-			//		if(k_point_differences_minima_modulus(count2)-k_point_differences_minima_modulus(count1)<threshold_building_kernel)
-			//			degenerate_elements+=1;
-			//		else{
-			//			k_point_differences_minima_modulus_after_degeneracy(count3)=k_point_differences_minima_modulus(count1);
-			//			count3+=1;
-			//			count1+=degenerate_elements;
-			//			break;
-			//		}
-			//	}
-			//}
-			//arma::mat k_point_differences_minima_after_degeneracy(3,total_number_elements);
-			//for(int count=0;count<count_number_points;count++)
-
-			///associating to each pair an element of the list of minima, if the pair is sufficiently nearby (SCALAR PRODUCT)
-			double maximize_projection=0.0;
-			int index_maximize_projeciton=0;
-			arma::vec pair_association(number_k_points_list*number_k_points_list);
-			for(int s1=0;s1<number_k_points_list;s1++)
-				for(int s2=0;s2<number_k_points_list;s2++){
-					if(s1==s2)
-						pair_association(s1*number_k_points_list+s2)=0;
-					else if(arma::vecnorm(excitonic_momentum+k_points_list.col(s1)-k_points_list.col(s2))>radius_building_kernel)
-						pair_association(s1*number_k_points_list+s2)=-1;
-					else{
-						///it is not sufficient to look at the radius but also at the projection
-						for(int count=1;count<count_number_points-1;count++)
-							if(s2>s1)
-								if(arma::vecnorm(excitonic_momentum+k_points_list.col(s1)-k_points_list.col(s2))<arma::vecnorm(k_point_differences_minima_ordered.col(count+1))){
-									maximize_projection=0;
-									index_maximize_projeciton=0;
-									for(int count2=0;count2<count+1;count2++)
-										if(arma::dot(excitonic_momentum+k_points_list.col(s1)-k_points_list.col(s2),k_point_differences_minima_ordered.col(count2))>maximize_projection)
-											index_maximize_projeciton=count2;
-									pair_association(s1*number_k_points_list+s2)=index_maximize_projeciton;	
-								}
-							else
-								if(arma::vecnorm(excitonic_momentum+k_points_list.col(s1)-k_points_list.col(s2))>arma::vecnorm(k_point_differences_minima_ordered.col(count+1))){
-									maximize_projection=0;
-									index_maximize_projeciton=0;
-									for(int count2=0;count2<count+1;count2++)
-										if(arma::dot(excitonic_momentum+k_points_list.col(s1)-k_points_list.col(s2),k_point_differences_minima_ordered.col(count2))>maximize_projection)
-											index_maximize_projeciton=count2;
-									pair_association(s1*number_k_points_list+s2)=index_maximize_projeciton;	
+			dipole_momenta.push_back(zeros);
+			cell_list[std::make_tuple(0LL,0LL,0LL)].push_back(0);
+			for(int u=0;u<int(k_point_differences.size());u++){
+				long long cell_0=(long long)std::floor(k_point_differences[u](0)/cell_side);
+				long long cell_1=(long long)std::floor(k_point_differences[u](1)/cell_side);
+				long long cell_2=(long long)std::floor(k_point_differences[u](2)/cell_side);
+				int index_nearest=-1;
+				double distance_nearest=cell_side;
+				for(long long c0=cell_0-1;c0<=cell_0+1;c0++)
+					for(long long c1=cell_1-1;c1<=cell_1+1;c1++)
+						for(long long c2=cell_2-1;c2<=cell_2+1;c2++){
+							std::map<std::tuple<long long,long long,long long>,std::vector<int>>::iterator found=cell_list.find(std::make_tuple(c0,c1,c2));
+							if(found==cell_list.end())
+								continue;
+							for(int r=0;r<int(found->second.size());r++){
+								double distance=arma::vecnorm(k_point_differences[u]-dipole_momenta[found->second[r]]);
+								if(distance<distance_nearest){
+									distance_nearest=distance;
+									index_nearest=found->second[r];
 								}
-					}
+							}
+						}
+				if(index_nearest<0){
+					index_nearest=dipole_momenta.size();
+					dipole_momenta.push_back(k_point_differences[u]);
+					cell_list[std::make_tuple(cell_0,cell_1,cell_2)].push_back(index_nearest);
 				}
-			////at this point is sufficient to calculate dipoles between the k_point_differences_minima and then associate the pairs to them
-			arma::cx_mat A_matrix0((spinorial_calculation+1)*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2),count_number_points);
-			for(int i=0;i<number_g_points_list;i++)	
-				for(int w1=0;w1<number_wannier_centers;w1++)
-					for(int w2=0;w2<number_wannier_centers;w2++){
-						for(int count=0;count<count_number_points;count++)
-							A_matrix0.col(count)=function_building_real_space_wannier_dipole_ij(w1,w2,k_point_differences_minima_ordered.col(count),g_points_list.col(i));		
-						for(int s1=0;s1<number_k_points_list;s1++)
-							for(int s2=0;s2<number_k_points_list;s2++)
-								if(pair_association(s1*number_k_points_list+s2)<0){
-									for(int spin=0;spin<(spinorial_calculation+1);spin++){
-										M_matrix(i*number_k_points_list+s1*number_k_points_list+s2)(spin*number_wannier_centers+w1,spin*number_wannier_centers+w2).real(0.0);			
-										M_matrix(i*number_k_points_list+s1*number_k_points_list+s2)(spin*number_wannier_centers+w1,spin*number_wannier_centers+w2).imag(0.0);
-									}
-								}else{
-									A_matrix1=A_matrix0.col(pair_association(s1*number_k_points_list+s2));
-									for(int spin=0;spin<(spinorial_calculation+1);spin++)
-										for(int l1=0;l1<number_primitive_cells_integration(0);l1++)
-											for(int j1=0;j1<number_primitive_cells_integration(1);j1++)
-												for(int k1=0;k1<number_primitive_cells_integration(2);k1++)
-												{
-													exponent=arma::accu(((excitonic_momentum+k_points_list.col(s1)-k_points_list.col(s2)))%(origin_unitcell+(l1-int(number_primitive_cells_integration(0)/2))*bravais_lattice.col(0)+(j1-int(number_primitive_cells_integration(1)/2))*bravais_lattice.col(1)+(k1-int(number_primitive_cells_integration(2)/2))*bravais_lattice.col(2)));
-													M_matrix(i*number_k_points_list+s1*number_k_points_list+s2)(spin*number_wannier_centers+w1,spin*number_wannier_centers+w2).real(std::real(M_matrix(i*number_k_points_list+s1*number_k_points_list+s2)(spin*number_wannier_centers+w1,spin*number_wannier_centers+w2))+additional_factor*cos(exponent)*real(A_matrix1(spin*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+l1*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+j1*number_primitive_cells_integration(2)+k1))-additional_factor*sin(exponent)*imag(A_matrix1(spin*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+l1*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+j1*number_primitive_cells_integration(2)+k1)));
-													M_matrix(i*number_k_points_list+s1*number_k_points_list+s2)(spin*number_wannier_centers+w1,spin*number_wannier_centers+w2).imag(std::imag(M_matrix(i*number_k_points_list+s1*number_k_points_list+s2)(spin*number_wannier_centers+w1,spin*number_wannier_centers+w2))+additional_factor*sin(exponent)*real(A_matrix1(spin*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+l1*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+j1*number_primitive_cells_integration(2)+k1))+additional_factor*cos(exponent)*imag(A_matrix1(spin*number_primitive_cells_integration(0)*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+l1*number_primitive_cells_integration(1)*number_primitive_cells_integration(2)+j1*number_primitive_cells_integration(2)+k1)));
-												}
-								}
-					}
-			cout<<"finishing M"<<endl;
-			return M_matrix;
+				dipole_association[u]=index_nearest;
+			}
+			cout<<"NUMBER K POINT DIFFERENCES CONSIDERED "<<dipole_momenta.size()<<endl;
 		}
+
+		///one contiguous tensor [w1][w2][G][u] (slice g*number_momentum_transfers+u), no per-block allocations
+		arma::cx_cube M_matrix((spinorial_calculation+1)*number_wannier_centers,(spinorial_calculation+1)*number_wannier_centers,number_g_points_list*number_momentum_transfers,arma::fill::zeros);
+		///work items (pair w1<=w2,G,dipole): every item integrates one A and adds it (and its mirror) to the transfers associated with the dipole,
+		///so the items write disjoint blocks of M and can be scheduled dynamically
+		std::vector<std::vector<int>> dipole_transfers(dipole_momenta.size());
+		for(int u=0;u<int(k_point_differences.size());u++)
+			dipole_transfers[dipole_association[u]].push_back(u);
+		int mirror_cells=(int(number_primitive_cells_integration(0))%2==1&&int(number_primitive_cells_integration(1))%2==1&&int(number_primitive_cells_integration(2))%2==1);
+		std::vector<std::tuple<int,int>> wannier_pairs=function_building_wannier_pairs(mirror_cells);
+		#pragma omp parallel for collapse(3) schedule(dynamic)
+		for(int p=0;p<int(wannier_pairs.size());p++)
+			for(int i=0;i<number_g_points_list;i++)
+				for(int count=0;count<int(dipole_momenta.size());count++){
+					if(dipole_transfers[count].size()==0)
+						continue;
+					int w1=get<0>(wannier_pairs[p]);
+					int w2=get<1>(wannier_pairs[p]);
+					arma::cx_vec A_matrix1=function_building_real_space_wannier_dipole_ij(w1,w2,dipole_momenta[count],g_points_list.col(i));
+					arma::cx_vec A_matrix2;
+					if(mirror_cells==1&&w1!=w2)
+						A_matrix2=function_building_mirror_dipole(A_matrix1,dipole_momenta[count]+g_points_list.col(i));
+					for(int t=0;t<int(dipole_transfers[count].size());t++){
+						int u=dipole_transfers[count][t];
+						function_adding_M_block(M_matrix,i*number_momentum_transfers+u,w1,w2,A_matrix1,excitonic_momentum+k_point_differences[u]);
+						if(mirror_cells==1&&w1!=w2)
+							function_adding_M_block(M_matrix,i*number_momentum_transfers+u,w2,w1,A_matrix2,excitonic_momentum+k_point_differences[u]);
+					}
+				}
+		cout<<"finishing M"<<endl;
+		return {M_matrix,momentum_transfer_indexing};
 	}
 	///}
 	//else{
@@ -1918,6 +3200,143 @@ arma::field<arma::cx_mat> Dipole_Elements::function_building_M_k1k2_ij(arma::vec
 	//}
 };
 
+void Dipole_Elements::push_perturbative_small_momentum(int perturbative_small_momentum_tmp,double threshold_perturbative_momentum_tmp,double threshold_perturbative_degeneracy_tmp){
+	perturbative_small_momentum=perturbative_small_momentum_tmp;
+	threshold_perturbative_momentum=threshold_perturbative_momentum_tmp;
+	threshold_perturbative_degeneracy=threshold_perturbative_degeneracy_tmp;
+};
+void Dipole_Elements::push_time_reversal_symmetry(int time_reversal_symmetry_tmp,arma::ivec time_reversal_partners_tmp){
+	time_reversal_symmetry=time_reversal_symmetry_tmp;
+	time_reversal_partners=time_reversal_partners_tmp;
+};
+void Dipole_Elements::push_ks_states_store(Ks_States_Store *ks_states_store_tmp){
+	ks_states_store=ks_states_store_tmp;
+};
+void Dipole_Elements::push_point_dipole_approximation(int point_dipole_approximation_tmp){
+	point_dipole_approximation=point_dipole_approximation_tmp;
+};
+std::tuple<arma::cube,arma::cx_cube> Dipole_Elements::function_building_ks_states_subset(arma::vec parameter,int number_valence_bands_selected,int number_conduction_bands_selected){
+	if(rho_cache==0)
+		return function_diagonalizing_ks_states_subset(parameter,number_valence_bands_selected,number_conduction_bands_selected);
+	std::tuple<long long,long long,long long,int,int> key=std::make_tuple(std::llround(parameter(0)/minval),std::llround(parameter(1)/minval),std::llround(parameter(2)/minval),number_valence_bands_selected,number_conduction_bands_selected);
+	std::map<std::tuple<long long,long long,long long,int,int>,std::tuple<arma::cube,arma::cx_cube>>::iterator found=ks_states_cache.find(key);
+	if(found==ks_states_cache.end())
+		found=ks_states_cache.insert(std::make_pair(key,function_diagonalizing_ks_states_subset(parameter,number_valence_bands_selected,number_conduction_bands_selected))).first;
+	return found->second;
+};
+std::tuple<arma::cube,arma::cx_cube> Dipole_Elements::function_diagonalizing_ks_states_subset(arma::vec parameter,int number_valence_bands_selected,int number_conduction_bands_selected){
+	arma::mat k_points_list_shifted(3,number_k_points_list);
+	for(int i=0;i<number_k_points_list;i++)
+		for(int s=0;s<3;s++)
+			k_points_list_shifted(s,i)=k_points_list(s,i)-parameter(s);
+	if(ks_states_store!=NULL&&arma::vecnorm(parameter)==0.0){
+		/// diagonalizing only the k points not already in the store (all bands are stored, the subset is extracted afterwards)
+		arma::ivec nested_indexing=ks_states_store->pull_nested_indexing_ks_states();
+		int number_new_k_points=0;
+		for(int i=0;i<number_k_points_list;i++)
+			if(nested_indexing(i)<0)
+				number_new_k_points++;
+		arma::uvec new_k_points(number_new_k_points);
+		arma::mat k_points_list_new(3,number_new_k_points);
+		number_new_k_points=0;
+		for(int i=0;i<number_k_points_list;i++)
+			if(nested_indexing(i)<0){
+				new_k_points(number_new_k_points)=i;
+				k_points_list_new.col(number_new_k_points)=k_points_list_shifted.col(i);
+				number_new_k_points++;
+			}
+		cout<<"Diagonalizing "<<number_new_k_points<<" new k points"<<endl;
+		/// pull_ks_states_batch returns number_wannier_functions bands (per spin channel)
+		int number_bands=hamiltonian_tb->pull_number_wannier_functions();
+		arma::cube ks_energies_all(2,number_bands,number_k_points_list);
+		arma::cx_cube ks_states_all(htb_basis_dimension,number_bands,number_k_points_list);
+		if(number_new_k_points>0){
+			std::tuple<arma::cube,arma::cx_cube> ks_states_new=hamiltonian_tb->pull_ks_states_batch(k_points_list_new);
+			for(int i=0;i<number_new_k_points;i++){
+				ks_energies_all.slice(new_k_points(i))=get<0>(ks_states_new).slice(i);
+				ks_states_all.slice(new_k_points(i))=get<1>(ks_states_new).slice(i);
+			}
+		}
+		for(int i=0;i<number_k_points_list;i++)
+			if(nested_indexing(i)>=0){
+				ks_energies_all.slice(i)=ks_states_store->pull_ks_energies(nested_indexing(i));
+				ks_states_all.slice(i)=ks_states_store->pull_ks_states(nested_indexing(i));
+			}
+		if(number_new_k_points>0)
+			ks_states_store->push_ks_states(k_points_list_shifted,ks_energies_all,ks_states_all);
+		arma::cube ks_energies(2,number_valence_bands_selected+number_conduction_bands_selected,number_k_points_list);
+		arma::cx_cube ks_states(htb_basis_dimension,number_valence_bands_selected+number_conduction_bands_selected,number_k_points_list);
+		#pragma omp parallel for
+		for(int i=0;i<number_k_points_list;i++){
+			std::tuple<arma::mat,arma::cx_mat> ks_states_k_point=hamiltonian_tb->extract_ks_states_subset({ks_energies_all.slice(i),ks_states_all.slice(i)},number_valence_bands_selected,number_conduction_bands_selected);
+			ks_energies.slice(i)=get<0>(ks_states_k_point);
+			ks_states.slice(i)=get<1>(ks_states_k_point);
+		}
+		return {ks_energies,ks_states};
+	}
+	if(time_reversal_symmetry==0||arma::vecnorm(parameter)>0.0)
+		return hamiltonian_tb->pull_ks_states_subset_batch(k_points_list_shifted,number_valence_bands_selected,number_conduction_bands_selected);
+	
+	/// diagonalizing only the representatives (k points without partner, or with partner of higher index)
+	int number_representatives=0;
+	for(int i=0;i<number_k_points_list;i++)
+		if(time_reversal_partners(i)<0||time_reversal_partners(i)>=i)
+			number_representatives++;
+	arma::uvec representatives(number_representatives);
+	arma::mat k_points_list_representatives(3,number_representatives);
+	number_representatives=0;
+	for(int i=0;i<number_k_points_list;i++)
+		if(time_reversal_partners(i)<0||time_reversal_partners(i)>=i){
+			representatives(number_representatives)=i;
+			k_points_list_representatives.col(number_representatives)=k_points_list_shifted.col(i);
+			number_representatives++;
+		}
+	std::tuple<arma::cube,arma::cx_cube> ks_states_representatives=hamiltonian_tb->pull_ks_states_subset_batch(k_points_list_representatives,number_valence_bands_selected,number_conduction_bands_selected);
+	arma::cube ks_energies(2,number_valence_bands_selected+number_conduction_bands_selected,number_k_points_list);
+	arma::cx_cube ks_states(htb_basis_dimension,number_valence_bands_selected+number_conduction_bands_selected,number_k_points_list);
+	for(int i=0;i<number_representatives;i++){
+		ks_energies.slice(representatives(i))=get<0>(ks_states_representatives).slice(i);
+		ks_states.slice(representatives(i))=get<1>(ks_states_representatives).slice(i);
+		/// H(-k)=H(k)^* ---> E(-k)=E(k), u(-k)=u(k)^*
+		if(time_reversal_partners(representatives(i))>int(representatives(i))){
+			ks_energies.slice(time_reversal_partners(representatives(i)))=get<0>(ks_states_representatives).slice(i);
+			ks_states.slice(time_reversal_partners(representatives(i)))=arma::conj(get<1>(ks_states_representatives).slice(i));
+		}
+	}
+	return {ks_energies,ks_states};
+};
+std::tuple<arma::cube,arma::cx_cube,arma::cube,arma::cx_cube> Dipole_Elements::function_building_ks_states_left_right(arma::vec parameter_l,arma::vec parameter_r,int left,int right){
+	int number_left_states=left*number_conduction_bands+(1-left)*number_valence_bands;
+	int number_right_states=right*number_conduction_bands+(1-right)*number_valence_bands;
+	arma::mat k_points_list_l(3,number_k_points_list);
+	for(int i=0;i<number_k_points_list;i++)
+		for(int s=0;s<3;s++)
+			k_points_list_l(s,i)=k_points_list(s,i)-parameter_l(s);
+	std::tuple<arma::cube,arma::cx_cube> ks_state_l_k_points;
+	std::tuple<arma::cube,arma::cx_cube> ks_state_r_k_points;
+	if(perturbative_small_momentum==1&&arma::vecnorm(parameter_l-parameter_r)<threshold_perturbative_momentum){
+		std::tuple<arma::cube,arma::cx_cube> ks_states_all=hamiltonian_tb->pull_ks_states_batch(k_points_list_l);
+		arma::cube ks_energy_l(2,number_left_states,number_k_points_list);
+		arma::cx_cube ks_state_l(htb_basis_dimension,number_left_states,number_k_points_list);
+		arma::cube ks_energy_r(2,number_right_states,number_k_points_list);
+		arma::cx_cube ks_state_r(htb_basis_dimension,number_right_states,number_k_points_list);
+		#pragma omp parallel for
+		for(int i=0;i<number_k_points_list;i++){
+			std::tuple<arma::mat,arma::cx_mat> ks_states_k_point(get<0>(ks_states_all).slice(i),get<1>(ks_states_all).slice(i));
+			std::tuple<arma::mat,arma::cx_mat> ks_state_l_k_point=hamiltonian_tb->extract_ks_states_subset(ks_states_k_point,(1-left)*number_valence_bands,left*number_conduction_bands);
+			std::tuple<arma::mat,arma::cx_mat> ks_state_r_k_point=hamiltonian_tb->extract_ks_states_subset(hamiltonian_tb->pull_ks_states_perturbative(k_points_list_l.col(i),parameter_l-parameter_r,ks_states_k_point,threshold_perturbative_degeneracy),(1-right)*number_valence_bands,right*number_conduction_bands);
+			ks_energy_l.slice(i)=get<0>(ks_state_l_k_point);
+			ks_state_l.slice(i)=get<1>(ks_state_l_k_point);
+			ks_energy_r.slice(i)=get<0>(ks_state_r_k_point);
+			ks_state_r.slice(i)=get<1>(ks_state_r_k_point);
+		}
+		return {ks_energy_l,ks_state_l,ks_energy_r,ks_state_r};
+	}else{
+		ks_state_l_k_points=function_building_ks_states_subset(parameter_l,(1-left)*number_valence_bands,left*number_conduction_bands);
+		ks_state_r_k_points=function_building_ks_states_subset(parameter_r,(1-right)*number_valence_bands,right*number_conduction_bands);
+		return {get<0>(ks_state_l_k_points),get<1>(ks_state_l_k_points),get<0>(ks_state_r_k_points),get<1>(ks_state_r_k_points)};
+	}
+};
 ///diagonal_k ---> rho_{n1,n2,k1-p,k2-q}(excitonic_momentum,G)-->rho_{n1,n2,k1-p,k1-q}(excitonic_momentum,G)
 std::tuple<arma::cx_mat,arma::cx_mat,arma::cx_mat> Dipole_Elements::pull_values(arma::vec excitonic_momentum,arma::vec parameter_l,arma::vec parameter_r,int diagonal_k,int minus,int left,int right,int reverse, int reverse_kk,double threshold_proximity, int small_excitonic_momentum,int radius_convergence){
 	arma::vec zeros_vec(3); int effective_number_k_points_list;
@@ -1928,7 +3347,7 @@ std::tuple<arma::cx_mat,arma::cx_mat,arma::cx_mat> Dipole_Elements::pull_values(
 	if(diagonal_k==1)
 		effective_number_k_points_list=number_k_points_list;
 	else
-		effective_number_k_points_list=number_k_points_list*number_k_points_list;
+		effective_number_k_points_list=number_k_points_list*number_k_points_tile;
 	
 	int number_left_states=left*number_conduction_bands+(1-left)*number_valence_bands;
 	int number_right_states=right*number_conduction_bands+(1-right)*number_valence_bands;
@@ -1940,7 +3359,23 @@ std::tuple<arma::cx_mat,arma::cx_mat,arma::cx_mat> Dipole_Elements::pull_values(
 	///this is the method using proximity of the wannier functions, and putting to 1 every dipole elements in the same site
 	//arma::field<arma::mat> A_matrix=function_building_A_matrix(threshold_proximity);
 	///dimension a little bit different 
-	arma::field<arma::cx_mat> A_matrix=function_building_M_k1k2_ij(excitonic_momentum,diagonal_k,small_excitonic_momentum,radius_convergence);
+	std::tuple<arma::cx_cube,arma::ivec> M_matrix_and_indexing_local;
+	const std::tuple<arma::cx_cube,arma::ivec>* M_matrix_and_indexing=&M_matrix_and_indexing_local;
+	arma::cx_mat exponential_factor;
+	if(point_dipole_approximation==0){
+		if(rho_cache==1){
+			std::tuple<long long,long long,long long,int,int,int> key=std::make_tuple(std::llround(excitonic_momentum(0)/minval),std::llround(excitonic_momentum(1)/minval),std::llround(excitonic_momentum(2)/minval),diagonal_k,small_excitonic_momentum,radius_convergence);
+			std::map<std::tuple<long long,long long,long long,int,int,int>,std::tuple<arma::cx_cube,arma::ivec>>::iterator found=M_matrix_cache.find(key);
+			if(found==M_matrix_cache.end())
+				found=M_matrix_cache.insert(std::make_pair(key,function_building_M_k1k2_ij(excitonic_momentum,diagonal_k,small_excitonic_momentum,radius_convergence))).first;
+			M_matrix_and_indexing=&(found->second);
+		}else
+			M_matrix_and_indexing_local=function_building_M_k1k2_ij(excitonic_momentum,diagonal_k,small_excitonic_momentum,radius_convergence);
+	}else
+		exponential_factor=function_building_exponential_factor(excitonic_momentum,diagonal_k,minus);
+	const arma::cx_cube& A_matrix=get<0>(*M_matrix_and_indexing);
+	const arma::ivec& momentum_transfer_indexing=get<1>(*M_matrix_and_indexing);
+	int number_momentum_transfers=A_matrix.n_slices/number_g_points_list;
 	///A_matrix(0)=A_matrix(0)/arma::trace(A_matrix(0));
 	///NAIVE METHOD!!!!!
 	///arma::field<arma::cx_mat> A_matrix=function_building_exponential_factor(excitonic_momentum,diagonal_k,0);
@@ -1955,19 +3390,16 @@ std::tuple<arma::cx_mat,arma::cx_mat,arma::cx_mat> Dipole_Elements::pull_values(
 		arma::cx_mat ks_state_r(htb_basis_dimension, number_right_states); 
 		arma::mat ks_energy_l(2,number_left_states);
 		arma::mat ks_energy_r(2,number_right_states);
-		std::tuple<arma::mat,arma::cx_mat> ks_state_l_k_points(ks_energy_l,ks_state_l); 
-		std::tuple<arma::mat,arma::cx_mat> ks_state_r_k_points(ks_energy_r,ks_state_r);
 		arma::cx_cube ks_state_right(htb_basis_dimension,number_right_states*effective_number_k_points_list,number_g_points_list,arma::fill::zeros);
 		arma::cx_cube ks_state_left(htb_basis_dimension,number_left_states*effective_number_k_points_list,number_g_points_list,arma::fill::zeros);
 
 		///private(ks_states_k_point,ks_states_k_point_q,ks_state,ks_state_q,ks_energy,ks_energy_q)
+		std::tuple<arma::cube,arma::cx_cube,arma::cube,arma::cx_cube> ks_state_lr_k_points=function_building_ks_states_left_right(parameter_l,parameter_r,left,right);
 		for(int i=0;i<number_k_points_list;i++){
-			ks_state_l_k_points = hamiltonian_tb->pull_ks_states_subset(k_points_list.col(i)-parameter_l,(1-left)*number_valence_bands,left*number_conduction_bands);
-			ks_state_r_k_points = hamiltonian_tb->pull_ks_states_subset(k_points_list.col(i)-parameter_r,(1-right)*number_valence_bands,right*number_conduction_bands);	
-			ks_state_l=get<1>(ks_state_l_k_points);
-			ks_state_r=get<1>(ks_state_r_k_points);
-			ks_energy_l=get<0>(ks_state_l_k_points);
-			ks_energy_r=get<0>(ks_state_r_k_points);
+			ks_state_l=get<1>(ks_state_lr_k_points).slice(i);
+			ks_state_r=get<3>(ks_state_lr_k_points).slice(i);
+			ks_energy_l=get<0>(ks_state_lr_k_points).slice(i);
+			ks_energy_r=get<2>(ks_state_lr_k_points).slice(i);
 			//if(left==1&&right==0){
 			//	cout<<"testing orthogonality"<<endl;
 			//	for(int l1=0;l1<number_conduction_bands;l1++)
@@ -2010,7 +3442,26 @@ std::tuple<arma::cx_mat,arma::cx_mat,arma::cx_mat> Dipole_Elements::pull_values(
 		//cout<<"ks_right "<<ks_state_right<<endl;
 		///arma::cx_double temporary;
 		///if(number_g_points_list==1){
-		if(reverse==0){
+		if(point_dipole_approximation==1){
+			///diagonal M: the rows of the right states are scaled by the phases and contracted with the left states
+			arma::cx_mat ks_state_r_scaled(spin_htb_basis_dimension,number_right_states);
+			arma::cx_mat rho_block(number_left_states,number_right_states);
+			for(int i=0;i<number_k_points_list;i++)
+				for(int spin_channel=0;spin_channel<(spinorial_calculation+1);spin_channel++)
+					for(int g=0;g<number_g_points_list;g++){
+						ks_state_r_scaled=get<3>(ks_state_lr_k_points).slice(i).rows(spin_channel*spin_htb_basis_dimension,(spin_channel+1)*spin_htb_basis_dimension-1);
+						for(int r=0;r<spin_htb_basis_dimension;r++)
+							ks_state_r_scaled.row(r)*=exponential_factor(spin_channel*number_wannier_centers+r,g);
+						rho_block=get<1>(ks_state_lr_k_points).slice(i).rows(spin_channel*spin_htb_basis_dimension,(spin_channel+1)*spin_htb_basis_dimension-1).t()*ks_state_r_scaled;
+						for(int n=0;n<number_left_states;n++)
+							for(int m=0;m<number_right_states;m++){
+								if(reverse==0)
+									rho(spin_channel*number_left_states*number_right_states*number_k_points_list+n*number_right_states*number_k_points_list+m*number_k_points_list+i,g)=rho_block(n,m);
+								else
+									rho(spin_channel*number_left_states*number_right_states*number_k_points_list+m*number_left_states*number_k_points_list+n*number_k_points_list+i,g)=rho_block(n,m);
+							}
+					}
+		}else if(reverse==0){
 			//#pragma omp parallel for collapse(6) 
 			for(int spin_channel=0;spin_channel<(spinorial_calculation+1);spin_channel++)
 				for(int n=0;n<number_left_states;n++)
@@ -2019,8 +3470,8 @@ std::tuple<arma::cx_mat,arma::cx_mat,arma::cx_mat> Dipole_Elements::pull_values(
 							for(int i=0;i<number_k_points_list;i++)
 								for(int r=0;r<spin_htb_basis_dimension;r++)
 									for(int s=0;s<spin_htb_basis_dimension;s++){
-										rho(spin_channel*number_left_states*number_right_states*number_k_points_list+n*number_right_states*number_k_points_list+m*number_k_points_list+i,g).real(std::real(rho(spin_channel*number_left_states*number_right_states*number_k_points_list+n*number_right_states*number_k_points_list+m*number_k_points_list+i,g))+std::real(conj(ks_state_left(spin_channel*spin_htb_basis_dimension+r,n*number_k_points_list+i,g))*A_matrix(g)(spin_channel*number_wannier_centers+r,spin_channel*number_wannier_centers+s)*ks_state_right(spin_channel*spin_htb_basis_dimension+s,m*number_k_points_list+i,g)));
-										rho(spin_channel*number_left_states*number_right_states*number_k_points_list+n*number_right_states*number_k_points_list+m*number_k_points_list+i,g).imag(std::imag(rho(spin_channel*number_left_states*number_right_states*number_k_points_list+n*number_right_states*number_k_points_list+m*number_k_points_list+i,g))+std::imag(conj(ks_state_left(spin_channel*spin_htb_basis_dimension+r,n*number_k_points_list+i,g))*A_matrix(g)(spin_channel*number_wannier_centers+r,spin_channel*number_wannier_centers+s)*ks_state_right(spin_channel*spin_htb_basis_dimension+s,m*number_k_points_list+i,g)));
+										rho(spin_channel*number_left_states*number_right_states*number_k_points_list+n*number_right_states*number_k_points_list+m*number_k_points_list+i,g).real(std::real(rho(spin_channel*number_left_states*number_right_states*number_k_points_list+n*number_right_states*number_k_points_list+m*number_k_points_list+i,g))+std::real(conj(ks_state_left(spin_channel*spin_htb_basis_dimension+r,n*number_k_points_list+i,g))*A_matrix(spin_channel*number_wannier_centers+r,spin_channel*number_wannier_centers+s,g)*ks_state_right(spin_channel*spin_htb_basis_dimension+s,m*number_k_points_list+i,g)));
+										rho(spin_channel*number_left_states*number_right_states*number_k_points_list+n*number_right_states*number_k_points_list+m*number_k_points_list+i,g).imag(std::imag(rho(spin_channel*number_left_states*number_right_states*number_k_points_list+n*number_right_states*number_k_points_list+m*number_k_points_list+i,g))+std::imag(conj(ks_state_left(spin_channel*spin_htb_basis_dimension+r,n*number_k_points_list+i,g))*A_matrix(spin_channel*number_wannier_centers+r,spin_channel*number_wannier_centers+s,g)*ks_state_right(spin_channel*spin_htb_basis_dimension+s,m*number_k_points_list+i,g)));
 										//cout<<A_matrix(g)(spin_channel*number_wannier_centers+r,spin_channel*number_wannier_centers+s)<<endl;
 										///cout<<rho(spin_channel*number_left_states*number_right_states*number_k_points_list+n*number_right_states*number_k_points_list+m*number_k_points_list+i,g)<<endl;
 								}
@@ -2035,8 +3486,8 @@ std::tuple<arma::cx_mat,arma::cx_mat,arma::cx_mat> Dipole_Elements::pull_values(
 							for(int i=0;i<number_k_points_list;i++)
 								for(int r=0;r<spin_htb_basis_dimension;r++)
 									for(int s=0;s<spin_htb_basis_dimension;s++){
-										rho(spin_channel*number_left_states*number_right_states*number_k_points_list+m*number_left_states*number_k_points_list+n*number_k_points_list+i,g).real(real(rho(spin_channel*number_left_states*number_right_states*number_k_points_list+m*number_left_states*number_k_points_list+n*number_k_points_list+i,g))+real(conj(ks_state_left(spin_channel*spin_htb_basis_dimension+r,n*number_k_points_list+i,g))*A_matrix(g)(spin_channel*number_wannier_centers+r,spin_channel*number_wannier_centers+s)*ks_state_right(spin_channel*spin_htb_basis_dimension+s,m*number_k_points_list+i,g)));
-										rho(spin_channel*number_left_states*number_right_states*number_k_points_list+m*number_left_states*number_k_points_list+n*number_k_points_list+i,g).imag(imag(rho(spin_channel*number_left_states*number_right_states*number_k_points_list+m*number_left_states*number_k_points_list+n*number_k_points_list+i,g))+imag(conj(ks_state_left(spin_channel*spin_htb_basis_dimension+r,n*number_k_points_list+i,g))*A_matrix(g)(spin_channel*number_wannier_centers+r,spin_channel*number_wannier_centers+s)*ks_state_right(spin_channel*spin_htb_basis_dimension+s,m*number_k_points_list+i,g)));
+										rho(spin_channel*number_left_states*number_right_states*number_k_points_list+m*number_left_states*number_k_points_list+n*number_k_points_list+i,g).real(real(rho(spin_channel*number_left_states*number_right_states*number_k_points_list+m*number_left_states*number_k_points_list+n*number_k_points_list+i,g))+real(conj(ks_state_left(spin_channel*spin_htb_basis_dimension+r,n*number_k_points_list+i,g))*A_matrix(spin_channel*number_wannier_centers+r,spin_channel*number_wannier_centers+s,g)*ks_state_right(spin_channel*spin_htb_basis_dimension+s,m*number_k_points_list+i,g)));
+										rho(spin_channel*number_left_states*number_right_states*number_k_points_list+m*number_left_states*number_k_points_list+n*number_k_points_list+i,g).imag(imag(rho(spin_channel*number_left_states*number_right_states*number_k_points_list+m*number_left_states*number_k_points_list+n*number_k_points_list+i,g))+imag(conj(ks_state_left(spin_channel*spin_htb_basis_dimension+r,n*number_k_points_list+i,g))*A_matrix(spin_channel*number_wannier_centers+r,spin_channel*number_wannier_centers+s,g)*ks_state_right(spin_channel*spin_htb_basis_dimension+s,m*number_k_points_list+i,g)));
 								}
 		}
 		///}else{
@@ -2066,14 +3517,10 @@ std::tuple<arma::cx_mat,arma::cx_mat,arma::cx_mat> Dipole_Elements::pull_values(
 		ks_energy_r.reset();
 	}else{
 		arma::cx_mat energies((spinorial_calculation+1),effective_number_k_points_list*number_left_states*number_right_states,arma::fill::zeros);
-		arma::cx_cube ks_state_l_k_points(htb_basis_dimension,number_left_states,number_k_points_list);
-		arma::cx_cube ks_state_r_k_points(htb_basis_dimension,number_right_states,number_k_points_list);
-		
 		cout<<"diagonalization"<<endl;
-		for(int i=0;i<number_k_points_list;i++){
-			ks_state_l_k_points.slice(i) = get<1>(hamiltonian_tb->pull_ks_states_subset(k_points_list.col(i)-parameter_l,(1-left)*number_valence_bands,left*number_conduction_bands));
-			ks_state_r_k_points.slice(i) = get<1>(hamiltonian_tb->pull_ks_states_subset(k_points_list.col(i)-parameter_r,(1-right)*number_valence_bands,right*number_conduction_bands));
-		}
+		std::tuple<arma::cube,arma::cx_cube,arma::cube,arma::cx_cube> ks_state_lr_k_points=function_building_ks_states_left_right(parameter_l,parameter_r,left,right);
+		arma::cx_cube ks_state_l_k_points=get<1>(ks_state_lr_k_points);
+		arma::cx_cube ks_state_r_k_points=get<3>(ks_state_lr_k_points);
 		///cout<<"exponential_factor"<<endl;
 		//////arma::cx_cube exponential_factor(htb_basis_dimension,number_g_points_list,number_k_points_list*number_k_points_list);
 		///arma::cx_mat temporary_value(htb_basis_dimension,number_g_points_list);
@@ -2100,20 +3547,44 @@ std::tuple<arma::cx_mat,arma::cx_mat,arma::cx_mat> Dipole_Elements::pull_values(
 		
 		///cout<<exponential_factor<<endl;
 		cout<<"combination"<<endl;
-		if(reverse==0){
+		if(point_dipole_approximation==1){
+			///diagonal M: the rows of the right states at k2 are scaled by the phases of (G,k1,k2) and contracted with the left states at k1
+			arma::cx_mat ks_state_r_scaled(spin_htb_basis_dimension,number_right_states);
+			arma::cx_mat rho_block(number_left_states,number_right_states);
+			arma::cx_vec pair_phase(spin_htb_basis_dimension);
+			for(int i=0;i<number_k_points_list;i++)
+				for(int j=first_k_point_tile;j<first_k_point_tile+number_k_points_tile;j++)
+					for(int spin_channel=0;spin_channel<(spinorial_calculation+1);spin_channel++){
+						for(int r=0;r<spin_htb_basis_dimension;r++)
+							pair_phase(r)=exponential_factor(spin_channel*number_wannier_centers+r,number_g_points_list+i)*std::conj(exponential_factor(spin_channel*number_wannier_centers+r,number_g_points_list+j));
+						for(int g=0;g<number_g_points_list;g++){
+							ks_state_r_scaled=ks_state_r_k_points.slice(j).rows(spin_channel*spin_htb_basis_dimension,(spin_channel+1)*spin_htb_basis_dimension-1);
+							for(int r=0;r<spin_htb_basis_dimension;r++)
+								ks_state_r_scaled.row(r)*=exponential_factor(spin_channel*number_wannier_centers+r,g)*pair_phase(r);
+							rho_block=ks_state_l_k_points.slice(i).rows(spin_channel*spin_htb_basis_dimension,(spin_channel+1)*spin_htb_basis_dimension-1).t()*ks_state_r_scaled;
+							for(int n=0;n<number_left_states;n++)
+								for(int m=0;m<number_right_states;m++){
+									if(reverse==0)
+										rho(spin_channel*number_left_states*number_right_states*effective_number_k_points_list+n*number_right_states*effective_number_k_points_list+m*effective_number_k_points_list+i*number_k_points_tile+(j-first_k_point_tile),g)=rho_block(n,m);
+									else
+										rho(spin_channel*number_left_states*number_right_states*effective_number_k_points_list+m*number_left_states*effective_number_k_points_list+n*effective_number_k_points_list+(j-first_k_point_tile)*number_k_points_list+i,g)=rho_block(n,m);
+								}
+						}
+					}
+		}else if(reverse==0){
 			//#pragma omp parallel for collapse(7)
 			for(int spin_channel=0;spin_channel<(spinorial_calculation+1);spin_channel++)
 				for(int n=0;n<number_left_states;n++)
 					for(int m=0;m<number_right_states;m++)
 						for(int i=0;i<number_k_points_list;i++)
-							for(int j=0;j<number_k_points_list;j++)
+							for(int j=first_k_point_tile;j<first_k_point_tile+number_k_points_tile;j++)
 								for(int g=0;g<number_g_points_list;g++)
 									for(int r=0;r<spin_htb_basis_dimension;r++)
 										for(int s=0;s<spin_htb_basis_dimension;s++){
 											///rho(spin_channel*number_left_states*number_right_states*effective_number_k_points_list+n*number_right_states*effective_number_k_points_list+m*effective_number_k_points_list+i*number_k_points_list+j,g).real((rho(spin_channel*number_left_states*number_right_states*effective_number_k_points_list+n*number_right_states*effective_number_k_points_list+m*effective_number_k_points_list+i*number_k_points_list+j,g)).real()+real(exponential_factor(spin_channel*spin_htb_basis_dimension+r,g,i*number_k_points_list+j)*(ks_state_r_k_points(spin_channel*spin_htb_basis_dimension+r,m,j))*A_matrix(g*number_k_points_list*number_k_points_list+i*number_k_points_list+j)(r,s)*conj(ks_state_l_k_points(spin_channel*spin_htb_basis_dimension+s,n,i))));
 											///rho(spin_channel*number_left_states*number_right_states*effective_number_k_points_list+n*number_right_states*effective_number_k_points_list+m*effective_number_k_points_list+i*number_k_points_list+j,g).imag((rho(spin_channel*number_left_states*number_right_states*effective_number_k_points_list+n*number_right_states*effective_number_k_points_list+m*effective_number_k_points_list+i*number_k_points_list+j,g)).imag()+imag(exponential_factor(spin_channel*spin_htb_basis_dimension+r,g,i*number_k_points_list+j)*(ks_state_r_k_points(spin_channel*spin_htb_basis_dimension+r,m,j))*A_matrix(g*number_k_points_list*number_k_points_list+i*number_k_points_list+j)(r,s)*conj(ks_state_l_k_points(spin_channel*spin_htb_basis_dimension+r,n,i))));
-											rho(spin_channel*number_left_states*number_right_states*effective_number_k_points_list+n*number_right_states*effective_number_k_points_list+m*effective_number_k_points_list+i*number_k_points_list+j,g).real((rho(spin_channel*number_left_states*number_right_states*effective_number_k_points_list+n*number_right_states*effective_number_k_points_list+m*effective_number_k_points_list+i*number_k_points_list+j,g)).real()+real((ks_state_r_k_points(spin_channel*spin_htb_basis_dimension+r,m,j))*A_matrix(g*number_k_points_list*number_k_points_list+i*number_k_points_list+j)(spin_channel*number_wannier_centers+r,spin_channel*number_wannier_centers+s)*conj(ks_state_l_k_points(spin_channel*spin_htb_basis_dimension+s,n,i))));
-											rho(spin_channel*number_left_states*number_right_states*effective_number_k_points_list+n*number_right_states*effective_number_k_points_list+m*effective_number_k_points_list+i*number_k_points_list+j,g).imag((rho(spin_channel*number_left_states*number_right_states*effective_number_k_points_list+n*number_right_states*effective_number_k_points_list+m*effective_number_k_points_list+i*number_k_points_list+j,g)).imag()+imag((ks_state_r_k_points(spin_channel*spin_htb_basis_dimension+r,m,j))*A_matrix(g*number_k_points_list*number_k_points_list+i*number_k_points_list+j)(spin_channel*number_wannier_centers+r,spin_channel*number_wannier_centers+s)*conj(ks_state_l_k_points(spin_channel*spin_htb_basis_dimension+r,n,i))));
+											rho(spin_channel*number_left_states*number_right_states*effective_number_k_points_list+n*number_right_states*effective_number_k_points_list+m*effective_number_k_points_list+i*number_k_points_tile+(j-first_k_point_tile),g).real((rho(spin_channel*number_left_states*number_right_states*effective_number_k_points_list+n*number_right_states*effective_number_k_points_list+m*effective_number_k_points_list+i*number_k_points_tile+(j-first_k_point_tile),g)).real()+real((ks_state_r_k_points(spin_channel*spin_htb_basis_dimension+r,m,j))*A_matrix(spin_channel*number_wannier_centers+r,spin_channel*number_wannier_centers+s,g*number_momentum_transfers+momentum_transfer_indexing(i*number_k_points_list+j))*conj(ks_state_l_k_points(spin_channel*spin_htb_basis_dimension+s,n,i))));
+											rho(spin_channel*number_left_states*number_right_states*effective_number_k_points_list+n*number_right_states*effective_number_k_points_list+m*effective_number_k_points_list+i*number_k_points_tile+(j-first_k_point_tile),g).imag((rho(spin_channel*number_left_states*number_right_states*effective_number_k_points_list+n*number_right_states*effective_number_k_points_list+m*effective_number_k_points_list+i*number_k_points_tile+(j-first_k_point_tile),g)).imag()+imag((ks_state_r_k_points(spin_channel*spin_htb_basis_dimension+r,m,j))*A_matrix(spin_channel*number_wannier_centers+r,spin_channel*number_wannier_centers+s,g*number_momentum_transfers+momentum_transfer_indexing(i*number_k_points_list+j))*conj(ks_state_l_k_points(spin_channel*spin_htb_basis_dimension+r,n,i))));
 									}		
 		}else{
 			//#pragma omp parallel for collapse(7) 
@@ -2121,14 +3592,14 @@ std::tuple<arma::cx_mat,arma::cx_mat,arma::cx_mat> Dipole_Elements::pull_values(
 				for(int n=0;n<number_left_states;n++)
 					for(int m=0;m<number_right_states;m++)
 						for(int i=0;i<number_k_points_list;i++)
-							for(int j=0;j<number_k_points_list;j++)
+							for(int j=first_k_point_tile;j<first_k_point_tile+number_k_points_tile;j++)
 								for(int g=0;g<number_g_points_list;g++)
 									for(int r=0;r<spin_htb_basis_dimension;r++)
 										for(int s=0;s<spin_htb_basis_dimension;s++){
 											///rho(spin_channel*number_left_states*number_right_states*effective_number_k_points_list+m*number_left_states*effective_number_k_points_list+n*effective_number_k_points_list+j*number_k_points_list+i,g).real((rho(spin_channel*number_left_states*number_right_states*effective_number_k_points_list+m*number_left_states*effective_number_k_points_list+n*effective_number_k_points_list+j*number_k_points_list+i,g)).real()+real(exponential_factor(spin_channel*spin_htb_basis_dimension+r,g,i*number_k_points_list+j)*(ks_state_r_k_points(spin_channel*spin_htb_basis_dimension+r,m,j))*A_matrix(g*number_k_points_list*number_k_points_list+i*number_k_points_list+j)(r,s)*conj(ks_state_l_k_points(spin_channel*spin_htb_basis_dimension+s,n,i))));
 											///rho(spin_channel*number_left_states*number_right_states*effective_number_k_points_list+m*number_left_states*effective_number_k_points_list+n*effective_number_k_points_list+j*number_k_points_list+i,g).imag((rho(spin_channel*number_left_states*number_right_states*effective_number_k_points_list+m*number_left_states*effective_number_k_points_list+n*effective_number_k_points_list+j*number_k_points_list+i,g)).imag()+imag(exponential_factor(spin_channel*spin_htb_basis_dimension+r,g,i*number_k_points_list+j)*(ks_state_r_k_points(spin_channel*spin_htb_basis_dimension+r,m,j))*A_matrix(g*number_k_points_list*number_k_points_list+i*number_k_points_list+j)(r,s)*conj(ks_state_l_k_points(spin_channel*spin_htb_basis_dimension+s,n,i))));
-											rho(spin_channel*number_left_states*number_right_states*effective_number_k_points_list+m*number_left_states*effective_number_k_points_list+n*effective_number_k_points_list+j*number_k_points_list+i,g).real((rho(spin_channel*number_left_states*number_right_states*effective_number_k_points_list+m*number_left_states*effective_number_k_points_list+n*effective_number_k_points_list+j*number_k_points_list+i,g)).real()+real((ks_state_r_k_points(spin_channel*spin_htb_basis_dimension+r,m,j))*A_matrix(g*number_k_points_list*number_k_points_list+i*number_k_points_list+j)(spin_channel*number_wannier_centers+r,spin_channel*number_wannier_centers+s)*conj(ks_state_l_k_points(spin_channel*spin_htb_basis_dimension+s,n,i))));
-											rho(spin_channel*number_left_states*number_right_states*effective_number_k_points_list+m*number_left_states*effective_number_k_points_list+n*effective_number_k_points_list+j*number_k_points_list+i,g).imag((rho(spin_channel*number_left_states*number_right_states*effective_number_k_points_list+m*number_left_states*effective_number_k_points_list+n*effective_number_k_points_list+j*number_k_points_list+i,g)).imag()+imag((ks_state_r_k_points(spin_channel*spin_htb_basis_dimension+r,m,j))*A_matrix(g*number_k_points_list*number_k_points_list+i*number_k_points_list+j)(spin_channel*number_wannier_centers+r,spin_channel*number_wannier_centers+s)*conj(ks_state_l_k_points(spin_channel*spin_htb_basis_dimension+s,n,i))));
+											rho(spin_channel*number_left_states*number_right_states*effective_number_k_points_list+m*number_left_states*effective_number_k_points_list+n*effective_number_k_points_list+(j-first_k_point_tile)*number_k_points_list+i,g).real((rho(spin_channel*number_left_states*number_right_states*effective_number_k_points_list+m*number_left_states*effective_number_k_points_list+n*effective_number_k_points_list+(j-first_k_point_tile)*number_k_points_list+i,g)).real()+real((ks_state_r_k_points(spin_channel*spin_htb_basis_dimension+r,m,j))*A_matrix(spin_channel*number_wannier_centers+r,spin_channel*number_wannier_centers+s,g*number_momentum_transfers+momentum_transfer_indexing(i*number_k_points_list+j))*conj(ks_state_l_k_points(spin_channel*spin_htb_basis_dimension+s,n,i))));
+											rho(spin_channel*number_left_states*number_right_states*effective_number_k_points_list+m*number_left_states*effective_number_k_points_list+n*effective_number_k_points_list+(j-first_k_point_tile)*number_k_points_list+i,g).imag((rho(spin_channel*number_left_states*number_right_states*effective_number_k_points_list+m*number_left_states*effective_number_k_points_list+n*effective_number_k_points_list+(j-first_k_point_tile)*number_k_points_list+i,g)).imag()+imag((ks_state_r_k_points(spin_channel*spin_htb_basis_dimension+r,m,j))*A_matrix(spin_channel*number_wannier_centers+r,spin_channel*number_wannier_centers+s,g*number_momentum_transfers+momentum_transfer_indexing(i*number_k_points_list+j))*conj(ks_state_l_k_points(spin_channel*spin_htb_basis_dimension+s,n,i))));
 										}	
 		}
 		//for(int spin_channel=0;spin_channel<(spinorial_calculation+1);spin_channel++)
@@ -2157,6 +3628,29 @@ std::tuple<arma::cx_mat,arma::cx_mat,arma::cx_mat> Dipole_Elements::pull_values(
 	return {energies_diff,energies_sum,rho};
 };
 
+std::vector<std::tuple<arma::cx_mat,arma::cx_mat,arma::cx_mat>> Dipole_Elements::pull_values_blocks(std::vector<std::tuple<arma::vec,arma::vec,arma::vec,int,int,int,int,int,int>> blocks,double threshold_proximity){
+	std::vector<std::tuple<arma::cx_mat,arma::cx_mat,arma::cx_mat>> rho_blocks;
+	push_rho_cache(1);
+	for(int b=0;b<int(blocks.size());b++)
+		rho_blocks.push_back(pull_values(get<0>(blocks[b]),get<1>(blocks[b]),get<2>(blocks[b]),get<3>(blocks[b]),0,get<4>(blocks[b]),get<5>(blocks[b]),get<6>(blocks[b]),0,threshold_proximity,get<7>(blocks[b]),get<8>(blocks[b])));
+	push_rho_cache(0);
+	return rho_blocks;
+};
+std::tuple<arma::cx_mat,arma::cx_mat,arma::cx_mat> Dipole_Elements::pull_values_k_tile(arma::vec excitonic_momentum,arma::vec parameter_l,arma::vec parameter_r,int left,int right,double threshold_proximity,int radius_convergence,int first_k_point_tile_tmp,int number_k_points_tile_tmp){
+	first_k_point_tile=first_k_point_tile_tmp;
+	number_k_points_tile=number_k_points_tile_tmp;
+	std::tuple<arma::cx_mat,arma::cx_mat,arma::cx_mat> values=pull_values(excitonic_momentum,parameter_l,parameter_r,0,0,left,right,0,0,threshold_proximity,0,radius_convergence);
+	first_k_point_tile=0;
+	number_k_points_tile=number_k_points_list;
+	return values;
+};
+void Dipole_Elements::push_rho_cache(int rho_cache_tmp){
+	rho_cache=rho_cache_tmp;
+	if(rho_cache==0){
+		ks_states_cache.clear();
+		M_matrix_cache.clear();
+	}
+};
 void Dipole_Elements::print(arma::vec excitonic_momentum,arma::vec parameter_l,arma::vec parameter_r,int diagonal_k,int minus,int left, int right,double threshold_proximity){
 	
 	///std::tuple<arma::cx_mat,arma::cx_mat,arma::cx_mat> energies_and_dipole_elements=pull_values(excitonic_momentum,parameter_l,parameter_r,diagonal_k,minus,left,right,0,0,threshold_proximity);
@@ -2169,8 +3663,8 @@ void Dipole_Elements::print(arma::vec excitonic_momentum,arma::vec parameter_l,a
 	//		arma::cx_mat A_ij=function_building_real_space_wannier_dipole_ij(w1,w2,excitonic_momentum,zeros);
 	//		cout<<w1<<" "<<w2<<" "<<A_ij<<endl;
 	//	}
-	arma::field<arma::cx_mat> Mij=function_building_M_k1k2_ij(excitonic_momentum,1,0,0);
-	cout<<Mij(0)<<endl;
+	std::tuple<arma::cx_cube,arma::ivec> Mij=function_building_M_k1k2_ij(excitonic_momentum,1,0,0);
+	cout<<get<0>(Mij).slice(0)<<endl;
 };
 
 
@@ -2187,12 +3681,20 @@ private:
 	Coulomb_Potential *coulomb_potential;
 	int spinorial_calculation;
 	double volume_cell;
+	int g_point_0;
+	/// rho_cv(q,G) (rows: spin,c,v,k) and the same columns multiplied by the frequency factors of chi0
+	std::tuple<arma::cx_mat,arma::cx_mat> function_building_rho_and_factors(arma::vec excitonic_momentum,arma::cx_double omega,double eta,double threshold_proximity);
 public:
 	Dielectric_Function(Dipole_Elements *dipole_elements_tmp,int number_k_points_list_tmp,int number_g_points_list_tmp,arma::mat g_points_list_tmp,int number_valence_bands_tmp,int number_conduction_bands_tmp,Coulomb_Potential *coulomb_potential_tmp,int spinorial_calculation_tmp,double volume_cell_tmp);
 	arma::cx_mat pull_values(arma::vec excitonic_momentum,arma::cx_double omega,double eta,int order_approximation,double threshold_proximity);
 	arma::cx_mat pull_values_PPA(arma::vec excitonic_momentum,arma::cx_double omega,double eta,double PPA,int order_approximation,double threshold_proximity);
 	void print(arma::vec excitonic_momentum,arma::cx_double omega,double eta,double PPA,int which_term,int order_approximation,double threshold_proximity);
 	void pull_macroscopic_value(arma::vec direction,arma::cx_vec omegas_path,int number_omegas_path,double eta,string file_macroscopic_dielectric_function_name,int order_approximation,double threshold_proximity);
+	/// local fields convergence: the G (sorted by |G|) are added shell by shell, epsilon^{-1} is extended with the Schur complement
+	/// of the new block (the rho columns and the chi0 blocks already calculated are reused), until the head of epsilon_M changes less than tolerance
+	/// returns the number of G (first ones by |G|) and epsilon_M, to be passed to G_points::push_number_g_points_list before building the objects of the run
+	/// (rho is calculated once on the whole list given here; the criterion is on epsilon_M only, the exciton energies are not checked)
+	std::tuple<int,arma::cx_double> pull_converged_g_shells(arma::vec excitonic_momentum,arma::cx_double omega,double eta,double threshold_proximity,double tolerance);
 	~Dielectric_Function(){
 		coulomb_potential=NULL;
 		dipole_elements=NULL;
@@ -2208,24 +3710,20 @@ g_points_list(3,number_g_points_list_tmp)
 	dipole_elements=dipole_elements_tmp;
 	coulomb_potential=coulomb_potential_tmp;
 	g_points_list=g_points_list_tmp;
+	g_point_0=function_finding_g_point_0(g_points_list);
 	spinorial_calculation=spinorial_calculation_tmp;
 	volume_cell=volume_cell_tmp;
 };
-arma::cx_mat Dielectric_Function::pull_values(arma::vec excitonic_momentum,arma::cx_double omega, double eta, int order_approximation,double threshold_proximity){
-	arma::cx_mat epsiloninv(number_g_points_list,number_g_points_list,arma::fill::zeros);
+std::tuple<arma::cx_mat,arma::cx_mat> Dielectric_Function::function_building_rho_and_factors(arma::vec excitonic_momentum,arma::cx_double omega,double eta,double threshold_proximity){
 	arma::cx_double ieta; ieta.real(0.0); ieta.imag(eta);
-	int number_valence_plus_conduction=number_conduction_bands+number_valence_bands;
 	int dimension=(spinorial_calculation+1)*number_k_points_list*number_conduction_bands*number_valence_bands;
 
 	arma::vec zeros_vec(3,arma::fill::zeros);
 	std::tuple<arma::cx_mat,arma::cx_mat,arma::cx_mat> energies_rho=dipole_elements->pull_values(excitonic_momentum,zeros_vec,excitonic_momentum,1,0,1,0,0,0,threshold_proximity,0,0);
 	arma::cx_mat rho_cv=get<2>(energies_rho);
 	arma::cx_mat energies=get<0>(energies_rho);
-	arma::cx_vec coulomb_shifted(number_g_points_list);
 	arma::cx_double ione; ione.real(1.0); ione.imag(0.0);
-	int g_point_0=int(number_g_points_list/2);
 	
-	//auto t1 = std::chrono::high_resolution_clock::now();
 	/// defining the denominator factors
 	arma::cx_mat rho_reduced_single_column_modified(dimension,number_g_points_list);
 	arma::cx_vec multiplicative_factor(dimension);
@@ -2236,14 +3734,23 @@ arma::cx_mat Dielectric_Function::pull_values(arma::vec excitonic_momentum,arma:
 				for(int v=0;v<number_valence_bands;v++)
 					multiplicative_factor(spin_channel*number_conduction_bands*number_valence_bands*number_k_points_list+c*number_valence_bands*number_k_points_list+v*number_k_points_list+i)= ione / (omega - energies(spin_channel,c*number_valence_bands*number_k_points_list+v*number_k_points_list+i) + ieta) -  ione / (omega + energies(spin_channel,c*number_valence_bands*number_k_points_list+v*number_k_points_list+i) - ieta);	
 	}
-	
-	///cout<<volume_cell<<endl;
-	//#pragma omp parallel for
-	for(int i=0;i<number_g_points_list;i++){
-		coulomb_shifted(i).real((coulomb_potential->pull(excitonic_momentum+g_points_list.col(i))));
+	for(int i=0;i<number_g_points_list;i++)
 		for(int r=0;r<dimension;r++)
 			rho_reduced_single_column_modified(r,i)=rho_cv(r,i)*multiplicative_factor(r);
-	}
+	return {rho_cv,rho_reduced_single_column_modified};
+};
+arma::cx_mat Dielectric_Function::pull_values(arma::vec excitonic_momentum,arma::cx_double omega, double eta, int order_approximation,double threshold_proximity){
+	arma::cx_mat epsiloninv(number_g_points_list,number_g_points_list,arma::fill::zeros);
+	int dimension=(spinorial_calculation+1)*number_k_points_list*number_conduction_bands*number_valence_bands;
+
+	std::tuple<arma::cx_mat,arma::cx_mat> rho_and_factors=function_building_rho_and_factors(excitonic_momentum,omega,eta,threshold_proximity);
+	arma::cx_mat rho_cv=get<0>(rho_and_factors);
+	arma::cx_mat rho_reduced_single_column_modified=get<1>(rho_and_factors);
+	arma::cx_vec coulomb_shifted(number_g_points_list);
+	
+	const arma::vec& coulomb_shifted_real=coulomb_potential->pull_table(excitonic_momentum);
+	for(int i=0;i<number_g_points_list;i++)
+		coulomb_shifted(i).real(coulomb_shifted_real(i));
 
 	const double factor_chi=1/(volume_cell*number_k_points_list);
 	arma::cx_double temporary1;
@@ -2308,11 +3815,78 @@ arma::cx_mat Dielectric_Function::pull_values(arma::vec excitonic_momentum,arma:
 	///cout<<"EPSILON^-1 RPA"<<endl;
 	///cout<<epsiloninv(g_point_0,g_point_0)<<endl;
 
-	multiplicative_factor.reset();
 	rho_reduced_single_column_modified.reset();
 
 	return epsiloninv;
 };
+std::tuple<int,arma::cx_double> Dielectric_Function::pull_converged_g_shells(arma::vec excitonic_momentum,arma::cx_double omega,double eta,double threshold_proximity,double tolerance){
+	/// G ordered by |G| (G=0 first) and grouped in shells
+	arma::vec modulus_g_points(number_g_points_list);
+	for(int i=0;i<number_g_points_list;i++)
+		modulus_g_points(i)=arma::norm(g_points_list.col(i));
+	arma::uvec sorting=arma::stable_sort_index(modulus_g_points);
+	std::vector<int> shells_end;
+	for(int i=1;i<number_g_points_list;i++)
+		if(modulus_g_points(sorting(i))-modulus_g_points(sorting(i-1))>minval*(1.0+modulus_g_points(sorting(i))))
+			shells_end.push_back(i);
+	shells_end.push_back(number_g_points_list);
+
+	/// rho columns of all G (calculated once), chi0 blocks added with the new G
+	std::tuple<arma::cx_mat,arma::cx_mat> rho_and_factors=function_building_rho_and_factors(excitonic_momentum,omega,eta,threshold_proximity);
+	arma::cx_mat rho_cv(get<0>(rho_and_factors).n_rows,number_g_points_list);
+	arma::cx_mat rho_modified(get<0>(rho_and_factors).n_rows,number_g_points_list);
+	const arma::vec& coulomb_shifted=coulomb_potential->pull_table(excitonic_momentum);
+	const double factor_chi=1/(volume_cell*number_k_points_list);
+	arma::vec coulomb_sorted(number_g_points_list);
+	for(int i=0;i<number_g_points_list;i++){
+		rho_cv.col(i)=get<0>(rho_and_factors).col(sorting(i));
+		rho_modified.col(i)=get<1>(rho_and_factors).col(sorting(i));
+		coulomb_sorted(i)=factor_chi*coulomb_shifted(sorting(i));
+	}
+
+	/// epsilon(i,j)=delta_ij-v_j factor_chi \sum_r rho^*_{ri} rho_modified_{rj} (as in pull_values, order_approximation=1),
+	/// the matrix of order_approximation=0 (delta+v chi0) is already epsilon^{-1} and cannot be extended in this way
+	arma::cx_mat epsilon_inverse;
+	arma::cx_double epsilon_macroscopic=0.0;
+	arma::cx_double epsilon_macroscopic_previous=0.0;
+	int number_g_points_converged=0;
+	for(int n=0;n<int(shells_end.size());n++){
+		int number_old=number_g_points_converged;
+		int number_new=shells_end[n];
+		arma::cx_mat block_new_new=rho_cv.cols(number_old,number_new-1).t()*rho_modified.cols(number_old,number_new-1);
+		for(int j=0;j<number_new-number_old;j++){
+			block_new_new.col(j)*=-coulomb_sorted(number_old+j);
+			block_new_new(j,j)+=1.0;
+		}
+		if(number_old==0){
+			epsilon_inverse=arma::inv(block_new_new);
+		}else{
+			arma::cx_mat block_old_new=rho_cv.cols(0,number_old-1).t()*rho_modified.cols(number_old,number_new-1);
+			for(int j=0;j<number_new-number_old;j++)
+				block_old_new.col(j)*=-coulomb_sorted(number_old+j);
+			arma::cx_mat block_new_old=rho_cv.cols(number_old,number_new-1).t()*rho_modified.cols(0,number_old-1);
+			for(int j=0;j<number_old;j++)
+				block_new_old.col(j)*=-coulomb_sorted(j);
+			/// Schur complement S=D-C A^{-1} B of the new block
+			arma::cx_mat inverse_times_old_new=epsilon_inverse*block_old_new;
+			arma::cx_mat new_old_times_inverse=block_new_old*epsilon_inverse;
+			arma::cx_mat schur_inverse=arma::inv(block_new_new-block_new_old*inverse_times_old_new);
+			arma::cx_mat epsilon_inverse_extended(number_new,number_new);
+			epsilon_inverse_extended.submat(0,0,number_old-1,number_old-1)=epsilon_inverse+inverse_times_old_new*schur_inverse*new_old_times_inverse;
+			epsilon_inverse_extended.submat(0,number_old,number_old-1,number_new-1)=-inverse_times_old_new*schur_inverse;
+			epsilon_inverse_extended.submat(number_old,0,number_new-1,number_old-1)=-schur_inverse*new_old_times_inverse;
+			epsilon_inverse_extended.submat(number_old,number_old,number_new-1,number_new-1)=schur_inverse;
+			epsilon_inverse=epsilon_inverse_extended;
+		}
+		number_g_points_converged=number_new;
+		epsilon_macroscopic_previous=epsilon_macroscopic;
+		epsilon_macroscopic=1.0/epsilon_inverse(0,0);
+		cout<<"G shell "<<n<<" number G "<<number_g_points_converged<<" epsilon_M "<<epsilon_macroscopic<<endl;
+		if(n>0&&std::abs(epsilon_macroscopic-epsilon_macroscopic_previous)<tolerance*std::abs(epsilon_macroscopic))
+			break;
+	}
+	return {number_g_points_converged,epsilon_macroscopic};
+};
 arma::cx_mat Dielectric_Function::pull_values_PPA(arma::vec excitonic_momentum,arma::cx_double omega,double eta,double PPA,int order_approximation,double threshold_proximity){
 	arma::cx_double omega_PPA; omega_PPA.imag(PPA); omega_PPA.real(0.0);
 	arma::cx_double omega_0; omega_0.real(0.0); omega_0.imag(0.0);
@@ -2344,7 +3918,6 @@ void Dielectric_Function::pull_macroscopic_value(arma::vec direction,arma::cx_ve
 	arma::vec q_point_0(3,arma::fill::zeros);
 	arma::cx_double ieta; ieta.real(0.0); ieta.imag(eta);
 	q_point_0(0)+=minval;
-	int g_point_0=int(number_g_points_list/2);
 	ofstream file_macroscopic_dielectric_function;
 	file_macroscopic_dielectric_function.open(file_macroscopic_dielectric_function_name);
 	for(int i=0;i<number_omegas_path;i++){
@@ -2458,11 +4031,35 @@ private:
 	arma::cx_vec v_coulomb_g;
 	arma::cx_mat excitonic_hamiltonian;
 	arma::cx_mat rho_q_diagk_cv;
-	arma::mat k_points_differences;
+	/// time reversal: epsilon^{-1}(-q)_{G,G'}=epsilon^{-1}(q)_{-G',-G}, only the pairs (k,k') with k<=k' are calculated
+	int time_reversal_symmetry;
+	arma::ivec minus_g_points;
+	/// 1: the first pair filled by time reversal is compared with its direct evaluation (test on crystals without inversion)
+	int checking_time_reversal_W;
+	double function_checking_time_reversal_W(Coulomb_Potential* coulomb_potential,Dielectric_Function* dielectric_function,int index_k_points_pair,int symmetrized,double eta,int order_approximation);
+	int g_point_0;
+	/// average of W around q=0: 0 sampled sphere, 1 quadrature on the Wigner-Seitz cell of the k grid (mini BZ)
+	int head_average_type;
+	arma::mat mini_brillouin_zone_vectors{arma::mat(3,3)};
+	/// sampling of the points for the average of the dielectric function around q=0 (see Sampling_Points)
+	int sampling_type_integration;
+	unsigned long long seed_integration;
+	/// memory (MB) for the k-pair rho tiles of the direct term (two tiles, cc and vv, are kept at the same time)
+	double memory_budget_direct_term;
+	/// rho_cc(k2,k1) and rho_vv(k2-q,k1-q) for the k1 in the tile
+	std::tuple<arma::cx_mat,arma::cx_mat> function_building_direct_term_rho_tile(int first_k_point_tile,int number_k_points_tile,int radius_convergence);
 public:
 	/// be carefull: do not try to build the BSE matrix with more bands than those given by the hamiltonian!!!
 	/// there is a check at the TB hamiltonian level but not here...
-	Excitonic_Hamiltonian(int number_valence_bands_tmp,int number_conduction_bands_tmp, arma::mat k_points_list_tmp, int number_k_points_list_tmp, arma::mat g_points_list_tmp,int number_g_points_list_tmp, int spinorial_calculation_tmp, int htb_basis_dimension_tmp,Dipole_Elements *dipole_elements_tmp, double cell_volume_tmp,int tamn_dancoff_tmp,int insulator_metal_tmp,arma::mat k_points_differences_tmp,double threshold_proximity_tmp);
+	Excitonic_Hamiltonian(int number_valence_bands_tmp,int number_conduction_bands_tmp, arma::mat k_points_list_tmp, int number_k_points_list_tmp, arma::mat g_points_list_tmp,int number_g_points_list_tmp, int spinorial_calculation_tmp, int htb_basis_dimension_tmp,Dipole_Elements *dipole_elements_tmp, double cell_volume_tmp,int tamn_dancoff_tmp,int insulator_metal_tmp,double threshold_proximity_tmp);
+	void push_time_reversal_symmetry(int time_reversal_symmetry_tmp,int checking_time_reversal_W_tmp);
+	void push_head_average(int head_average_type_tmp,arma::mat mini_brillouin_zone_vectors_tmp);
+	void push_sampling_integration(int sampling_type_integration_tmp,unsigned long long seed_integration_tmp);
+	void push_memory_budget_direct_term(double memory_budget_direct_term_tmp);
+	/// k_i-k_j-momentum for the pair index i*number_k_points_list+j (computed on demand)
+	/// k_i-k_j-momentum of the pair index_k_points_pair=i*number_k_points_list+j, computed on demand (no Nk^2 list is stored);
+	/// the shift of the grid cancels in the difference, whatever the coordinates in which it has been added
+	arma::vec pull_k_points_difference(int index_k_points_pair,arma::vec momentum);
 	void pull_coulomb_potentials(Coulomb_Potential* coulomb_potential,Dielectric_Function* dielectric_function,int adding_screening,arma::vec excitonic_momentum,double eta,int order_approximation,int number_integration_points,int reading_W,int adding_momentum);
 	void pull_resonant_part_and_rcv(arma::vec excitonic_momentum_tmp,int ipa,int small_momentum_value,int radius_convergence);
 	void add_coupling_part();
@@ -2482,8 +4079,8 @@ public:
 	///	rho_p_diagk_vc.reset();
 	///}
 };
-Excitonic_Hamiltonian::Excitonic_Hamiltonian(int number_valence_bands_tmp,int number_conduction_bands_tmp, arma::mat k_points_list_tmp, int number_k_points_list_tmp, arma::mat g_points_list_tmp,int number_g_points_list_tmp,int spinorial_calculation_tmp,int htb_basis_dimension_tmp,Dipole_Elements *dipole_elements_tmp,double cell_volume_tmp,int tamn_dancoff_tmp,int insulator_metal_tmp,arma::mat k_points_differences_tmp,double threshold_proximity_tmp):
-k_points_differences(3,number_k_points_list_tmp*number_k_points_list_tmp),k_points_list(3,number_k_points_list_tmp),g_points_list(3,number_g_points_list_tmp),exciton(2, number_valence_bands_tmp*number_conduction_bands_tmp),v_coulomb_gg(number_g_points_list_tmp,number_g_points_list_tmp,number_k_points_list_tmp*number_k_points_list_tmp),
+Excitonic_Hamiltonian::Excitonic_Hamiltonian(int number_valence_bands_tmp,int number_conduction_bands_tmp, arma::mat k_points_list_tmp, int number_k_points_list_tmp, arma::mat g_points_list_tmp,int number_g_points_list_tmp,int spinorial_calculation_tmp,int htb_basis_dimension_tmp,Dipole_Elements *dipole_elements_tmp,double cell_volume_tmp,int tamn_dancoff_tmp,int insulator_metal_tmp,double threshold_proximity_tmp):
+k_points_list(3,number_k_points_list_tmp),g_points_list(3,number_g_points_list_tmp),exciton(2, number_valence_bands_tmp*number_conduction_bands_tmp),v_coulomb_gg(number_g_points_list_tmp,number_g_points_list_tmp,number_k_points_list_tmp*number_k_points_list_tmp),
 v_coulomb_g(number_g_points_list_tmp),excitonic_hamiltonian((2-tamn_dancoff_tmp)*(3*spinorial_calculation_tmp+1)*number_conduction_bands_tmp*number_valence_bands_tmp*number_k_points_list_tmp,(2-tamn_dancoff_tmp)*(3*spinorial_calculation_tmp+1)*number_conduction_bands_tmp*number_valence_bands_tmp*number_k_points_list_tmp),
 rho_q_diagk_cv((2-tamn_dancoff_tmp)*(spinorial_calculation_tmp+1)*number_conduction_bands_tmp*number_valence_bands_tmp*number_k_points_list_tmp,number_g_points_list_tmp)
 {
@@ -2497,13 +4094,21 @@ rho_q_diagk_cv((2-tamn_dancoff_tmp)*(spinorial_calculation_tmp+1)*number_conduct
 	k_points_list = k_points_list_tmp;
 	g_points_list = g_points_list_tmp;
 	number_g_points_list = number_g_points_list_tmp;
+	g_point_0 = function_finding_g_point_0(g_points_list);
 	htb_basis_dimension = htb_basis_dimension_tmp;
 
 	bravais_lattice=dipole_elements_tmp->pull_bravais_lattice();
 
 	threshold_proximity=threshold_proximity_tmp;
-	k_points_differences=k_points_differences_tmp;
 	tamn_dancoff=tamn_dancoff_tmp;
+	time_reversal_symmetry=0;
+	checking_time_reversal_W=0;
+	sampling_type_integration=1;
+	seed_integration=0;
+	/// mini BZ of the same volume of the one per k point, until the grid vectors are given
+	head_average_type=1;
+	memory_budget_direct_term=1024.0;
+	mini_brillouin_zone_vectors=2*pigreco*arma::inv(bravais_lattice).t()/std::cbrt(double(number_k_points_list));
 
 	cell_volume=cell_volume_tmp;
 	dipole_elements=dipole_elements_tmp;
@@ -2542,14 +4147,79 @@ rho_q_diagk_cv((2-tamn_dancoff_tmp)*(spinorial_calculation_tmp+1)*number_conduct
 	///cout<<"Finished allocating HBSE memory"<<endl;
 
 };
+void Excitonic_Hamiltonian::push_sampling_integration(int sampling_type_integration_tmp,unsigned long long seed_integration_tmp){
+	sampling_type_integration=sampling_type_integration_tmp;
+	seed_integration=seed_integration_tmp;
+};
+void Excitonic_Hamiltonian::push_memory_budget_direct_term(double memory_budget_direct_term_tmp){
+	memory_budget_direct_term=memory_budget_direct_term_tmp;
+};
+std::tuple<arma::cx_mat,arma::cx_mat> Excitonic_Hamiltonian::function_building_direct_term_rho_tile(int first_k_point_tile,int number_k_points_tile,int radius_convergence){
+	arma::vec zeros_vec(3,arma::fill::zeros);
+	arma::cx_mat rho_kk_cc=get<2>(dipole_elements->pull_values_k_tile(zeros_vec,zeros_vec,zeros_vec,1,1,threshold_proximity,radius_convergence,first_k_point_tile,number_k_points_tile));
+	arma::cx_mat rho_qq_kk_vv=get<2>(dipole_elements->pull_values_k_tile(zeros_vec,excitonic_momentum,excitonic_momentum,0,0,threshold_proximity,radius_convergence,first_k_point_tile,number_k_points_tile));
+	return {rho_kk_cc,rho_qq_kk_vv};
+};
+void Excitonic_Hamiltonian::push_head_average(int head_average_type_tmp,arma::mat mini_brillouin_zone_vectors_tmp){
+	head_average_type=head_average_type_tmp;
+	mini_brillouin_zone_vectors=mini_brillouin_zone_vectors_tmp;
+};
+void Excitonic_Hamiltonian::push_time_reversal_symmetry(int time_reversal_symmetry_tmp,int checking_time_reversal_W_tmp){
+	time_reversal_symmetry=time_reversal_symmetry_tmp;
+	checking_time_reversal_W=checking_time_reversal_W_tmp;
+	minus_g_points.set_size(number_g_points_list);
+	for(int g=0;g<number_g_points_list;g++){
+		minus_g_points(g)=-1;
+		for(int g1=0;g1<number_g_points_list;g1++)
+			if(arma::vecnorm(g_points_list.col(g)+g_points_list.col(g1))<minval)
+				minus_g_points(g)=g1;
+		/// the list of G is not symmetric
+		if(minus_g_points(g)==-1){
+			cout<<"G list not symmetric under G->-G, time reversal not used for W"<<endl;
+			time_reversal_symmetry=0;
+		}
+	}
+};
+/// largest difference between the slice of W filled by time reversal and W evaluated directly at the same k-k'
+/// symmetrized=1 v^{1/2}(q+G)epsilon^{-1}_{G,G'}v^{1/2}(q+G'), 0 epsilon^{-1}_{G,G'}v(q+G')
+double Excitonic_Hamiltonian::function_checking_time_reversal_W(Coulomb_Potential* coulomb_potential,Dielectric_Function* dielectric_function,int index_k_points_pair,int symmetrized,double eta,int order_approximation){
+	arma::cx_double omega_0; omega_0.real(0.0); omega_0.imag(0.0);
+	arma::vec zeros_vec(3,arma::fill::zeros);
+	arma::vec k_point=pull_k_points_difference(index_k_points_pair,zeros_vec);
+	arma::cx_mat epsilon_inv=dielectric_function->pull_values(k_point,omega_0,eta,order_approximation,threshold_proximity);
+	arma::vec coulomb_potential_g;
+	if(symmetrized==1)
+		coulomb_potential_g=coulomb_potential->pull_table_sqrt(k_point);
+	else
+		coulomb_potential_g=coulomb_potential->pull_table(k_point);
+	double maximum_difference=0.0;
+	for (int s = 0; s < number_g_points_list; s++)
+		for (int k = 0; k < number_g_points_list; k++){
+			arma::cx_double w_direct=epsilon_inv(k,s)*coulomb_potential_g(s);
+			if(symmetrized==1)
+				w_direct*=coulomb_potential_g(k);
+			maximum_difference=std::max(maximum_difference,std::abs(w_direct-v_coulomb_gg(k,s,index_k_points_pair)));
+		}
+	return maximum_difference;
+};
+arma::vec Excitonic_Hamiltonian::pull_k_points_difference(int index_k_points_pair,arma::vec momentum){
+	int i=index_k_points_pair/number_k_points_list;
+	int j=index_k_points_pair%number_k_points_list;
+	arma::vec k_points_difference(3);
+	for(int r=0;r<3;r++)
+		k_points_difference(r)=k_points_list(r,i)-k_points_list(r,j)-momentum(r);
+	return k_points_difference;
+};
 /// calculating the potentianl before the BSE hamiltonian building
 /// calculating the generalized potential (the screened one and the unscreened-one)
+/// adding_momentum=1: the differences are k-k'-excitonic_momentum (the momentum enters as a parameter, the k points are not modified)
 void Excitonic_Hamiltonian::pull_coulomb_potentials(Coulomb_Potential* coulomb_potential,Dielectric_Function* dielectric_function,int adding_screening,arma::vec excitonic_momentum,double eta,int order_approximation,int number_integration_points,int reading_W,int adding_momentum){
 	
+	arma::vec momentum_shift(3,arma::fill::zeros);
+	/// with the momentum the pairs (k,k') and (k',k) are not related anymore by time reversal
+	int time_reversal_W=time_reversal_symmetry*(1-adding_momentum);
 	if(adding_momentum==1){
-		for(int i=0;i<number_k_points_list*number_k_points_list;i++)
-			for(int r=0;r<3;r++)
-				k_points_differences(r,i)=k_points_differences(r,i)-excitonic_momentum(r);
+		momentum_shift=excitonic_momentum;
 		for (int k = 0; k < number_g_points_list; k++)
 			v_coulomb_g(k)=0.0;
 		for(int i = 0; i < number_k_points_list; i++)
@@ -2562,9 +4232,11 @@ void Excitonic_Hamiltonian::pull_coulomb_potentials(Coulomb_Potential* coulomb_p
 	arma::cx_double omega_0; omega_0.real(0.0); omega_0.imag(0.0);
 	arma::cx_mat epsilon_inv_static(number_g_points_list,number_g_points_list);
 	
-	int g_point_0=int(number_g_points_list/2);
+	/// v(q+G) of the current pair, from the table of the potential (the same differences k-k' are shared by many pairs)
+	arma::vec coulomb_potential_g(number_g_points_list);
+	coulomb_potential_g=coulomb_potential->pull_table(excitonic_momentum);
 	for (int k = 0; k < number_g_points_list; k++)
-		v_coulomb_g(k) = coulomb_potential->pull(excitonic_momentum+g_points_list.col(k));
+		v_coulomb_g(k) = coulomb_potential_g(k);
 
 	int writing_on_file_W=1;
 
@@ -2576,19 +4248,32 @@ void Excitonic_Hamiltonian::pull_coulomb_potentials(Coulomb_Potential* coulomb_p
 			if(adding_screening==1){
 				for(int i = 0; i < number_k_points_list; i++)
 					for(int j = 0; j < number_k_points_list; j++){
-						k_point=k_points_differences.col(i*number_k_points_list+j);
+						if(time_reversal_W==1&&i>j)
+							continue;
+						k_point=pull_k_points_difference(i*number_k_points_list+j,momentum_shift);
 						temporary_matrix=dielectric_function->pull_values(k_point,omega_0,eta,order_approximation,threshold_proximity);
+						coulomb_potential_g=coulomb_potential->pull_table(k_point);
 						for (int k = 0; k < number_g_points_list; k++)
 							for (int s = 0; s < number_g_points_list; s++)
-								v_coulomb_gg(k,s,i*number_k_points_list+j)=temporary_matrix(k,s)*coulomb_potential->pull(k_points_differences.col(i*number_k_points_list+j)+g_points_list.col(s));
+								v_coulomb_gg(k,s,i*number_k_points_list+j)=temporary_matrix(k,s)*coulomb_potential_g(s);
+						/// W(k'-k)_{G,G'}=epsilon^{-1}(k-k')_{-G',-G}v(k-k'-G'), with v(k-k'-G') in the table of k-k' (v is not symmetric in G,G' here)
+						if(time_reversal_W==1&&i<j)
+							for (int k = 0; k < number_g_points_list; k++)
+								for (int s = 0; s < number_g_points_list; s++)
+									v_coulomb_gg(k,s,j*number_k_points_list+i)=temporary_matrix(minus_g_points(s),minus_g_points(k))*coulomb_potential_g(minus_g_points(s));
 					}
+				if(time_reversal_W==1&&checking_time_reversal_W==1&&number_k_points_list>1)
+					cout<<"time reversal W, largest difference with the direct evaluation "<<function_checking_time_reversal_W(coulomb_potential,dielectric_function,number_k_points_list,0,eta,order_approximation)<<endl;
 			}else{
 				temporary_matrix.eye();
 				for(int i = 0; i < number_k_points_list; i++)
-					for(int j = 0; j < number_k_points_list; j++)
+					for(int j = 0; j < number_k_points_list; j++){
+						k_point=pull_k_points_difference(i*number_k_points_list+j,momentum_shift);
+						coulomb_potential_g=coulomb_potential->pull_table(k_point);
 						for (int k = 0; k < number_g_points_list; k++)
 							for (int s = 0; s < number_g_points_list; s++)
-								v_coulomb_gg(k,s,i*number_k_points_list+j)=temporary_matrix(k,s)*coulomb_potential->pull(k_points_differences.col(i*number_k_points_list+j)+g_points_list.col(s));
+								v_coulomb_gg(k,s,i*number_k_points_list+j)=temporary_matrix(k,s)*coulomb_potential_g(s);
+					}
 			}			
 		}else{
 			///in the case of an insulator 0
@@ -2603,7 +4288,7 @@ void Excitonic_Hamiltonian::pull_coulomb_potentials(Coulomb_Potential* coulomb_p
 			int counting_0=0;
 			for(int i = 0; i < number_k_points_list; i++)
 				for(int j = 0; j < number_k_points_list; j++){
-					if(norm(k_points_differences.col(i*number_k_points_list+j))>minval)
+					if(norm(pull_k_points_difference(i*number_k_points_list+j,momentum_shift))>minval)
 						counting_gt0+=1;
 					else
 						counting_0+=1;
@@ -2614,7 +4299,7 @@ void Excitonic_Hamiltonian::pull_coulomb_potentials(Coulomb_Potential* coulomb_p
 			counting_gt0=0;
 			for(int i = 0; i < number_k_points_list; i++)
 				for(int j = 0; j < number_k_points_list; j++){
-					if(norm(k_points_differences.col(i*number_k_points_list+j))>minval){
+					if(norm(pull_k_points_difference(i*number_k_points_list+j,momentum_shift))>minval){
 						k_points_differences_gt0(counting_gt0)=i*number_k_points_list+j;
 						counting_gt0+=1;
 					}else{
@@ -2623,60 +4308,127 @@ void Excitonic_Hamiltonian::pull_coulomb_potentials(Coulomb_Potential* coulomb_p
 					}
 				}
 
-			double coulomb_potential_average_g1;
-			double coulomb_potential_average_g2;
 			double coulomb_potential_average_g1_0=conversion_parameter*4*pigreco*radius*number_k_points_list*cell_volume/pow(2*pigreco,3);
+			/// bare part on the mini BZ: 1/V \int_{mini BZ} 1/q^2 (quadrature on the faces of the Wigner-Seitz cell)
+			Mini_Brillouin_Zone mini_brillouin_zone(mini_brillouin_zone_vectors,2);
+			if(head_average_type==1){
+				if(coulomb_potential->pull_dimension_potential()==3)
+					coulomb_potential_average_g1_0=conversion_parameter*mini_brillouin_zone.pull_average_inverse_square();
+				else{
+					/// truncated potential (slab, wire, 0D): 1/V \int_{mini BZ} v(q) on the volume quadrature
+					std::tuple<arma::mat,arma::vec> volume_quadrature=mini_brillouin_zone.pull_volume_quadrature();
+					/// the k grid does not sample the non-periodic directions (one division, prism shaped mini BZ): only the periodic component of q
+					coulomb_potential_average_g1_0=arma::dot(get<1>(volume_quadrature),coulomb_potential->pull_batch(coulomb_potential->pull_projection_periodic(get<0>(volume_quadrature))))/mini_brillouin_zone.pull_volume();
+				}
+			}
 			///TEST
 			///double coulomb_potential_average_g1_0=0.0;
 			///cout<<adding_screening<<endl;
 			if(adding_screening==1){
 				cout<<"building dielectric function "<<counting_0<<" "<<counting_gt0<<endl;
-				int counting=0;
-				arma::mat list_temporary_vectors(3,number_integration_points);
-				arma::vec temporary_vector(3);
-				std::random_device rd;
-    			std::mt19937 gen(rd());
-   				std::uniform_real_distribution<> dis(0.0,1.0); // distribution in range [0,1]
-				while(counting<number_integration_points){
-					///cout<<counting<<"MONTE-CARLO INTEGRATION  "<<endl;
-					for(int i=0;i<3;i++){
-						if(dis(gen)>0.5){
-							temporary_vector(i)=-dis(gen)*radius;
-						}else
-							temporary_vector(i)=dis(gen)*radius;
+				arma::cx_mat average_inv_epsilon(number_g_points_list,number_g_points_list,arma::fill::zeros);
+				cout<<"averaging dielectric function around 0"<<endl;
+				if(head_average_type==0){
+					/// quasi-random (or seeded pseudo-random) points in the sphere, with their weights
+					Sampling_Points sampling_points(sampling_type_integration,seed_integration);
+					std::tuple<arma::mat,arma::vec> integration_points_weights=sampling_points.pull_points_sphere(number_integration_points,radius,0);
+					arma::mat list_temporary_vectors=get<0>(integration_points_weights);
+					arma::vec integration_weights=get<1>(integration_points_weights);
+					for (int i=0; i<int(list_temporary_vectors.n_cols); i++)
+						if(norm(list_temporary_vectors.col(i),2)>minval*minval)
+							average_inv_epsilon+=integration_weights(i)*dielectric_function->pull_values(list_temporary_vectors.col(i),omega_0,eta,order_approximation,threshold_proximity);
+				}else{
+					/// head for q->0: epsilon^{-1}_00(q)=1/(\hat{q}^T L \hat{q}); L from the principal directions (+-x,+-y,+-z) and the diagonals (xy,xz,yz)
+					/// the body is the average of the six evaluations +-q (the odd wings cancel)
+					double modulus_q_head=0.25*mini_brillouin_zone.pull_inscribed_radius();
+					arma::cx_mat head_tensor(3,3,arma::fill::zeros);
+					arma::cx_mat epsilon_inv_direction(number_g_points_list,number_g_points_list);
+					arma::vec direction(3);
+					for(int a=0;a<3;a++)
+						for(int sign=-1;sign<=1;sign+=2){
+							direction.zeros();
+							direction(a)=sign*modulus_q_head;
+							epsilon_inv_direction=dielectric_function->pull_values(direction,omega_0,eta,order_approximation,threshold_proximity);
+							average_inv_epsilon+=epsilon_inv_direction/6.0;
+							head_tensor(a,a)+=0.5/epsilon_inv_direction(g_point_0,g_point_0);
+						}
+					for(int a=0;a<3;a++)
+						for(int b=a+1;b<3;b++){
+							direction.zeros();
+							direction(a)=modulus_q_head/sqrt(2.0);
+							direction(b)=modulus_q_head/sqrt(2.0);
+							epsilon_inv_direction=dielectric_function->pull_values(direction,omega_0,eta,order_approximation,threshold_proximity);
+							head_tensor(a,b)=1.0/epsilon_inv_direction(g_point_0,g_point_0)-0.5*(head_tensor(a,a)+head_tensor(b,b));
+							head_tensor(b,a)=head_tensor(a,b);
+						}
+					/// <epsilon^{-1}_00/q^2> over the mini BZ, divided by <1/q^2> (the product with coulomb_potential_average_g1_0 is used below)
+					/// truncated potentials: weights v(q) on the volume quadrature instead of 1/q^2 on the faces
+					std::tuple<arma::mat,arma::vec> quadrature;
+					arma::vec bare_weights;
+					if(coulomb_potential->pull_dimension_potential()==3){
+						quadrature=mini_brillouin_zone.pull_quadrature();
+						bare_weights=get<1>(quadrature)/arma::sum(arma::square(get<0>(quadrature)),0).t();
+					}else{
+						quadrature=mini_brillouin_zone.pull_volume_quadrature();
+						get<0>(quadrature)=coulomb_potential->pull_projection_periodic(get<0>(quadrature));
+						bare_weights=get<1>(quadrature)%coulomb_potential->pull_batch(get<0>(quadrature));
 					}
-					////inside the sphere
-					if((norm(temporary_vector,2)<=radius)&&(norm(temporary_vector,2)>minval*minval)){
-						list_temporary_vectors.col(counting)=temporary_vector;
-						counting+=1;
+					arma::cx_double average_head=0.0;
+					double average_bare=0.0;
+					for(int n=0;n<int(bare_weights.n_elem);n++){
+						arma::vec point=get<0>(quadrature).col(n);
+						double modulus_point_square=arma::dot(point,point);
+						if(modulus_point_square<minval*minval)
+							continue;
+						arma::cx_double head_point=0.0;
+						for(int a=0;a<3;a++)
+							for(int b=0;b<3;b++)
+								head_point+=point(a)*head_tensor(a,b)*point(b)/modulus_point_square;
+						average_head+=bare_weights(n)/head_point;
+						average_bare+=bare_weights(n);
 					}
+					/// (0D: no direction, the head is the one of the six evaluations)
+					if(average_bare>0.0)
+						average_inv_epsilon(g_point_0,g_point_0)=average_head/average_bare;
 				}
-				arma::cx_mat average_inv_epsilon(number_g_points_list,number_g_points_list);
-				cout<<"averaging dielectric function around 0"<<endl;
-				for (int i=0; i<number_integration_points; i++)
-					average_inv_epsilon+=dielectric_function->pull_values(list_temporary_vectors.col(i),omega_0,eta,order_approximation,threshold_proximity);
-
-				for (int s = 0; s < number_g_points_list; s++)
-					for (int k = 0; k < number_g_points_list; k++){
-						average_inv_epsilon(s,k).real(average_inv_epsilon(s,k).real()/number_integration_points);
-						average_inv_epsilon(s,k).imag(average_inv_epsilon(s,k).imag()/number_integration_points);
-					}		
 
 				cout<<"building W function taking into account diverging points"<<endl;
 				arma::cx_cube temporary_matrix(number_g_points_list,number_g_points_list,number_k_points_list*number_k_points_list);
-				for(int c = 0; c < counting_gt0; c++)	
-					temporary_matrix.subcube(0,0,k_points_differences_gt0(c),number_g_points_list-1,number_g_points_list-1,k_points_differences_gt0(c))=arma::cx_mat(dielectric_function->pull_values(k_points_differences.col(k_points_differences_gt0(c)),omega_0,eta,order_approximation,threshold_proximity));
+				for(int c = 0; c < counting_gt0; c++){
+					if(time_reversal_W==1&&int(k_points_differences_gt0(c))/number_k_points_list>int(k_points_differences_gt0(c))%number_k_points_list)
+						continue;
+					temporary_matrix.subcube(0,0,k_points_differences_gt0(c),number_g_points_list-1,number_g_points_list-1,k_points_differences_gt0(c))=arma::cx_mat(dielectric_function->pull_values(pull_k_points_difference(int(k_points_differences_gt0(c)),momentum_shift),omega_0,eta,order_approximation,threshold_proximity));
+				}
 				for(int c = 0; c < counting_0; c++)
 					temporary_matrix.subcube(0,0,k_points_differences_0(c),number_g_points_list-1,number_g_points_list-1,k_points_differences_0(c))=arma::cx_mat(average_inv_epsilon);
 			
 				//#pragma omp parallel for collapse(3)
-				for(int c = 0; c < counting_gt0; c++)
+				for(int c = 0; c < counting_gt0; c++){
+					if(time_reversal_W==1&&int(k_points_differences_gt0(c))/number_k_points_list>int(k_points_differences_gt0(c))%number_k_points_list)
+						continue;
+					k_point=pull_k_points_difference(int(k_points_differences_gt0(c)),momentum_shift);
+					coulomb_potential_g=coulomb_potential->pull_table_sqrt(k_point);
 					for (int s = 0; s < number_g_points_list; s++)
-						for (int k = 0; k < number_g_points_list; k++){								
-							coulomb_potential_average_g1=sqrt(coulomb_potential->pull(k_points_differences.col(k_points_differences_gt0(c))+g_points_list.col(s)));
-							coulomb_potential_average_g2=sqrt(coulomb_potential->pull(k_points_differences.col(k_points_differences_gt0(c))+g_points_list.col(k)));
-							v_coulomb_gg(k,s,k_points_differences_gt0(c))=temporary_matrix(k,s,k_points_differences_gt0(c))*coulomb_potential_average_g1*coulomb_potential_average_g2;
+						for (int k = 0; k < number_g_points_list; k++)
+							v_coulomb_gg(k,s,k_points_differences_gt0(c))=temporary_matrix(k,s,k_points_differences_gt0(c))*coulomb_potential_g(s)*coulomb_potential_g(k);
+				}
+				/// W(k'-k)_{G,G'}=W(k-k')_{-G',-G} (time reversal alone, no inversion symmetry needed)
+				if(time_reversal_W==1){
+					int index_checked_pair=-1;
+					for(int c = 0; c < counting_gt0; c++){
+						int i=int(k_points_differences_gt0(c))/number_k_points_list;
+						int j=int(k_points_differences_gt0(c))%number_k_points_list;
+						if(i>j){
+							for (int s = 0; s < number_g_points_list; s++)
+								for (int k = 0; k < number_g_points_list; k++)
+									v_coulomb_gg(k,s,i*number_k_points_list+j)=v_coulomb_gg(minus_g_points(s),minus_g_points(k),j*number_k_points_list+i);
+							if(index_checked_pair==-1)
+								index_checked_pair=i*number_k_points_list+j;
 						}
+					}
+					if(checking_time_reversal_W==1&&index_checked_pair>=0)
+						cout<<"time reversal W, largest difference with the direct evaluation "<<function_checking_time_reversal_W(coulomb_potential,dielectric_function,index_checked_pair,1,eta,order_approximation)<<endl;
+				}
 				//#pragma omp parallel for collapse(3)
 				for(int c = 0; c < counting_0; c++)
 					for (int s = 0; s < number_g_points_list; s++)
@@ -2700,18 +4452,19 @@ void Excitonic_Hamiltonian::pull_coulomb_potentials(Coulomb_Potential* coulomb_p
 
 				///double empirical_inv_epsilon=0.1;
 				///#pragma omp parallel for collapse(3)
-				for(int c = 0; c < counting_gt0; c++)
+				for(int c = 0; c < counting_gt0; c++){
+					k_point=pull_k_points_difference(int(k_points_differences_gt0(c)),momentum_shift);
+					coulomb_potential_g=coulomb_potential->pull_table(k_point);
 					for (int s = 0; s < number_g_points_list; s++)
 						for (int k = 0; k < number_g_points_list; k++){								
 							if(k==s){
-								coulomb_potential_average_g1=sqrt(coulomb_potential->pull(k_points_differences.col(k_points_differences_gt0(c))+g_points_list.col(s)));
-								coulomb_potential_average_g2=sqrt(coulomb_potential->pull(k_points_differences.col(k_points_differences_gt0(c))+g_points_list.col(k)));
-								v_coulomb_gg(k,s,k_points_differences_gt0(c))=empirical_inv_epsilon*coulomb_potential_average_g1*coulomb_potential_average_g2;
+								v_coulomb_gg(k,s,k_points_differences_gt0(c))=empirical_inv_epsilon*coulomb_potential_g(s);
 							}else{
 								v_coulomb_gg(k,s,k_points_differences_gt0(c)).real(0.0);
 								v_coulomb_gg(k,s,k_points_differences_gt0(c)).imag(0.0);
 							}
 						}
+				}
 				//	cout<<v_coulomb_gg.slice(k_points_differences_gt0(c))<<endl;
 
 				///#pragma omp parallel for collapse(3)
@@ -2756,6 +4509,8 @@ void Excitonic_Hamiltonian::pull_coulomb_potentials(Coulomb_Potential* coulomb_p
 	///cout<<"LONG RANGE PART W"<<endl;
 	
 	cout<<"W00 "<<v_coulomb_gg(g_point_0,g_point_0,0)<<endl;
+	/// the q of the next call (other excitonic momentum) are different: the table would grow with all the k-k' of the run
+	coulomb_potential->clear_table();
 	///cout<<"W11 "<<v_coulomb_gg<<endl;
 	///cout<<"V00 "<<v_coulomb_g(g_point_0)<<endl;
 	///cout<<"V11 "<<v_coulomb_g(0)<<endl;
@@ -2788,6 +4543,8 @@ void Excitonic_Hamiltonian::pull_resonant_part_and_rcv(arma::vec excitonic_momen
 	cout<<"building v"<<endl;
 	cout<<"beginning extracting rho"<<endl;
 	arma::vec zeros_vec(3,arma::fill::zeros);
+	///rho_cv(q) and the tiles of rho_cc(k1,k2), rho_vv(k1-q,k2-q) of the direct term share ks states and M tables
+	dipole_elements->push_rho_cache(1);
 	std::tuple<arma::cx_mat,arma::cx_mat,arma::cx_mat> energies_rho_q_diagk_cv=dipole_elements->pull_values(excitonic_momentum,zeros_vec,excitonic_momentum,1,0,1,0,0,0,threshold_proximity,small_excitonic_momentum,0);
 	rho_q_diagk_cv.submat(0,0,spin_dimension_bse_hamiltonian_2-1,number_g_points_list-1)=get<2>(energies_rho_q_diagk_cv);
 	arma::cx_mat energies_q_diff=get<0>(energies_rho_q_diagk_cv);
@@ -2808,8 +4565,7 @@ void Excitonic_Hamiltonian::pull_resonant_part_and_rcv(arma::vec excitonic_momen
 			}
 		////excluding G=0 
 		cout<<"second part"<<endl;
-		int g_point_0=int(number_g_points_list/2);
-		temporary_matrix1.row(g_point_0)=zeros_long_vec.t();
+			temporary_matrix1.row(g_point_0)=zeros_long_vec.t();
 		////cout<<rho_q_diagk_cv<<endl;
 		arma::cx_mat rho_q_diagk_cv_tmp(number_g_points_list,spin_dimension_bse_hamiltonian_2);
 		rho_q_diagk_cv_tmp=(rho_q_diagk_cv.submat(0,0,spin_dimension_bse_hamiltonian_2-1,number_g_points_list-1)).t();
@@ -2832,57 +4588,75 @@ void Excitonic_Hamiltonian::pull_resonant_part_and_rcv(arma::vec excitonic_momen
 		
 		cout<<"building w"<<endl;
 		cout<<"beginning extracting rho"<<endl;
-		arma::cx_mat rho_kk_cc=get<2>(dipole_elements->pull_values(zeros_vec,zeros_vec,zeros_vec,0,0,1,1,0,0,threshold_proximity,0,radius_convergence));
-		arma::cx_mat rho_qq_kk_vv=get<2>(dipole_elements->pull_values(zeros_vec,excitonic_momentum,excitonic_momentum,0,0,0,0,0,0,threshold_proximity,0,radius_convergence));
-		//cout<<rho_kk_cc<<endl;
-		//cout<<rho_qq_kk_vv<<endl;
-		///cout<<v_coulomb_gg<<endl;
+		///the direct term is assembled by tiles of k1: the rho_cc and rho_vv of a tile are built (while the previous one is contracted) and discarded
+		///the first tile is built outside the parallel region, so that M and the ks states enter the cache with the full parallelism
+		int number_k_points_tile=int(memory_budget_direct_term*1024.0*1024.0/(2.0*16.0*number_g_points_list*number_k_points_list*(spinorial_calculation+1)*(number_conduction_bands*number_conduction_bands+number_valence_bands*number_valence_bands)));
+		if(number_k_points_tile<1)
+			number_k_points_tile=1;
+		if(number_k_points_tile>number_k_points_list)
+			number_k_points_tile=number_k_points_list;
+		int number_tiles=(number_k_points_list+number_k_points_tile-1)/number_k_points_tile;
+		cout<<"direct term: "<<number_tiles<<" tiles of "<<number_k_points_tile<<" k points"<<endl;
+		std::tuple<arma::cx_mat,arma::cx_mat> rho_tile=function_building_direct_term_rho_tile(0,number_k_points_tile,radius_convergence);
 		cout<<"ending extracting rho"<<endl;
 		cout<<"fourth part"<<endl;
-		arma::cx_mat v_coulomb_temp(number_g_points_list,number_g_points_list,arma::fill::zeros);
-		arma::cx_mat temporary_matrix2(number_k_points_list,number_g_points_list);
-		arma::cx_vec temporary_vector2(number_conduction_bands*number_valence_bands*number_k_points_list);
 		arma::cx_double factor_w;
 		factor_w.real(-1.0/(cell_volume*number_k_points_list));
 		//factor_w.real(1.0);
 		factor_w.imag(0.0);
-		int spinv1; int spinc1;
-		for(int spin1=0;spin1<(3*spinorial_calculation+1);spin1++){
-			spinv1=exciton_spin(0,spin1);
-			spinc1=exciton_spin(1,spin1);
-			for(int c1=0;c1<number_conduction_bands;c1++)
-				for(int v1=0;v1<number_valence_bands;v1++)
-					for(int k1=0;k1<number_k_points_list;k1++){
-						for(int c2=0;c2<number_conduction_bands;c2++){
-							for(int k2=0;k2<number_k_points_list;k2++)
-								for(int s=0;s<number_g_points_list;s++){
-									temporary_matrix2(k2,s).real(0.0);
-									temporary_matrix2(k2,s).imag(0.0);
-									for(int g=0;g<number_g_points_list;g++){
-										temporary_matrix2(k2,s).real(temporary_matrix2(k2,s).real()+real(conj(rho_kk_cc(spinc1*number_conduction_bands*number_conduction_bands*number_k_points_list*number_k_points_list+c2*number_conduction_bands*number_k_points_list*number_k_points_list+c1*number_k_points_list*number_k_points_list+k2*number_k_points_list+k1,g))*(v_coulomb_gg(g,s,k2*number_k_points_list+k1))));
-										temporary_matrix2(k2,s).imag(temporary_matrix2(k2,s).imag()+imag(conj(rho_kk_cc(spinc1*number_conduction_bands*number_conduction_bands*number_k_points_list*number_k_points_list+c2*number_conduction_bands*number_k_points_list*number_k_points_list+c1*number_k_points_list*number_k_points_list+k2*number_k_points_list+k1,g))*(v_coulomb_gg(g,s,k2*number_k_points_list+k1))));
-									}
-								}
-							for(int v2=0;v2<number_valence_bands;v2++)
-								for(int k2=0;k2<number_k_points_list;k2++){
-									temporary_vector2(c2*number_valence_bands*number_k_points_list+v2*number_k_points_list+k2).real(0.0);
-									temporary_vector2(c2*number_valence_bands*number_k_points_list+v2*number_k_points_list+k2).imag(0.0);
-									for(int g=0;g<number_g_points_list;g++){
-										temporary_vector2(c2*number_valence_bands*number_k_points_list+v2*number_k_points_list+k2).real(temporary_vector2(c2*number_valence_bands*number_k_points_list+v2*number_k_points_list+k2).real()+real(factor_w*temporary_matrix2(k2,g)*(rho_qq_kk_vv(spinv1*number_valence_bands*number_valence_bands*number_k_points_list*number_k_points_list+v2*number_valence_bands*number_k_points_list*number_k_points_list+v1*number_k_points_list*number_k_points_list+k2*number_k_points_list+k1,g))));
-										temporary_vector2(c2*number_valence_bands*number_k_points_list+v2*number_k_points_list+k2).imag(temporary_vector2(c2*number_valence_bands*number_k_points_list+v2*number_k_points_list+k2).imag()+imag(factor_w*temporary_matrix2(k2,g)*(rho_qq_kk_vv(spinv1*number_valence_bands*number_valence_bands*number_k_points_list*number_k_points_list+v2*number_valence_bands*number_k_points_list*number_k_points_list+v1*number_k_points_list*number_k_points_list+k2*number_k_points_list+k1,g))));
-									}
+		for(int t=0;t<number_tiles;t++){
+			int first_k_point_tile=t*number_k_points_tile;
+			int number_k_points_current_tile=std::min(number_k_points_tile,number_k_points_list-first_k_point_tile);
+			std::tuple<arma::cx_mat,arma::cx_mat> rho_next_tile;
+			#pragma omp parallel num_threads(2)
+			#pragma omp single
+			{
+				if(t+1<number_tiles){
+					#pragma omp task shared(rho_next_tile)
+					rho_next_tile=function_building_direct_term_rho_tile((t+1)*number_k_points_tile,std::min(number_k_points_tile,number_k_points_list-(t+1)*number_k_points_tile),radius_convergence);
+				}
+				const arma::cx_mat& rho_kk_cc=get<0>(rho_tile);
+				const arma::cx_mat& rho_qq_kk_vv=get<1>(rho_tile);
+				arma::cx_mat temporary_matrix2(number_k_points_list,number_g_points_list);
+				arma::cx_vec temporary_vector2(number_conduction_bands*number_valence_bands*number_k_points_list);
+				int spinv1; int spinc1;
+				for(int spin1=0;spin1<(3*spinorial_calculation+1);spin1++){
+					spinv1=exciton_spin(0,spin1);
+					spinc1=exciton_spin(1,spin1);
+					for(int c1=0;c1<number_conduction_bands;c1++)
+						for(int v1=0;v1<number_valence_bands;v1++)
+							for(int k1=first_k_point_tile;k1<first_k_point_tile+number_k_points_current_tile;k1++){
+								for(int c2=0;c2<number_conduction_bands;c2++){
+									for(int k2=0;k2<number_k_points_list;k2++)
+										for(int s=0;s<number_g_points_list;s++){
+											temporary_matrix2(k2,s).real(0.0);
+											temporary_matrix2(k2,s).imag(0.0);
+											for(int g=0;g<number_g_points_list;g++){
+												temporary_matrix2(k2,s).real(temporary_matrix2(k2,s).real()+real(conj(rho_kk_cc(spinc1*number_conduction_bands*number_conduction_bands*number_k_points_list*number_k_points_current_tile+c2*number_conduction_bands*number_k_points_list*number_k_points_current_tile+c1*number_k_points_list*number_k_points_current_tile+k2*number_k_points_current_tile+(k1-first_k_point_tile),g))*(v_coulomb_gg(g,s,k2*number_k_points_list+k1))));
+												temporary_matrix2(k2,s).imag(temporary_matrix2(k2,s).imag()+imag(conj(rho_kk_cc(spinc1*number_conduction_bands*number_conduction_bands*number_k_points_list*number_k_points_current_tile+c2*number_conduction_bands*number_k_points_list*number_k_points_current_tile+c1*number_k_points_list*number_k_points_current_tile+k2*number_k_points_current_tile+(k1-first_k_point_tile),g))*(v_coulomb_gg(g,s,k2*number_k_points_list+k1))));
+											}
+										}
+									for(int v2=0;v2<number_valence_bands;v2++)
+										for(int k2=0;k2<number_k_points_list;k2++){
+											temporary_vector2(c2*number_valence_bands*number_k_points_list+v2*number_k_points_list+k2).real(0.0);
+											temporary_vector2(c2*number_valence_bands*number_k_points_list+v2*number_k_points_list+k2).imag(0.0);
+											for(int g=0;g<number_g_points_list;g++){
+												temporary_vector2(c2*number_valence_bands*number_k_points_list+v2*number_k_points_list+k2).real(temporary_vector2(c2*number_valence_bands*number_k_points_list+v2*number_k_points_list+k2).real()+real(factor_w*temporary_matrix2(k2,g)*(rho_qq_kk_vv(spinv1*number_valence_bands*number_valence_bands*number_k_points_list*number_k_points_current_tile+v2*number_valence_bands*number_k_points_list*number_k_points_current_tile+v1*number_k_points_list*number_k_points_current_tile+k2*number_k_points_current_tile+(k1-first_k_point_tile),g))));
+												temporary_vector2(c2*number_valence_bands*number_k_points_list+v2*number_k_points_list+k2).imag(temporary_vector2(c2*number_valence_bands*number_k_points_list+v2*number_k_points_list+k2).imag()+imag(factor_w*temporary_matrix2(k2,g)*(rho_qq_kk_vv(spinv1*number_valence_bands*number_valence_bands*number_k_points_list*number_k_points_current_tile+v2*number_valence_bands*number_k_points_list*number_k_points_current_tile+v1*number_k_points_list*number_k_points_current_tile+k2*number_k_points_current_tile+(k1-first_k_point_tile),g))));
+											}
+										}
 								}
-						}
-						excitonic_hamiltonian.submat(spin1*number_conduction_bands*number_valence_bands*number_k_points_list+c1*number_valence_bands*number_k_points_list+v1*number_k_points_list+k1,
-							spin1*number_conduction_bands*number_valence_bands*number_k_points_list,spin1*number_conduction_bands*number_valence_bands*number_k_points_list+c1*number_valence_bands*number_k_points_list+v1*number_k_points_list+k1,
-							(spin1+1)*number_conduction_bands*number_valence_bands*number_k_points_list-1)=temporary_vector2.t();
-					}
+								excitonic_hamiltonian.submat(spin1*number_conduction_bands*number_valence_bands*number_k_points_list+c1*number_valence_bands*number_k_points_list+v1*number_k_points_list+k1,
+									spin1*number_conduction_bands*number_valence_bands*number_k_points_list,spin1*number_conduction_bands*number_valence_bands*number_k_points_list+c1*number_valence_bands*number_k_points_list+v1*number_k_points_list+k1,
+									(spin1+1)*number_conduction_bands*number_valence_bands*number_k_points_list-1)=temporary_vector2.t();
+							}
+				}
+				#pragma omp taskwait
+			}
+			rho_tile=rho_next_tile;
 		}
-		rho_kk_cc.reset();
-		rho_qq_kk_vv.reset();
-		temporary_matrix2.reset();
-		temporary_vector2.reset();
 	}
+	dipole_elements->push_rho_cache(0);
 	///cout<<excitonic_hamiltonian<<endl;
 	///separated == 1 gives H00=Resonant Part H11=Coupling Part
 	///rewriting energies in order to obtain something that can be summed to the rest
@@ -2934,7 +4708,13 @@ void Excitonic_Hamiltonian::add_coupling_part(){
 	cout<<"building v"<<endl;
 	cout<<"beginning extracting rho"<<endl;
 	arma::vec zeros_vec(3,arma::fill::zeros);
-	arma::cx_mat rho_q_diagk_vc=get<2>(dipole_elements->pull_values(excitonic_momentum,-excitonic_momentum,zeros_vec,1,0,0,1,1,0,threshold_proximity,0,0));
+	///rho_vc(q) and the exchange-like blocks rho_cv(k1,k2-q), rho_vc(k1-q,k2) in one call (shared ks states and M)
+	std::vector<std::tuple<arma::vec,arma::vec,arma::vec,int,int,int,int,int,int>> blocks;
+	blocks.push_back(std::make_tuple(excitonic_momentum,arma::vec(-excitonic_momentum),zeros_vec,1,0,1,1,0,0));
+	blocks.push_back(std::make_tuple(arma::vec(-excitonic_momentum),zeros_vec,excitonic_momentum,0,1,0,0,0,0));
+	blocks.push_back(std::make_tuple(arma::vec(-excitonic_momentum),arma::vec(-excitonic_momentum),zeros_vec,0,0,1,0,0,0));
+	std::vector<std::tuple<arma::cx_mat,arma::cx_mat,arma::cx_mat>> rho_blocks=dipole_elements->pull_values_blocks(blocks,threshold_proximity);
+	arma::cx_mat rho_q_diagk_vc=get<2>(rho_blocks[0]);
 	cout<<"ending extracting rho"<<endl;
 	arma::cx_vec zeros_long_vec((spinorial_calculation+1)*number_conduction_bands*number_valence_bands*number_k_points_list,arma::fill::zeros);
 	arma::cx_mat temporary_matrix1((spinorial_calculation+1)*number_conduction_bands*number_valence_bands*number_k_points_list,number_g_points_list);
@@ -2952,7 +4732,6 @@ void Excitonic_Hamiltonian::add_coupling_part(){
 
 	cout<<"second part"<<endl;
 	////excluding G=0 maybe not needed
-	int g_point_0=int(number_g_points_list/2);
 	temporary_matrix1.col(g_point_0)=zeros_long_vec;
 	
 	arma::cx_mat rho_q_diagk_cv_tmp(spin_dimension_bse_hamiltonian_2,number_g_points_list);
@@ -2981,8 +4760,9 @@ void Excitonic_Hamiltonian::add_coupling_part(){
 	///double factor_w=-1;
 
 	cout<<"beginning extracting rho"<<endl;
-	arma::cx_mat rho_q_kk_cv=get<2>(dipole_elements->pull_values(-excitonic_momentum,zeros_vec,excitonic_momentum,0,0,1,0,0,0,threshold_proximity,0,0));
-	arma::cx_mat rho_q_kk_vc=get<2>(dipole_elements->pull_values(-excitonic_momentum,-excitonic_momentum,zeros_vec,0,0,0,1,0,0,threshold_proximity,0,0));
+	arma::cx_mat rho_q_kk_cv=get<2>(rho_blocks[1]);
+	arma::cx_mat rho_q_kk_vc=get<2>(rho_blocks[2]);
+	rho_blocks.clear();
 	cout<<"ending extracting rho"<<endl;
 
 	arma::cx_mat temporary_matrix3(number_k_points_list,number_g_points_list);
@@ -3486,7 +5266,6 @@ std::tuple<arma::cx_vec,arma::cx_mat> Excitonic_Hamiltonian::common_diagonalizat
 std::tuple<arma::cx_vec,arma::cx_vec> Excitonic_Hamiltonian::pull_excitonic_oscillator_force(arma::cx_mat excitonic_eigenstates,int tamn_dancoff,int ipa){
 	arma::cx_vec oscillator_force_l(spin_dimension_bse_hamiltonian_2,arma::fill::zeros);
 	///cout<<excitonic_eigenstates<<endl;
-	int g_point_0=int(number_g_points_list/2);
 	if((tamn_dancoff==1)||(ipa==1)){
 		for(int i=0;i<spin_dimension_bse_hamiltonian_2;i++)
 			oscillator_force_l(i)=arma::accu(arma::conj(rho_q_diagk_cv.col(g_point_0))%excitonic_eigenstates.col(i+spin_dimension_bse_hamiltonian_2*(1-tamn_dancoff)));
@@ -3713,9 +5492,21 @@ int main(int argc, char** argv){
 	string file_k_points_name="k_points_list_si.dat";
 	int number_k_points_list=1000;
 	int crystal_coordinates=1;
+	/// 0 from file, 1 pseudo-random, 2 Sobol, 3 rank-1 lattice, 4 stratified
 	int random_generator=1;
+	unsigned long long seed=1;
+	/// periodic directions (1) and non-periodic ones (0, i.e. the vacuum direction of a slab), dimension 3 for bulk
+	int dimension_system=3;
+	arma::vec direction_cutting(3); direction_cutting(0)=1; direction_cutting(1)=1; direction_cutting(2)=1;
+	/// regular grid from the spacing (only the periodic directions are sampled when dimension_system<3)
+	int k_points_from_spacing=0;
+	double spacing_k_points=0.2;
 	K_points k_points(&crystal,shift,number_k_points_list);
-	k_points.push_k_points_list_values(file_k_points_name,crystal_coordinates,random_generator);
+	if(k_points_from_spacing==1)
+		k_points.push_k_points_list_values(spacing_k_points,dimension_system,direction_cutting);
+	else
+		k_points.push_k_points_list_values(file_k_points_name,crystal_coordinates,random_generator,seed);
+	number_k_points_list=k_points.pull_number_k_points_list();
 	arma::mat k_points_list=k_points.pull_k_points_list_values();
 	k_points.print();
 	arma::mat primitive_vectors=k_points.pull_primitive_vectors();
@@ -3724,18 +5515,22 @@ int main(int argc, char** argv){
 	arma::vec shift_g; shift_g.zeros(3);
 	//double cutoff_g_points_list=2;
 	double cutoff_g_points_list=1;
-	int dimension_g_points_list=3;
-	arma::vec direction_cutting(3); direction_cutting(0)=1; direction_cutting(1)=1; direction_cutting(2)=1;
-	G_points g_points(&crystal,cutoff_g_points_list,dimension_g_points_list,direction_cutting,shift_g);
+	/// 0 box, 1 sphere |G|<=cutoff, 2 kinetic energy (eV)
+	int cutoff_type_g_points_list=0;
+	int dimension_g_points_list=dimension_system;
+	/// G along the non-periodic directions (on each side), used only when dimension_g_points_list<3
+	int number_g_points_out_of_plane=0;
+	G_points g_points(&crystal,cutoff_g_points_list,cutoff_type_g_points_list,dimension_g_points_list,direction_cutting,shift_g,number_g_points_out_of_plane);
 	arma::mat g_points_list=g_points.pull_g_points_list_values(); 
 	int number_g_points_list=g_points.pull_number_g_points_list();
 	cout<<"G points: "<<number_g_points_list<<endl;
-	int g_point0=int(number_g_points_list/2);
+	int g_point0=g_points.pull_g_point_0();
 	cout<<g_points_list.col(g_point0)<<endl;
 	g_points.print();
 
 	//////Initializing Coulomb potential
 	double minimum_k_point_modulus=0.0;
+	/// 3 bulk, otherwise truncated on the directions with direction_cutting=0 (2 slab, 1 wire, 0 molecule)
 	int dimension_potential=3;
 	double radius=0.0;
 	Coulomb_Potential coulomb_potential(&k_points,&g_points,minimum_k_point_modulus,dimension_potential,direction_cutting,volume,radius);
@@ -3772,7 +5567,8 @@ int main(int argc, char** argv){
 	///string bands_file_name="bands.data";
 	///string k_points_bands_file_name="k_points_bands.data";
 	///int number_k_points_bands=3;
-	///htb.pull_bands(bands_file_name,k_points_bands_file_name,number_k_points_bands,4,4,crystal_coordinates,primitive_vectors);
+	///int binary_output=0;
+	///htb.pull_bands(bands_file_name,k_points_bands_file_name,number_k_points_bands,4,4,crystal_coordinates,primitive_vectors,binary_output);
 
 	//////Initializing dipole elements
 	int number_conduction_bands_selected_diel=2;
@@ -3806,19 +5602,64 @@ int main(int argc, char** argv){
 	number_primitive_cells_integration(0)=3;
 	number_primitive_cells_integration(1)=3;
 	number_primitive_cells_integration(2)=3;
+	/// no periodic images along the non-periodic directions
+	if(dimension_system<3)
+		for(int r=0;r<3;r++)
+			if(direction_cutting(r)==0)
+				number_primitive_cells_integration(r)=1;
 	
 	double radius_building_kernel=0.2;
 	///not implemente this radius threhsold
 	double threshold_building_kernel=1.0e-2;
-	Dipole_Elements dipole_elements(number_k_points_list,k_points_list,number_g_points_list,g_points_list,number_wannier_centers,number_valence_bands_selected,number_conduction_bands_selected,&htb,spinorial_calculation,&real_space_wannier,number_primitive_cells_integration,number_unit_cells_supercell,number_points_real_space_grid,radius_building_kernel,threshold_building_kernel);
 	arma::vec zeros(3,arma::fill::zeros);
 	arma::vec excitonic_momentum(3,arma::fill::zeros);
 	excitonic_momentum(0)=minval;
+	arma::cx_double omega; omega.real(0.0); omega.imag(0.0); 
+	double eta=0.0; 
+	double threshold_proximity=0.1;
+	/// adding G shells to the local fields until epsilon_M(omega) changes less than tolerance_g_shells, on a first set of objects with the whole G list;
+	/// the G list (and the Coulomb table) are then cut to the converged shells, used by the dipole elements, the dielectric function and the BSE below
+	int converging_g_shells=0;
+	double tolerance_g_shells=1.0e-3;
+	if(converging_g_shells==1){
+		Dipole_Elements dipole_elements_g_shells(number_k_points_list,k_points_list,number_g_points_list,g_points_list,number_wannier_centers,number_valence_bands_selected,number_conduction_bands_selected,&htb,spinorial_calculation,&real_space_wannier,number_primitive_cells_integration,radius_building_kernel,threshold_building_kernel);
+		Dielectric_Function dielectric_function_g_shells(&dipole_elements_g_shells,number_k_points_list,number_g_points_list,g_points_list,number_valence_bands_selected_diel,number_conduction_bands_selected_diel,&coulomb_potential,spinorial_calculation,volume);
+		std::tuple<int,arma::cx_double> converged_g_shells=dielectric_function_g_shells.pull_converged_g_shells(excitonic_momentum,omega,eta,threshold_proximity,tolerance_g_shells);
+		cout<<"converged number G "<<get<0>(converged_g_shells)<<" epsilon_M "<<get<1>(converged_g_shells)<<endl;
+		g_points.push_number_g_points_list(get<0>(converged_g_shells));
+		coulomb_potential.push_g_points(&g_points);
+		g_points_list=g_points.pull_g_points_list_values();
+		number_g_points_list=g_points.pull_number_g_points_list();
+		g_point0=g_points.pull_g_point_0();
+	}
+	Dipole_Elements dipole_elements(number_k_points_list,k_points_list,number_g_points_list,g_points_list,number_wannier_centers,number_valence_bands_selected,number_conduction_bands_selected,&htb,spinorial_calculation,&real_space_wannier,number_primitive_cells_integration,radius_building_kernel,threshold_building_kernel);
+	/// states at k-q from the ones at k through k.p, when |q| is below the threshold (0 full diagonalization at k-q)
+	int perturbative_small_momentum=0;
+	double threshold_perturbative_momentum=1.0e-3;
+	double threshold_perturbative_degeneracy=1.0e-4;
+	dipole_elements.push_perturbative_small_momentum(perturbative_small_momentum,threshold_perturbative_momentum,threshold_perturbative_degeneracy);
+	/// time reversal H(-k)=H(k)^* (no spin, real H_R): only one k point of each pair (k,-k) is diagonalized
+	int time_reversal_symmetry=htb.pull_time_reversal_symmetry(minval);
+	double resolution_folding=1.0e-6;
+	if(time_reversal_symmetry==1){
+		k_points.push_time_reversal_partners(resolution_folding);
+		dipole_elements.push_time_reversal_symmetry(time_reversal_symmetry,k_points.pull_time_reversal_partners());
+	}
+	/// reusing the ks states of a previous run on a nested (coarser) grid (W is always recalculated, it depends on the grid through chi0)
+	int reusing_nested_grid=0;
+	Ks_States_Store ks_states_store("ks_states_store");
+	if(reusing_nested_grid==1){
+		ks_states_store.load(&k_points,resolution_folding,htb_basis_dimension,number_wannier_centers);
+		dipole_elements.push_ks_states_store(&ks_states_store);
+	}
+	/// fast screening: M replaced by the phases on the wannier centers (point dipoles)
+	int point_dipole_approximation=0;
+	dipole_elements.push_point_dipole_approximation(point_dipole_approximation);
+	/// the small q moments of the wannier functions are saved next to the xsf files and read by the following runs
+	dipole_elements.push_small_q_moments_file_name(seedname_files_xsf);
 	///dipole_elements.print(excitonic_momentum,zeros,zeros,1,0,0,0,0.0);
 	/////////Initializing dielectric function
 	Dielectric_Function dielectric_function(&dipole_elements,number_k_points_list,number_g_points_list,g_points_list,number_valence_bands_selected_diel,number_conduction_bands_selected_diel,&coulomb_potential,spinorial_calculation,volume);
-	arma::cx_double omega; omega.real(0.0); omega.imag(0.0); 
-	double eta=0.0; 
 	int order_approximation=0;
 	int number_omegas_path=3200;
 	arma::cx_vec omegas_path(number_omegas_path);
@@ -3833,9 +5674,19 @@ int main(int argc, char** argv){
 	int tamn_dancoff=1;
 	int ipa=1;
 	int insulator_metal=0;
-	double threshold_proximity=0.1;
-	arma::mat k_points_differences=k_points.pull_k_point_differences();
-	Excitonic_Hamiltonian htbse(number_valence_bands_selected,number_conduction_bands_selected,k_points_list,number_k_points_list,g_points_list,number_g_points_list,spinorial_calculation,htb_basis_dimension,&dipole_elements,volume,tamn_dancoff,insulator_metal,k_points_differences,threshold_proximity);
+	Excitonic_Hamiltonian htbse(number_valence_bands_selected,number_conduction_bands_selected,k_points_list,number_k_points_list,g_points_list,number_g_points_list,spinorial_calculation,htb_basis_dimension,&dipole_elements,volume,tamn_dancoff,insulator_metal,threshold_proximity);
+	/// 1: prints the difference between a slice of W obtained by time reversal and the direct one (check on crystals without inversion)
+	int checking_time_reversal_W=0;
+	htbse.push_time_reversal_symmetry(time_reversal_symmetry,checking_time_reversal_W);
+	/// points for the average of epsilon around q=0: 0 pseudo-random, 1 Sobol, 2 rank-1 lattice, 3 stratified
+	int sampling_type_integration=1;
+	htbse.push_sampling_integration(sampling_type_integration,seed);
+	/// average of W around q=0: 0 sampled sphere (sampling_type_integration), 1 quadrature on the mini BZ of the k grid
+	int head_average_type=1;
+	htbse.push_head_average(head_average_type,k_points.pull_mini_brillouin_zone_vectors());
+	/// memory (MB) for the tiles of k-pair rho of the direct term
+	double memory_budget_direct_term=1024.0;
+	htbse.push_memory_budget_direct_term(memory_budget_direct_term);
 	///cout<<bravais_lattice<<endl;
 	int reading_W=0;
 	int number_integration_points=4;